@@ -0,0 +1,52 @@
+/*
+	Allocation trace file of Corelan_HeapLog (-recordtrace 1), replayed by heaplog_replay
+
+	A header, followed by one record per heap operation, in the order the drain processed
+	them (cycle counter order across threads). Objects are numbered in order of allocation,
+	starting at 1. A realloc keeps the number of the object it resizes, also when the chunk
+	moves, so every record is tied to its allocation without looking at addresses, and a
+	replay can run it against any allocator. Page level operations (VirtualAlloc, mmap,
+	munmap) are not recorded.
+
+	Include pin.H (or define UINT8, UINT16, UINT32 and UINT64) before including this file.
+
+	Same license as Corelan_HeapLog.cpp
+*/
+
+#ifndef ALLOCTRACE_H
+#define ALLOCTRACE_H
+
+#define ALLOC_TRACE_MAGIC "CHAT"
+#define ALLOC_TRACE_VERSION 1
+
+struct ALLOC_TRACE_HEADER
+{
+	char magic[4];
+	UINT32 version;
+	UINT32 pid;
+	UINT32 nrthreads;			// highest thread number in the trace, plus one
+	UINT64 nrrecords;			// 0 if the trace wasn't closed properly, the records go up to the end of the file
+	UINT64 nrobjects;
+};
+
+enum ALLOC_TRACE_OP
+{
+	TRACE_MALLOC = 0,
+	TRACE_CALLOC,				// zeroed memory
+	TRACE_REALLOC,
+	TRACE_FREE
+};
+
+struct ALLOC_TRACE_RECORD
+{
+	UINT64 objectid;
+	UINT32 size;				// requested size, 0 for a free
+	UINT16 thread;				// Pin thread id of the caller
+	UINT8 op;					// ALLOC_TRACE_OP
+	UINT8 alignshift;			// log2 of the requested alignment, 0 for the allocator's default
+};
+
+static_assert(sizeof(ALLOC_TRACE_HEADER) == 32, "ALLOC_TRACE_HEADER is part of the file format");
+static_assert(sizeof(ALLOC_TRACE_RECORD) == 16, "ALLOC_TRACE_RECORD is part of the file format");
+
+#endif
@@ -0,0 +1,536 @@
+/*
+	Block compressed log files of Corelan_HeapLog (-compress 1), and the codec they use
+
+	The log text is cut into blocks of a fixed size, every block is compressed on its own
+	with an LZ4 compatible block codec, and an index of all blocks is appended when the
+	file is closed. The index has the time of the first and last heap event and the range
+	of chunk addresses logged in every block, so a reader can seek to a time range or an
+	address without decompressing the whole file.
+
+	File layout, all numbers little endian:
+		BLOCK_FILE_HEADER
+		BLOCK_HEADER + data, for every block (data is stored as is if it didn't compress)
+		BLOCK_INDEX_ENTRY for every block
+		BLOCK_FILE_TRAILER
+	Every block header has the same information as its index entry, so the blocks of a file
+	that was never closed properly can still be found by walking them from the start.
+
+	Kept out of Corelan_HeapLog.cpp so hlz_reader.cpp can use it without Pin.
+	Include pin.H (or define UINT8, UINT32, INT64 and UINT64) before including this file.
+
+	Same license as Corelan_HeapLog.cpp
+*/
+
+#ifndef BLOCKFILE_H
+#define BLOCKFILE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define BLOCK_FILE_MAGIC "CHLZ"
+#define BLOCK_FILE_TRAILER_MAGIC "CHLE"
+#define BLOCK_FILE_VERSION 1
+
+// seek with a 64 bit offset, logs easily grow past 2 GB
+// (define _FILE_OFFSET_BITS 64 before any include to get a 64 bit off_t on 32 bit Linux)
+inline int seekBlockFile(FILE* file, INT64 offset, int whence)
+{
+#if defined(_WIN32)
+	return _fseeki64(file, offset, whence);
+#else
+	return fseeko(file, (off_t) offset, whence);
+#endif
+}
+
+struct BLOCK_FILE_HEADER
+{
+	char magic[4];				// BLOCK_FILE_MAGIC
+	UINT32 version;
+	UINT32 blocksize;			// uncompressed size of every block but the last one
+	UINT32 reserved;
+};
+
+// what a block (or a part of one) contains
+struct BLOCK_META
+{
+	UINT64 firsttime;			// wall clock time of the first and last heap event, in microseconds since 1970
+	UINT64 lasttime;			// both 0 if there are no heap events
+	UINT64 minaddr;				// lowest chunk start and highest chunk end, both 0 if there are no heap events
+	UINT64 maxaddr;
+};
+
+struct BLOCK_HEADER
+{
+	BLOCK_META meta;
+	UINT32 compressedsize;		// equal to rawsize if the block is stored uncompressed
+	UINT32 rawsize;
+	UINT32 linestart;			// offset of the first line that starts in this block, rawsize if there is none
+	UINT32 reserved;
+};
+
+struct BLOCK_INDEX_ENTRY
+{
+	UINT64 offset;				// file offset of the BLOCK_HEADER
+	BLOCK_HEADER header;
+};
+
+struct BLOCK_FILE_TRAILER
+{
+	UINT64 indexoffset;
+	UINT32 nrblocks;
+	char magic[4];				// BLOCK_FILE_TRAILER_MAGIC
+};
+
+static_assert(sizeof(BLOCK_HEADER) == 48, "BLOCK_HEADER should be 48 bytes");
+static_assert(sizeof(BLOCK_INDEX_ENTRY) == 56, "BLOCK_INDEX_ENTRY should be 56 bytes");
+static_assert(sizeof(BLOCK_FILE_TRAILER) == 16, "BLOCK_FILE_TRAILER should be 16 bytes");
+
+
+inline void clearBlockMeta(BLOCK_META& meta)
+{
+	memset(&meta, 0, sizeof(meta));
+}
+
+// add what other describes to meta
+inline void mergeBlockMeta(BLOCK_META& meta, const BLOCK_META& other)
+{
+	if (other.firsttime != 0 && (meta.firsttime == 0 || other.firsttime < meta.firsttime))
+	{
+		meta.firsttime = other.firsttime;
+	}
+	if (other.lasttime > meta.lasttime)
+	{
+		meta.lasttime = other.lasttime;
+	}
+	if (other.maxaddr != 0)
+	{
+		if (meta.maxaddr == 0 || other.minaddr < meta.minaddr)
+		{
+			meta.minaddr = other.minaddr;
+		}
+		if (other.maxaddr > meta.maxaddr)
+		{
+			meta.maxaddr = other.maxaddr;
+		}
+	}
+}
+
+
+/* ================================================================== */
+// LZ4 block format: sequences of a token (literal length << 4 | match length - 4), extra
+// literal length bytes, the literals, a 16 bit match offset and extra match length bytes.
+// The compressor is a greedy single probe hash match finder, which is what makes LZ4 fast
+/* ================================================================== */
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5		// a block always ends with at least this many literals
+#define LZ_MATCH_LIMIT 12		// and the last match starts at least this far from the end
+#define LZ_MAX_OFFSET 0xffff
+
+// worst case compressed size of len bytes
+inline size_t lzCompressBound(size_t len)
+{
+	return len + len / 255 + 16;
+}
+
+inline UINT32 lzRead32(const UINT8* p)
+{
+	UINT32 value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+inline UINT32 lzHash(UINT32 sequence)
+{
+	return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+inline UINT8* lzWriteLength(UINT8* out, size_t length)
+{
+	for (; length >= 255; length -= 255)
+	{
+		*out++ = 255;
+	}
+	*out++ = (UINT8) length;
+	return out;
+}
+
+inline UINT8* lzWriteSequence(UINT8* out, const UINT8* literals, size_t nrliterals, UINT32 offset, size_t matchlength)
+{
+	UINT8* token = out++;
+	*token = (UINT8) ((nrliterals >= 15 ? 15 : nrliterals) << 4);
+	if (nrliterals >= 15)
+	{
+		out = lzWriteLength(out, nrliterals - 15);
+	}
+	memcpy(out, literals, nrliterals);
+	out += nrliterals;
+	if (matchlength == 0)
+	{
+		// last literals
+		return out;
+	}
+	*out++ = (UINT8) offset;
+	*out++ = (UINT8) (offset >> 8);
+	matchlength -= LZ_MIN_MATCH;
+	*token |= (UINT8) (matchlength >= 15 ? 15 : matchlength);
+	if (matchlength >= 15)
+	{
+		out = lzWriteLength(out, matchlength - 15);
+	}
+	return out;
+}
+
+// compress len bytes of in into out, which must hold lzCompressBound(len) bytes.
+// table is scratch space of 1 << LZ_HASH_BITS entries. Returns the compressed size
+inline size_t lzCompress(const UINT8* in, size_t len, UINT8* out, UINT32* table)
+{
+	const UINT8* anchor = in;
+	const UINT8* end = in + len;
+	UINT8* op = out;
+	if (len > LZ_MATCH_LIMIT)
+	{
+		const UINT8* matchstart = end - LZ_MATCH_LIMIT;
+		const UINT8* matchend = end - LZ_LAST_LITERALS;
+		memset(table, 0, sizeof(UINT32) << LZ_HASH_BITS);
+		const UINT8* ip = in + 1;
+		UINT32 misses = 0;
+		while (ip < matchstart)
+		{
+			UINT32 sequence = lzRead32(ip);
+			UINT32 h = lzHash(sequence);
+			const UINT8* ref = in + table[h];
+			table[h] = (UINT32) (ip - in);
+			if (ip - ref > LZ_MAX_OFFSET || lzRead32(ref) != sequence)
+			{
+				// skip ahead faster through data that doesn't compress
+				ip += 1 + (misses++ >> 6);
+				continue;
+			}
+			misses = 0;
+			while (ip > anchor && ref > in && ip[-1] == ref[-1])
+			{
+				ip--;
+				ref--;
+			}
+			size_t matchlength = LZ_MIN_MATCH;
+			while (ip + matchlength < matchend && ip[matchlength] == ref[matchlength])
+			{
+				matchlength++;
+			}
+			op = lzWriteSequence(op, anchor, ip - anchor, (UINT32) (ip - ref), matchlength);
+			ip += matchlength;
+			anchor = ip;
+			if (ip < matchstart)
+			{
+				table[lzHash(lzRead32(ip - 2))] = (UINT32) (ip - 2 - in);
+			}
+		}
+	}
+	op = lzWriteSequence(op, anchor, end - anchor, 0, 0);
+	return op - out;
+}
+
+// decompress a block of len bytes into exactly rawsize bytes at out. Checks every length
+// against both buffers, returns false if the block is damaged
+inline bool lzDecompress(const UINT8* in, size_t len, UINT8* out, size_t rawsize)
+{
+	const UINT8* ip = in;
+	const UINT8* end = in + len;
+	UINT8* op = out;
+	UINT8* outend = out + rawsize;
+	while (ip < end)
+	{
+		UINT32 token = *ip++;
+		size_t length = token >> 4;
+		if (length == 15)
+		{
+			UINT8 more;
+			do
+			{
+				if (ip >= end)
+				{
+					return false;
+				}
+				more = *ip++;
+				length += more;
+			}
+			while (more == 255);
+		}
+		if (length > (size_t) (end - ip) || length > (size_t) (outend - op))
+		{
+			return false;
+		}
+		memcpy(op, ip, length);
+		ip += length;
+		op += length;
+		if (ip == end)
+		{
+			// the last sequence has no match
+			break;
+		}
+		if (end - ip < 2)
+		{
+			return false;
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t) (op - out))
+		{
+			return false;
+		}
+		length = token & 15;
+		if (length == 15)
+		{
+			UINT8 more;
+			do
+			{
+				if (ip >= end)
+				{
+					return false;
+				}
+				more = *ip++;
+				length += more;
+			}
+			while (more == 255);
+		}
+		length += LZ_MIN_MATCH;
+		if (length > (size_t) (outend - op))
+		{
+			return false;
+		}
+		// matches may overlap what they produce, copy byte by byte
+		const UINT8* ref = op - offset;
+		for (size_t i = 0; i < length; i++)
+		{
+			op[i] = ref[i];
+		}
+		op += length;
+	}
+	return op == outend;
+}
+
+
+// Writes a block compressed log file. Not thread safe, the caller serializes access
+class CBlockFileWriter
+{
+public:
+	CBlockFileWriter()
+	{
+		file = NULL;
+		block = NULL;
+		compressed = NULL;
+		table = NULL;
+		blocksize = 0;
+		used = 0;
+		offset = 0;
+		rawbytes = 0;
+		atlinestart = true;
+	}
+
+	~CBlockFileWriter()
+	{
+		delete[] block;
+		delete[] compressed;
+		delete[] table;
+	}
+
+	// start a new file, LogF must be empty and opened in binary mode
+	void open(FILE* LogF, UINT32 size)
+	{
+		file = LogF;
+		blocksize = size;
+		block = new char[blocksize];
+		compressed = new UINT8[lzCompressBound(blocksize)];
+		table = new UINT32[1 << LZ_HASH_BITS];
+		BLOCK_FILE_HEADER header;
+		memcpy(header.magic, BLOCK_FILE_MAGIC, sizeof(header.magic));
+		header.version = BLOCK_FILE_VERSION;
+		header.blocksize = blocksize;
+		header.reserved = 0;
+		fwrite(&header, sizeof(header), 1, file);
+		offset = sizeof(header);
+		startBlock();
+	}
+
+	// add log text. meta describes all of it, NULL if it has no heap events
+	void write(const char * data, size_t len, const BLOCK_META* meta)
+	{
+		while (len > 0)
+		{
+			size_t part = (len < blocksize - used) ? len : blocksize - used;
+			memcpy(block + used, data, part);
+			if (header.linestart == NOT_YET)
+			{
+				const char * newline = (const char *) memchr(data, '\n', part);
+				if (newline != NULL)
+				{
+					header.linestart = used + (UINT32) (newline - data) + 1;
+				}
+			}
+			if (meta != NULL)
+			{
+				mergeBlockMeta(header.meta, *meta);
+			}
+			used += (UINT32) part;
+			atlinestart = (data[part - 1] == '\n');
+			data += part;
+			len -= part;
+			if (used == blocksize)
+			{
+				writeBlock();
+			}
+		}
+	}
+
+	// write the last block, the index and the trailer. The caller closes the file
+	void close()
+	{
+		if (file == NULL)
+		{
+			return;
+		}
+		if (used > 0)
+		{
+			writeBlock();
+		}
+		BLOCK_FILE_TRAILER trailer;
+		trailer.indexoffset = offset;
+		trailer.nrblocks = (UINT32) index.size();
+		memcpy(trailer.magic, BLOCK_FILE_TRAILER_MAGIC, sizeof(trailer.magic));
+		if (!index.empty())
+		{
+			fwrite(&index[0], sizeof(BLOCK_INDEX_ENTRY), index.size(), file);
+		}
+		fwrite(&trailer, sizeof(trailer), 1, file);
+		file = NULL;
+	}
+
+	UINT64 getRawBytes() const
+	{
+		return rawbytes;
+	}
+
+	UINT64 getFileBytes() const
+	{
+		return offset;
+	}
+
+private:
+	static const UINT32 NOT_YET = 0xffffffff;
+
+	FILE* file;
+	char* block;				// uncompressed text of the current block
+	UINT32 blocksize;
+	UINT32 used;
+	BLOCK_HEADER header;		// of the current block
+	UINT8* compressed;
+	UINT32* table;				// hash table of the compressor
+	UINT64 offset;				// of the next block in the file
+	UINT64 rawbytes;
+	bool atlinestart;			// the last byte written was a newline
+	std::vector<BLOCK_INDEX_ENTRY> index;
+
+	void startBlock()
+	{
+		used = 0;
+		clearBlockMeta(header.meta);
+		header.linestart = atlinestart ? 0 : NOT_YET;
+		header.reserved = 0;
+	}
+
+	void writeBlock()
+	{
+		size_t size = lzCompress((const UINT8*) block, used, compressed, table);
+		const void* data = compressed;
+		if (size >= used)
+		{
+			size = used;
+			data = block;
+		}
+		header.compressedsize = (UINT32) size;
+		header.rawsize = used;
+		if (header.linestart == NOT_YET)
+		{
+			header.linestart = used;
+		}
+		BLOCK_INDEX_ENTRY entry;
+		entry.offset = offset;
+		entry.header = header;
+		index.push_back(entry);
+		fwrite(&header, sizeof(header), 1, file);
+		fwrite(data, 1, size, file);
+		offset += sizeof(header) + size;
+		rawbytes += used;
+		startBlock();
+	}
+};
+
+
+// Reads the blocks of a block compressed log file in order, for tools that stream through it.
+// Stops at the block index, or at the first damaged or missing block of a file that wasn't closed
+class CBlockFileReader
+{
+public:
+	CBlockFileReader()
+	{
+		file = NULL;
+		offset = 0;
+		end = 0;
+	}
+
+	// false if LogF isn't a block compressed log file
+	bool open(FILE* LogF)
+	{
+		file = LogF;
+		if (fread(&header, sizeof(header), 1, file) != 1 ||
+			memcmp(header.magic, BLOCK_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != BLOCK_FILE_VERSION)
+		{
+			return false;
+		}
+		offset = sizeof(header);
+		end = ~(UINT64) 0;
+		BLOCK_FILE_TRAILER trailer;
+		if (seekBlockFile(file, -(INT64) sizeof(trailer), SEEK_END) == 0 && fread(&trailer, sizeof(trailer), 1, file) == 1 &&
+			memcmp(trailer.magic, BLOCK_FILE_TRAILER_MAGIC, sizeof(trailer.magic)) == 0)
+		{
+			end = trailer.indexoffset;
+		}
+		return seekBlockFile(file, (INT64) offset, SEEK_SET) == 0;
+	}
+
+	// text of the next block, false at the end
+	bool next(std::vector<char>& text)
+	{
+		BLOCK_HEADER block;
+		if (offset >= end || fread(&block, sizeof(block), 1, file) != 1 ||
+			block.rawsize == 0 || block.rawsize > header.blocksize || block.compressedsize > block.rawsize)
+		{
+			return false;
+		}
+		compressed.resize(block.compressedsize);
+		text.resize(block.rawsize);
+		if (fread(&compressed[0], 1, compressed.size(), file) != compressed.size())
+		{
+			return false;
+		}
+		offset += sizeof(block) + block.compressedsize;
+		if (block.compressedsize == block.rawsize)
+		{
+			memcpy(&text[0], &compressed[0], text.size());
+			return true;
+		}
+		return lzDecompress(&compressed[0], compressed.size(), (UINT8*) &text[0], text.size());
+	}
+
+private:
+	FILE* file;
+	BLOCK_FILE_HEADER header;
+	UINT64 offset;				// of the next block
+	UINT64 end;					// of the last block
+	std::vector<UINT8> compressed;
+};
+
+#endif
@@ -0,0 +1,395 @@
+/*
+	Live and freed heap chunks of Corelan_HeapLog, in a sharded open addressing table
+
+	Kept out of Corelan_HeapLog.cpp so chunktable_bench.cpp can measure it without Pin.
+	Include pin.H (or define ADDRINT, UINT32 and UINT64) before including this file,
+	and define CHUNKTABLE_YIELD() to give up the cpu while waiting for a lock.
+
+	Same license as Corelan_HeapLog.cpp
+*/
+
+#ifndef CHUNKTABLE_H
+#define CHUNKTABLE_H
+
+#include <atomic>
+#include <string.h>
+#include <emmintrin.h>
+#include <vector>
+
+#ifndef CHUNKTABLE_YIELD
+#define CHUNKTABLE_YIELD()
+#endif
+
+// pause loops before a waiting thread yields, the lock holder may not be running
+#define SPIN_BEFORE_YIELD 64
+
+
+// Spin lock for the very short critical sections of a shard (a probe or two)
+class CSpinLock
+{
+public:
+	CSpinLock()
+	{
+		locked = false;
+	}
+
+	void lock()
+	{
+		while (locked.exchange(true, std::memory_order_acquire))
+		{
+			// wait without hammering the cache line with writes
+			for (UINT32 spins = 0; locked.load(std::memory_order_relaxed); spins++)
+			{
+				if (spins < SPIN_BEFORE_YIELD)
+				{
+					_mm_pause();
+				}
+				else
+				{
+					CHUNKTABLE_YIELD();
+				}
+			}
+		}
+	}
+
+	void unlock()
+	{
+		locked.store(false, std::memory_order_release);
+	}
+
+private:
+	std::atomic<bool> locked;
+};
+
+
+enum CHUNK_STATE
+{
+	CHUNK_UNKNOWN = 0,		// empty slot, or a chunk we don't know about
+	CHUNK_LIVE,
+	CHUNK_FREED,
+	CHUNK_DELETED			// slot of a chunk that was forgotten, probes continue past it
+};
+
+struct CHUNK_SLOT
+{
+	UINT64 start;
+	UINT32 size;
+	UINT32 state : 2;		// CHUNK_STATE
+	UINT32 site : 30;		// allocation site of live chunks, chosen by the caller
+};
+
+static_assert(sizeof(CHUNK_SLOT) == 16, "CHUNK_SLOT should be 16 bytes");
+
+#define CHUNK_TABLE_SHARD_BITS 6
+#define CHUNK_TABLE_SHARDS (1 << CHUNK_TABLE_SHARD_BITS)
+#define CHUNK_TABLE_MIN_SLOTS 1024				// per shard, must be a power of 2
+
+struct CHUNK_SHARD
+{
+	CHUNK_SLOT* slots;
+	UINT32 mask;			// number of slots - 1
+	UINT32 used;			// slots that aren't empty, including deleted ones
+	UINT32 live;
+	UINT32 freed;
+	CSpinLock lock;
+	char padding[64 - sizeof(CHUNK_SLOT*) - 4 * sizeof(UINT32) - sizeof(CSpinLock)];
+};
+
+
+// One entry per chunk start address, with the size of live chunks, and freed chunks remembered
+// for double free detection. Linear probing in flat arrays of 16 byte slots, so most operations
+// touch a single cache line. The address hash picks one of 64 shards, each with its own lock,
+// so application threads rarely wait for each other
+class CChunkTable
+{
+public:
+	CChunkTable()
+	{
+		for (UINT32 i = 0; i < CHUNK_TABLE_SHARDS; i++)
+		{
+			CHUNK_SHARD& shard = shards[i];
+			shard.slots = newSlots(CHUNK_TABLE_MIN_SLOTS);
+			shard.mask = CHUNK_TABLE_MIN_SLOTS - 1;
+			shard.used = 0;
+			shard.live = 0;
+			shard.freed = 0;
+		}
+	}
+
+	~CChunkTable()
+	{
+		for (UINT32 i = 0; i < CHUNK_TABLE_SHARDS; i++)
+		{
+			delete[] shards[i].slots;
+		}
+	}
+
+	// chunk allocated (or reallocated) at start, from site. Returns the state it was in before,
+	// and its size in previoussize if it was live
+	UINT32 allocated(ADDRINT start, UINT32 size, UINT32 site, UINT32* previoussize = NULL)
+	{
+		UINT32 hash = hashAddress(start);
+		CHUNK_SHARD& shard = shards[hash & (CHUNK_TABLE_SHARDS - 1)];
+		shard.lock.lock();
+		CHUNK_SLOT* slot = findOrInsert(shard, hash, start);
+		UINT32 previous = slot->state;
+		if (previous == CHUNK_LIVE && previoussize != NULL)
+		{
+			*previoussize = slot->size;
+		}
+		setState(shard, *slot, CHUNK_LIVE);
+		slot->size = size;
+		slot->site = site;
+		shard.lock.unlock();
+		return previous;
+	}
+
+	// chunk at start freed. Returns the state it was in before, and the size if it was live.
+	// Freed chunks are only remembered (for double free detection) if remember is true,
+	// otherwise the slot is deleted and a chunk we don't know about isn't added
+	UINT32 freed(ADDRINT start, UINT32& size, bool remember)
+	{
+		UINT32 hash = hashAddress(start);
+		CHUNK_SHARD& shard = shards[hash & (CHUNK_TABLE_SHARDS - 1)];
+		shard.lock.lock();
+		CHUNK_SLOT* slot = remember ? findOrInsert(shard, hash, start) : find(shard, hash, start);
+		UINT32 previous = CHUNK_UNKNOWN;
+		size = 0;
+		if (slot != NULL)
+		{
+			previous = slot->state;
+			if (previous == CHUNK_LIVE)
+			{
+				size = slot->size;
+			}
+			else if (previous != CHUNK_FREED)
+			{
+				slot->size = 0;
+			}
+			setState(shard, *slot, remember ? CHUNK_FREED : CHUNK_DELETED);
+		}
+		shard.lock.unlock();
+		return previous;
+	}
+
+	// state of the chunk at start, and its size (and site) if it's live
+	UINT32 lookup(ADDRINT start, UINT32& size, UINT32* site = NULL)
+	{
+		UINT32 hash = hashAddress(start);
+		CHUNK_SHARD& shard = shards[hash & (CHUNK_TABLE_SHARDS - 1)];
+		shard.lock.lock();
+		CHUNK_SLOT* slot = find(shard, hash, start);
+		UINT32 state = (slot != NULL) ? slot->state : (UINT32) CHUNK_UNKNOWN;
+		size = (state == CHUNK_LIVE) ? slot->size : 0;
+		if (site != NULL)
+		{
+			*site = (state == CHUNK_LIVE) ? slot->site : 0;
+		}
+		shard.lock.unlock();
+		return state;
+	}
+
+	// like freed, but only if the chunk at start is still live with the size and site lookup
+	// returned earlier. False if the address was freed or handed out again in the meantime
+	bool freedIf(ADDRINT start, UINT32 size, UINT32 site, bool remember)
+	{
+		UINT32 hash = hashAddress(start);
+		CHUNK_SHARD& shard = shards[hash & (CHUNK_TABLE_SHARDS - 1)];
+		shard.lock.lock();
+		CHUNK_SLOT* slot = find(shard, hash, start);
+		bool match = slot != NULL && slot->state == CHUNK_LIVE && slot->size == size && slot->site == site;
+		if (match)
+		{
+			setState(shard, *slot, remember ? CHUNK_FREED : CHUNK_DELETED);
+		}
+		shard.lock.unlock();
+		return match;
+	}
+
+	// stop tracking the chunk at start, but only if it is in the given state
+	void forget(ADDRINT start, UINT32 state)
+	{
+		UINT32 hash = hashAddress(start);
+		CHUNK_SHARD& shard = shards[hash & (CHUNK_TABLE_SHARDS - 1)];
+		shard.lock.lock();
+		CHUNK_SLOT* slot = find(shard, hash, start);
+		if (slot != NULL && slot->state == state)
+		{
+			setState(shard, *slot, CHUNK_DELETED);
+		}
+		shard.lock.unlock();
+	}
+
+	// calls visit(start, size, site) for every live chunk. Safe while other threads change the table:
+	// the live slots of a shard are copied under its lock and visited after it is released, so
+	// allocating threads only wait for the copy. Not a consistent snapshot across shards then
+	template <class VISITOR>
+	void forEachLive(VISITOR& visit)
+	{
+		std::vector<CHUNK_SLOT> live;
+		for (UINT32 i = 0; i < CHUNK_TABLE_SHARDS; i++)
+		{
+			CHUNK_SHARD& shard = shards[i];
+			live.clear();
+			shard.lock.lock();
+			live.reserve(shard.live);
+			for (UINT32 j = 0; j <= shard.mask; j++)
+			{
+				if (shard.slots[j].state == CHUNK_LIVE)
+				{
+					live.push_back(shard.slots[j]);
+				}
+			}
+			shard.lock.unlock();
+			for (size_t j = 0; j < live.size(); j++)
+			{
+				visit((ADDRINT) live[j].start, live[j].size, live[j].site);
+			}
+		}
+	}
+
+	// totals over all shards, not a consistent snapshot while other threads are busy
+	void getCounts(UINT64& live, UINT64& freed, UINT64& slots)
+	{
+		live = 0;
+		freed = 0;
+		slots = 0;
+		for (UINT32 i = 0; i < CHUNK_TABLE_SHARDS; i++)
+		{
+			shards[i].lock.lock();
+			live += shards[i].live;
+			freed += shards[i].freed;
+			slots += shards[i].mask + 1;
+			shards[i].lock.unlock();
+		}
+	}
+
+private:
+	CHUNK_SHARD shards[CHUNK_TABLE_SHARDS];
+
+	// low bits pick the shard, the bits above them the first slot to probe
+	static UINT32 hashAddress(ADDRINT start)
+	{
+		UINT64 x = (UINT64) start >> 3;
+		UINT32 h = (UINT32) (x ^ (x >> 32));
+		h ^= h >> 16;
+		h *= 0x85ebca6b;
+		h ^= h >> 13;
+		h *= 0xc2b2ae35;
+		h ^= h >> 16;
+		return h;
+	}
+
+	static CHUNK_SLOT* newSlots(UINT32 count)
+	{
+		CHUNK_SLOT* slots = new CHUNK_SLOT[count];
+		memset(slots, 0, sizeof(CHUNK_SLOT) * count);
+		return slots;
+	}
+
+	static void setState(CHUNK_SHARD& shard, CHUNK_SLOT& slot, UINT32 state)
+	{
+		if (slot.state == CHUNK_LIVE)
+		{
+			shard.live--;
+		}
+		else if (slot.state == CHUNK_FREED)
+		{
+			shard.freed--;
+		}
+		if (state == CHUNK_LIVE)
+		{
+			shard.live++;
+		}
+		else if (state == CHUNK_FREED)
+		{
+			shard.freed++;
+		}
+		slot.state = state;
+	}
+
+	// caller must hold the shard lock
+	static CHUNK_SLOT* find(CHUNK_SHARD& shard, UINT32 hash, ADDRINT start)
+	{
+		for (UINT32 i = hash >> CHUNK_TABLE_SHARD_BITS; ; i++)
+		{
+			CHUNK_SLOT& slot = shard.slots[i & shard.mask];
+			if (slot.state == CHUNK_UNKNOWN)
+			{
+				return NULL;
+			}
+			if (slot.start == start && slot.state != CHUNK_DELETED)
+			{
+				return &slot;
+			}
+		}
+	}
+
+	// returns the slot of start, a new one in state CHUNK_UNKNOWN if it isn't there yet.
+	// Caller must hold the shard lock
+	static CHUNK_SLOT* findOrInsert(CHUNK_SHARD& shard, UINT32 hash, ADDRINT start)
+	{
+		CHUNK_SLOT* reuse = NULL;
+		UINT32 i = hash >> CHUNK_TABLE_SHARD_BITS;
+		for (; ; i++)
+		{
+			CHUNK_SLOT& slot = shard.slots[i & shard.mask];
+			if (slot.state == CHUNK_UNKNOWN)
+			{
+				break;
+			}
+			if (slot.start == start && slot.state != CHUNK_DELETED)
+			{
+				return &slot;
+			}
+			if (slot.state == CHUNK_DELETED && reuse == NULL)
+			{
+				reuse = &slot;
+			}
+		}
+		if (reuse != NULL)
+		{
+			reuse->start = start;
+			reuse->state = CHUNK_UNKNOWN;
+			return reuse;
+		}
+		if ((shard.used + 1) * 4 > (shard.mask + 1) * 3)
+		{
+			// at most 75% full, counting deleted slots. Only grow if they aren't the reason
+			rehash(shard, (shard.live + shard.freed + 1) * 2 > shard.mask + 1 ? (shard.mask + 1) * 2 : shard.mask + 1);
+			for (i = hash >> CHUNK_TABLE_SHARD_BITS; shard.slots[i & shard.mask].state != CHUNK_UNKNOWN; i++)
+			{
+			}
+		}
+		CHUNK_SLOT& slot = shard.slots[i & shard.mask];
+		slot.start = start;
+		slot.size = 0;
+		shard.used++;
+		return &slot;
+	}
+
+	static void rehash(CHUNK_SHARD& shard, UINT32 count)
+	{
+		CHUNK_SLOT* old = shard.slots;
+		UINT32 oldcount = shard.mask + 1;
+		shard.slots = newSlots(count);
+		shard.mask = count - 1;
+		shard.used = 0;
+		for (UINT32 i = 0; i < oldcount; i++)
+		{
+			if (old[i].state == CHUNK_LIVE || old[i].state == CHUNK_FREED)
+			{
+				UINT32 j = hashAddress((ADDRINT) old[i].start) >> CHUNK_TABLE_SHARD_BITS;
+				while (shard.slots[j & shard.mask].state != CHUNK_UNKNOWN)
+				{
+					j++;
+				}
+				shard.slots[j & shard.mask] = old[i];
+				shard.used++;
+			}
+		}
+		delete[] old;
+	}
+};
+
+#endif
@@ -35,16 +35,32 @@
 */
 
 #include "pin.H"
+#if defined(TARGET_WINDOWS)
 namespace WINDOWS
 {
 #include<Windows.h>
 }
+#endif
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+#include <atomic>
 #include <ctime>
+#include <cmath>
+#if defined(TARGET_WINDOWS)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#include <sys/time.h>
+#endif
+#define HEAPLOG_PIN
+#define CHUNKTABLE_YIELD() PIN_Yield()
+#include "HeapCore.h"
 
 /* ================================================================== */
 // Global variables 
@@ -54,16 +70,44 @@ namespace WINDOWS
 BOOL LogAlloc = true;
 BOOL LogFree = true;
 BOOL ShowTimeStamp = false;
+BOOL ShowMicroseconds = false;					// -timestamp with microseconds
 BOOL SplitFiles = false;
-BOOL StaySilent = false;
+BOOL SharedClock = false;						// cycle counter on every heap event, for heaplog_merge
+BOOL StaySilent = false;						// can be toggled at runtime through the control channel, under drainLock
 BOOL BufferOutput = true;
-TLS_KEY alloc_key;
+BOOL CompressOutput = false;					// block compressed log file, see BlockFile.h
+BOOL ProfileMode = false;
+BOOL Sampling = false;							// true if any of the sampling or size filter options is used
+BOOL ReplaceHooks = false;						// -hookmode replace
+BOOL ModuleFilter = false;						// only record allocations made from some modules
+BOOL RecordTrace = false;						// write an allocation trace for heaplog_replay
+UINT32 SampleRate = 1;
+UINT32 MinSize = 0;
+UINT32 MaxSize = 0xffffffff;
+UINT32 SampleBytes = 0;
+UINT32 StackDepth = 0;
+UINT32 HistoryMB = 256;							// memory budget for the chunk history, 0 means no limit
+UINT32 LeakReportSites = 0;						// allocation sites in the live heap report, 0 means all
+UINT32 HeapStatsInterval = 0;					// ms between two rows of per-heap counters, 0 means off
+BOOL UafCheck = false;
 FILE* LogFile;
 FILE* ExceptionLogFile;
-std::map<ADDRINT,WINDOWS::DWORD> chunksizes;	// used to collect info from all threads
-std::map<ADDRINT, ADDRINT> mapFree;				// used to remember all frees and the SRP
+CChunkTable chunkTable;							// live and freed chunks, updated by the analysis routines
 PIN_LOCK lock;
-int nrLogEntries = 0;
+PIN_LOCK drainLock;								// protects everything the drain thread updates
+PIN_SEMAPHORE drainSemaphore;					// wakes up the drain thread early
+PIN_THREAD_UID DrainThreadUid;
+PIN_THREAD_UID WriterThreadUid;
+PIN_THREAD_UID ControlThreadUid;
+PIN_SEMAPHORE controlSemaphore;					// wakes up the control thread to exit
+volatile BOOL DrainThreadExit = false;
+volatile BOOL ControlThreadExit = false;
+BOOL DrainThreadStarted = false;
+BOOL WriterThreadStarted = false;
+BOOL ControlThreadStarted = false;
+UINT32 CurrentPid = 0;
+UINT64 nrHeapOperations = 0;
+std::atomic<UINT64> nrRingStalls(0);			// events that had to wait for room in their ring
 
 /* ================================================================== */
 // Function declarations 
@@ -76,32 +120,27 @@ void saveToLog(FILE*, const char * fmt, ...);
 // Classes 
 /* ================================================================== */
 
-class CLogEntry{
-public:
-	// constructor
-	CLogEntry(FILE* LogF, std::string entrystr)
-	{
-		LogFileRef = LogF;
-		entry = entrystr;
-	}
-	
-	FILE* getLogFile()
+// heap events, event rings, chunk history and log output are in HeapCore.h
+
+CLogWriter LogWriter;
+
+
+// write text to LogFile, through the log writer if output is buffered.
+// meta describes the heap events in data, if any
+void saveRawToLog(const char * data, size_t len, const BLOCK_META* meta = NULL)
+{
+	if (BufferOutput)
 	{
-		return LogFileRef;
+		LogWriter.write(data, len, meta);
 	}
-
-	string getEntry()
+	else if (LogFile != NULL)
 	{
-		return entry;
+		fwrite(data, 1, len, LogFile);
 	}
+}
 
-private:
-	FILE* LogFileRef;
-	std::string entry;
-};
-
-vector<CLogEntry> arrOutputBuffer;
 
+CTextBlock eventText(saveRawToLog);
 
 
 class CModuleImage
@@ -113,6 +152,7 @@ public:
 		ImageName = IMG_Name(thisimage);
 		ImageEnd = IMG_HighAddress(thisimage);
 		ImageBase = IMG_LowAddress(thisimage);
+		ModuleId = 0;
 	}
 
 	void save_to_log()
@@ -135,453 +175,2797 @@ public:
 		return ImageEnd;
 	}
 
+	UINT16 getId()
+	{
+		return ModuleId;
+	}
+
+	void setId(UINT16 id)
+	{
+		ModuleId = id;
+	}
+
 private:
 	string ImageName;
 	ADDRINT ImageBase;
-	ADDRINT ImageEnd;
+	ADDRINT ImageEnd;			// last byte of the image
+	UINT16 ModuleId;			// see moduleTable
 };
 
 
-class CHeapOperation
+// Module names are stored once. Heap events only carry the 16 bit id of the caller's module
+#define MAX_MODULE_IDS 0x10000
+
+class CModuleTable
 {
 public:
-	string operation_type;
-	ADDRINT chunk_start;
-	WINDOWS::DWORD chunk_size;
-	ADDRINT chunk_end;
-	ADDRINT saved_return_pointer;
-	string srp_imagename;
-	time_t operation_timestamp;
+	CModuleTable()
+	{
+		// id 0 means "not inside a known module"
+		names[0] = "";
+		count = 1;
+	}
 
-	// constructor, only used to initialize private var currentpid
-	CHeapOperation(bool is_this_an_alloc)
+	UINT16 intern(const string& name)
 	{
-		currentpid = PIN_GetPid();
-		isalloc = is_this_an_alloc;
+		std::map<string, UINT16>::iterator it = nameids.find(name);
+		if (it != nameids.end())
+		{
+			return it->second;
+		}
+		if (count >= MAX_MODULE_IDS)
+		{
+			// out of ids, pretend we don't know the module
+			return 0;
+		}
+		// the name is stored before the id is handed out, so getName() doesn't need a lock
+		UINT16 id = (UINT16) count;
+		names[id] = strdup(name.c_str());
+		count++;
+		nameids[name] = id;
+		return id;
 	}
 
-	// member functions to perform check on current address
-	void check_addy()
+	const char * getName(UINT16 id)
 	{
-		// it doesn't make sense to analyze if we're not tracking data in the first place
-		if (LogAlloc && LogFree)
+		if (id < count)
 		{
-			// is this an alloc or free ?
-			if (isalloc)
-			{
-				// alloc
-				// try to remove item from freelist. Doesn't matter if item doesn't exist yet
-				try
-				{
-					mapFree.erase(chunk_start);
-				}
-				catch ( ... )
-				{
-					saveToLog(LogFile,"***Exception: Unable to remove element from free list\n");
-				}
-			}
-			else
-			{
-				// free
-				// if item is already in free list, then log this as a double free
-				if (mapFree.find( chunk_start ) != mapFree.end())
-				{
-					saveToLog(LogFile, "PID: %u >>> Double Free of 0x%p from 0x%p (%s) <<<\n", currentpid, chunk_start, saved_return_pointer, srp_imagename);
-				}
-				else
-				{
-					// add to map
-					try
-					{
-						mapFree[chunk_start] = saved_return_pointer;
-					}
-					catch ( ... )
-					{
-						saveToLog(LogFile, "***Exception: Unable to add freed chunk to list\n");
-					}
-				}
-			}
+			return names[id];
 		}
+		return names[0];
 	}
 
+private:
+	const char * names[MAX_MODULE_IDS];
+	volatile UINT32 count;
+	std::map<string, UINT16> nameids;
+};
+
+CModuleTable moduleTable;
 
-	// member function to write info about current heap operation to log file
-	void save_to_log()
+
+// cycle counter, orders events across threads
+UINT64 readClock()
+{
+	return __rdtsc();
+}
+
+
+// microseconds since 1970
+UINT64 readWallClock()
+{
+#if defined(TARGET_WINDOWS)
+	WINDOWS::FILETIME now;
+	WINDOWS::GetSystemTimeAsFileTime(&now);
+	// 100ns units since 1601
+	return ((((UINT64) now.dwHighDateTime) << 32) | now.dwLowDateTime) / 10 - 11644473600000000ULL;
+#else
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (UINT64) now.tv_sec * 1000000 + now.tv_usec;
+#endif
+}
+
+
+// 48 bits of timestamp in units of 16 cycles last for weeks
+#define TIMESTAMP_SHIFT 4
+
+// Turns event timestamps into wall clock time. The analysis routines only read the cycle counter,
+// the wall clock is read once at startup and again with every drain pass, which keeps the
+// conversion accurate without a system call per event
+class CClock
+{
+public:
+	CClock()
+	{
+		base = 0;
+		startclock = lastclock = 0;
+		startwall = lastwall = 0;
+		ticksperus = 1000.0;
+		cachedsecond = 0;
+		cachedtext[0] = 0;
+	}
+
+	// first estimate of the cycle counter frequency, from two samples a few ms apart
+	void init()
+	{
+		base = readClock();
+		startclock = base;
+		startwall = readWallClock();
+		PIN_Sleep(20);
+		calibrate();
+	}
+
+	// caller must hold drainLock
+	void calibrate()
 	{
-		char * ascii_time;
-		if (ShowTimeStamp)
+		UINT64 clock = readClock();
+		UINT64 wall = readWallClock();
+		if (wall > startwall)
 		{
-			struct tm * timeinfo;
-			time ( & operation_timestamp );
-			timeinfo = localtime ( & operation_timestamp);
-			ascii_time = strtok(asctime(timeinfo),"\n");
+			// the longer the baseline, the better the estimate
+			ticksperus = (double) (clock - startclock) / (double) (wall - startwall);
 		}
-		else
+		lastclock = clock;
+		lastwall = wall;
+	}
+
+	// timestamp for a HEAP_EVENT
+	UINT64 toTimestamp(UINT64 clock) const
+	{
+		return (clock - base) >> TIMESTAMP_SHIFT;
+	}
+
+	// cycle counter value of a timestamp, which is the same clock in every process
+	UINT64 toClock(UINT64 timestamp) const
+	{
+		return base + (timestamp << TIMESTAMP_SHIFT);
+	}
+
+	// wall clock time of a timestamp, in microseconds since 1970. Caller must hold drainLock
+	UINT64 toWall(UINT64 timestamp) const
+	{
+		UINT64 clock = toClock(timestamp);
+		INT64 delta = (INT64) ((double) (INT64) (clock - lastclock) / ticksperus);
+		return lastwall + delta;
+	}
+
+	// "Www Mmm dd hh:mm:ss yyyy" in local time, like asctime, or "Www Mmm dd hh:mm:ss.uuuuuu yyyy"
+	// with microseconds. Caller must hold drainLock
+	const char* format(UINT64 timestamp, BOOL microseconds)
+	{
+		UINT64 wall = toWall(timestamp);
+		time_t second = (time_t) (wall / 1000000);
+		if (second != cachedsecond || cachedtext[0] == 0)
 		{
-			ascii_time = "";
+			// localtime and asctime only once per second of events
+			char * ascii_time = asctime(localtime(&second));
+			strncpy(cachedtext, ascii_time, sizeof(cachedtext) - 1);
+			cachedtext[sizeof(cachedtext) - 1] = 0;
+			cachedsecond = second;
 		}
-
-		if (!StaySilent)
+		// asctime: "Www Mmm dd hh:mm:ss yyyy\n"
+		if (microseconds)
 		{
-			if (operation_type ==  "rtlallocateheap")
-			{
-				saveToLog(LogFile, "PID: %u | %s | alloc(0x%x) = 0x%p from 0x%p (%s)\n",currentpid,ascii_time,chunk_size,chunk_start,saved_return_pointer,srp_imagename);
-			}
-			else if (operation_type ==  "rtlreallocateheap")
-			{
-				saveToLog(LogFile, "PID: %u | %s | realloc(0x%x) at 0x%p from 0x%p (%s)\n",currentpid,ascii_time,chunk_size,chunk_start,saved_return_pointer,srp_imagename);
-			}
-			else if (operation_type ==  "virtualalloc")
-			{
-				saveToLog(LogFile, "PID: %u | %s | virtualalloc(0x%x) at 0x%p from 0x%p (%s)\n",currentpid,ascii_time,chunk_size,chunk_start,saved_return_pointer,srp_imagename);
-			}
-			else if (operation_type == "rtlfreeheap")
-			{
-				saveToLog(LogFile, "PID: %u | %s | free(0x%p) from 0x%p (size was 0x%x) (%s)\n",currentpid,ascii_time, chunk_start,saved_return_pointer,chunk_size,srp_imagename);
-			}
+			snprintf(text, sizeof(text), "%.19s.%06u %.4s", cachedtext, (UINT32) (wall % 1000000), cachedtext + 20);
+		}
+		else
+		{
+			snprintf(text, sizeof(text), "%.24s", cachedtext);
 		}
+		return text;
+	}
+
+	UINT64 getBase() const
+	{
+		return base;
+	}
+
+	UINT64 getStartWall() const
+	{
+		return startwall;
+	}
+
+	double getTicksPerUs() const
+	{
+		return ticksperus;
 	}
 
 private:
-	int currentpid;
-	bool isalloc;
+	UINT64 base;					// cycle counter at startup, timestamp 0
+	UINT64 startclock;
+	UINT64 startwall;
+	UINT64 lastclock;				// most recent calibration
+	UINT64 lastwall;
+	double ticksperus;
+	time_t cachedsecond;
+	char cachedtext[32];
+	char text[40];
 };
 
+CClock eventClock;
+
+
+// report double frees. They are detected by the analysis routine, against chunkTable
+void checkHeapEvent(const HEAP_EVENT& ev)
+{
+	if ((ev.flags & EV_DOUBLE_FREE) != 0)
+	{
+		if (CompressOutput)
+		{
+			eventText.note(eventClock.toWall(ev.timestamp), ev.chunk_start, ev.chunk_end());
+		}
+		formatDoubleFree(eventText, ev, CurrentPid, moduleTable.getName(ev.moduleid));
+	}
+}
+
+
+// write info about a heap operation to log file
+void logHeapEvent(const HEAP_EVENT& ev)
+{
+	if (StaySilent)
+	{
+		return;
+	}
+
+	const char * ascii_time = "";
+	if (ShowTimeStamp)
+	{
+		ascii_time = eventClock.format(ev.timestamp, ShowMicroseconds);
+	}
+	if (CompressOutput)
+	{
+		eventText.note(eventClock.toWall(ev.timestamp), ev.chunk_start, ev.chunk_end());
+	}
+
+	UINT64 clock = SharedClock ? eventClock.toClock(ev.timestamp) : 0;
+	formatHeapEvent(eventText, ev, CurrentPid, ascii_time, SharedClock ? &clock : NULL, moduleTable.getName(ev.moduleid));
+}
 
-vector<CHeapOperation> arrAllOperations;
 vector<CModuleImage> arrLoadedModules;
 
 
-/* ===================================================================== */
-// Command line switches
-/* ===================================================================== */
+CChunkIndex chunkIndex(&chunkTable);
 
-KNOB<BOOL>   KnobLogAlloc(KNOB_MODE_WRITEONCE,  "pintool",
-	"logalloc", "1", "Log heap allocations (RtlAllocateHeap, RtlReAllocateHeap and VirtualAlloc)");
+void saveChunkIndexStats(FILE* file)
+{
+	UINT64 kept, evicteddead, evictedlive;
+	chunkIndex.getStats(kept, evicteddead, evictedlive);
+	saveToLog(file, "Chunk history: %llu chunks kept, %llu evicted (%llu dead, %llu live)\n",
+		kept, evicteddead + evictedlive, evicteddead, evictedlive);
+}
 
-KNOB<BOOL>   KnobLogFree(KNOB_MODE_WRITEONCE,  "pintool",
-	"logfree", "1", "Log heap free operations (RtlFreeHeap)");
+CTraceWriter traceWriter;						// -recordtrace, only used by the drain
 
-KNOB<BOOL>   KnobShowTimeStamp(KNOB_MODE_WRITEONCE,  "pintool",
-	"timestamp", "0", "Show timestamps in output");
 
-KNOB<BOOL>   KnobSplitFiles(KNOB_MODE_WRITEONCE,  "pintool",
-	"splitfiles", "0", "Split output into PID-specific files");
+/* ================================================================== */
+// Per-thread event buffers
+/* ================================================================== */
 
-KNOB<BOOL>   KnobStaySilent(KNOB_MODE_WRITEONCE,  "pintool",
-	"silent", "0", "Silent mode, do not log allocs & frees to log file");
+// Analysis routines don't touch any shared state. Every application thread queues its
+// heap events in its own ring buffer, and the drain thread (the only consumer) merges
+// them in clock order into the chunk maps, the operation history and the log
+#define MAX_THREADS 4096
+#define DRAIN_INTERVAL 10		// ms between two drain passes
 
-KNOB<BOOL>   KnobBufferOutput(KNOB_MODE_WRITEONCE,  "pintool",
-	"bufferoutput", "1", "Buffer output in memory before writing to file.  Dump contents to file 5000 lines at once");
+std::atomic<CEventRing*> threadRings[MAX_THREADS];	// indexed by THREADID, created by the owning thread
+std::atomic<UINT32> nrThreadRings;					// highest THREADID with a ring, plus one
+vector<RING_ENTRY> drainBatch;						// only used with drainLock held
 
-/* ===================================================================== */
-// Utilities
-/* ===================================================================== */
 
-INT32 Usage()
+/* ================================================================== */
+// Module ranges
+/* ================================================================== */
+
+struct MODULE_RANGE
 {
+	ADDRINT base;
+	ADDRINT end;				// first byte after the image
+	UINT16 id;
+};
 
-	return -1;
+bool compareRangeBase(const MODULE_RANGE& a, const MODULE_RANGE& b)
+{
+	return a.base < b.base;
 }
 
-void dumpBufferToFile()
+// last module hit per thread, a cache line each so threads don't share them
+struct alignas(64) MODULE_CACHE
 {
-	PIN_LockClient();
-	for (CLogEntry le : arrOutputBuffer)
+	UINT32 generation;
+	MODULE_RANGE range;
+};
+
+static_assert(sizeof(MODULE_CACHE) == 64, "MODULE_CACHE should be one cache line");
+
+
+// Sorted address ranges of the loaded images, used to resolve callers without PIN_LockClient.
+// The table is only changed from image load/unload callbacks, which Pin serializes. Every change
+// builds a new copy and publishes it with a single pointer store, so readers never see a
+// half updated table. Replaced tables are kept until exit, a reader may still be using them
+class CModuleRanges
+{
+public:
+	CModuleRanges()
 	{
-		FILE* LogF = le.getLogFile();
-		string entry = le.getEntry();
-		fprintf(LogF, "%s", entry);
+		current = new RANGE_TABLE();
+		current.load()->generation = 1;
 	}
-	// I won't fflush the output buffer here, for performance reasons.
-	arrOutputBuffer.clear();
-	PIN_UnlockClient();
-}
 
+	// rebuild from arrLoadedModules, instrumentation time only
+	void publish(vector<CModuleImage>& modules)
+	{
+		RANGE_TABLE* table = new RANGE_TABLE();
+		RANGE_TABLE* old = current.load(std::memory_order_relaxed);
+		table->generation = old->generation + 1;
+		for (size_t i = 0; i < modules.size(); i++)
+		{
+			MODULE_RANGE range;
+			range.base = modules[i].getBase();
+			range.end = modules[i].getEnd() + 1;
+			range.id = modules[i].getId();
+			table->ranges.push_back(range);
+		}
+		std::sort(table->ranges.begin(), table->ranges.end(), compareRangeBase);
+		current.store(table, std::memory_order_release);
+		retired.push_back(old);
+	}
 
-void CloseLogFile()
-{
-	// first dump remaining log entries to file, if any
-	dumpBufferToFile();
-	// wrap up
-	std::fprintf(ExceptionLogFile,"\nClosing log file for PID %u\n", PIN_GetPid());
-	std::fprintf(LogFile, "############## EOF\n");
-	fflush(LogFile);
-	fclose(LogFile);
-}
+	// module id for an address, 0 if it isn't part of a loaded image. Safe to call from any thread
+	UINT16 find(THREADID tid, ADDRINT address)
+	{
+		RANGE_TABLE* table = current.load(std::memory_order_acquire);
+		MODULE_CACHE* cache = (tid < MAX_THREADS) ? &caches[tid] : NULL;
+		if (cache != NULL && cache->generation == table->generation && cache->range.base <= address && address < cache->range.end)
+		{
+			return cache->range.id;
+		}
 
-void CloseExceptionLogFile()
-{
-	std::fprintf(ExceptionLogFile,"Closing exception log file for PID %u\n", PIN_GetPid());
-	std::fprintf(ExceptionLogFile, "############## EOF\n");
-	fflush(ExceptionLogFile);
-	fclose(ExceptionLogFile);
-}
+		const MODULE_RANGE* range = search(table, address);
+		if (range == NULL)
+		{
+			return 0;
+		}
+		if (cache != NULL)
+		{
+			cache->range = *range;
+			cache->generation = table->generation;
+		}
+		return range->id;
+	}
 
+	// same, but also returns where the image starts
+	bool findRange(ADDRINT address, MODULE_RANGE& result)
+	{
+		const MODULE_RANGE* range = search(current.load(std::memory_order_acquire), address);
+		if (range == NULL)
+		{
+			return false;
+		}
+		result = *range;
+		return true;
+	}
 
-string getCurrentDateTimeStr()
-{
-	time_t thistime;
-	thistime = time(0);
-	char * ascii_time;
-	struct tm * timeinfo;
-	time ( & thistime);
-	timeinfo = localtime ( & thistime);
-	ascii_time = strtok(asctime(timeinfo),"\n");
-	stringstream returnval;
-	returnval << ascii_time;
-	return returnval.str();
-}
+private:
+	struct RANGE_TABLE
+	{
+		UINT32 generation;
+		vector<MODULE_RANGE> ranges;
+	};
+
+	std::atomic<RANGE_TABLE*> current;
+	vector<RANGE_TABLE*> retired;
+	MODULE_CACHE caches[MAX_THREADS];	// indexed by THREADID, only touched by the owning thread
+
+	static const MODULE_RANGE* search(RANGE_TABLE* table, ADDRINT address)
+	{
+		// binary search for the last range that starts at or below address
+		size_t lo = 0;
+		size_t hi = table->ranges.size();
+		while (lo < hi)
+		{
+			size_t mid = (lo + hi) / 2;
+			if (table->ranges[mid].base <= address)
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		if (lo == 0 || address >= table->ranges[lo - 1].end)
+		{
+			return NULL;
+		}
+		return &table->ranges[lo - 1];
+	}
+};
+
+CModuleRanges moduleRanges;
 
 
-WINDOWS::DWORD findSize(ADDRINT address)
+// Module filter (-modules, -excludemodules). A page bitmap marks the images whose callers
+// are in scope, or out of scope when only exclusions are given, so the analysis routines decide
+// with a single lookup. Each leaf covers 128MB, leaves are only allocated for regions that
+// hold a marked image
+#define SCOPE_PAGE_BITS 12
+#define SCOPE_REGION_BITS 27
+#if defined(TARGET_IA32)
+#define SCOPE_ADDRESS_BITS 32
+#else
+#define SCOPE_ADDRESS_BITS 47
+#endif
+#define SCOPE_TOP_ENTRIES (1 << (SCOPE_ADDRESS_BITS - SCOPE_REGION_BITS))
+#define SCOPE_LEAF_WORDS ((1 << (SCOPE_REGION_BITS - SCOPE_PAGE_BITS)) / 32)
+
+class CModuleScope
 {
-	// search in map for key address
-	std::map<ADDRINT,WINDOWS::DWORD>::iterator it;
+public:
+	CModuleScope()
+	{
+		// top is left to the zero initialization of the global, clearing it would commit all of it
+		marksinscope = true;
+	}
+
+	// comma separated lists of (parts of) module names, not case sensitive
+	void addIncludes(const string& list)
+	{
+		split(list, includes);
+		marksinscope = true;
+	}
+
+	void addExcludes(const string& list)
+	{
+		split(list, excludes);
+		marksinscope = !includes.empty();
+	}
+
+	bool isActive() const
+	{
+		return !includes.empty() || !excludes.empty();
+	}
+
+	// true if allocations made from this image get recorded
+	bool isInScope(const string& imagename) const
+	{
+		string name = baseName(imagename);
+		return (includes.empty() || matches(name, includes)) && !matches(name, excludes);
+	}
+
+	// image load and unload, instrumentation time only
+	void imageLoaded(const string& imagename, ADDRINT low, ADDRINT high)
+	{
+		if (isInScope(imagename) == marksinscope)
+		{
+			mark(low, high, true);
+		}
+	}
+
+	void imageUnloaded(const string& imagename, ADDRINT low, ADDRINT high)
+	{
+		if (isInScope(imagename) == marksinscope)
+		{
+			mark(low, high, false);
+		}
+	}
+
+	// callers outside any image are in scope unless modules were included explicitly
+	bool contains(ADDRINT address) const
+	{
+		ADDRINT region = address >> SCOPE_REGION_BITS;
+		const UINT32* leaf = (region < SCOPE_TOP_ENTRIES) ? top[region] : NULL;
+		bool marked = leaf != NULL &&
+			((leaf[(address & ((1 << SCOPE_REGION_BITS) - 1)) >> (SCOPE_PAGE_BITS + 5)] >> ((address >> SCOPE_PAGE_BITS) & 31)) & 1);
+		return marked == marksinscope;
+	}
+
+	string describe() const
+	{
+		string text;
+		for (size_t i = 0; i < includes.size(); i++)
+		{
+			text += (text.empty() ? "" : ", ") + includes[i];
+		}
+		for (size_t i = 0; i < excludes.size(); i++)
+		{
+			text += (text.empty() ? "not " : ", not ") + excludes[i];
+		}
+		return text;
+	}
 
-	it = chunksizes.find(address);
-	if (it != chunksizes.end())
+private:
+	vector<string> includes;
+	vector<string> excludes;
+	bool marksinscope;					// meaning of a set bit
+	UINT32* top[SCOPE_TOP_ENTRIES];		// 8MB on Intel64, only the pages that hold leaf pointers get used
+
+	static string lowerCase(const string& text)
+	{
+		string result = text;
+		for (size_t i = 0; i < result.size(); i++)
+		{
+			result[i] = (char) tolower((unsigned char) result[i]);
+		}
+		return result;
+	}
+
+	static string baseName(const string& path)
+	{
+		size_t slash = path.find_last_of("\\/");
+		return lowerCase(slash == string::npos ? path : path.substr(slash + 1));
+	}
+
+	static void split(const string& list, vector<string>& names)
+	{
+		size_t start = 0;
+		while (start <= list.size())
+		{
+			size_t comma = list.find(',', start);
+			if (comma == string::npos)
+			{
+				comma = list.size();
+			}
+			if (comma > start)
+			{
+				names.push_back(lowerCase(list.substr(start, comma - start)));
+			}
+			start = comma + 1;
+		}
+	}
+
+	static bool matches(const string& name, const vector<string>& patterns)
+	{
+		for (size_t i = 0; i < patterns.size(); i++)
+		{
+			if (name.find(patterns[i]) != string::npos)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// high is the last byte of the image
+	void mark(ADDRINT low, ADDRINT high, bool value)
+	{
+		for (ADDRINT page = low >> SCOPE_PAGE_BITS; page <= (high >> SCOPE_PAGE_BITS); page++)
+		{
+			ADDRINT region = page >> (SCOPE_REGION_BITS - SCOPE_PAGE_BITS);
+			if (region >= SCOPE_TOP_ENTRIES)
+			{
+				break;
+			}
+			if (top[region] == NULL)
+			{
+				if (!value)
+				{
+					continue;
+				}
+				// filled in before it's published, readers never see a half initialized leaf
+				UINT32* leaf = new UINT32[SCOPE_LEAF_WORDS];
+				memset(leaf, 0, sizeof(UINT32) * SCOPE_LEAF_WORDS);
+				top[region] = leaf;
+			}
+			UINT32 bit = 1u << (page & 31);
+			UINT32& word = top[region][(page & ((1 << (SCOPE_REGION_BITS - SCOPE_PAGE_BITS)) - 1)) >> 5];
+			word = value ? (word | bit) : (word & ~bit);
+		}
+	}
+};
+
+CModuleScope moduleScope;
+
+
+/* ================================================================== */
+// Stack depot (-stackdepth N)
+/* ================================================================== */
+
+// Every distinct call stack is stored once, events only carry its 32 bit id.
+// Lookups don't take a lock: nodes never change once they are linked into their
+// bucket. Adding a new stack takes insertLock, which is rare once the program warmed up
+#define MAX_STACK_DEPTH 64
+#define STACK_DEPOT_BUCKETS 0x10000		// must be a power of 2
+#define STACK_IDS_PER_BLOCK 0x1000
+#define MAX_STACK_ID_BLOCKS 0x10000
+
+struct STACK_NODE
+{
+	STACK_NODE* next;			// next node in the same bucket
+	UINT32 hash;
+	UINT32 id;
+	UINT32 depth;
+	ADDRINT frames[1];			// really 'depth' entries, innermost frame first
+};
+
+class CStackDepot
+{
+public:
+	CStackDepot()
+	{
+		count = 0;
+		PIN_InitLock(&insertLock);
+	}
+
+	// returns the id of the stack, adding it if we haven't seen it before
+	UINT32 put(const ADDRINT* frames, UINT32 depth)
+	{
+		UINT32 hash = hashFrames(frames, depth);
+		std::atomic<STACK_NODE*>& bucket = buckets[hash & (STACK_DEPOT_BUCKETS - 1)];
+		STACK_NODE* node = find(bucket.load(std::memory_order_acquire), hash, frames, depth);
+		if (node != NULL)
+		{
+			return node->id;
+		}
+
+		PIN_GetLock(&insertLock, PIN_ThreadId() + 1);
+		// another thread may have added it in the meantime
+		node = find(bucket.load(std::memory_order_relaxed), hash, frames, depth);
+		if (node == NULL && count + 1 < STACK_IDS_PER_BLOCK * MAX_STACK_ID_BLOCKS)
+		{
+			node = (STACK_NODE*) new char[sizeof(STACK_NODE) + depth * sizeof(ADDRINT)];
+			node->hash = hash;
+			node->depth = depth;
+			memcpy(node->frames, frames, depth * sizeof(ADDRINT));
+			node->id = count + 1;
+			UINT32 block = node->id / STACK_IDS_PER_BLOCK;
+			if (idblocks[block] == NULL)
+			{
+				idblocks[block] = new STACK_NODE*[STACK_IDS_PER_BLOCK];
+			}
+			idblocks[block][node->id % STACK_IDS_PER_BLOCK] = node;
+			count = node->id;
+			node->next = bucket.load(std::memory_order_relaxed);
+			bucket.store(node, std::memory_order_release);
+		}
+		PIN_ReleaseLock(&insertLock);
+		return (node != NULL) ? node->id : 0;
+	}
+
+	// id must have been handed out by put() before
+	const STACK_NODE* get(UINT32 id)
+	{
+		if (id == 0 || id > count)
+		{
+			return NULL;
+		}
+		return idblocks[id / STACK_IDS_PER_BLOCK][id % STACK_IDS_PER_BLOCK];
+	}
+
+	UINT32 size()
+	{
+		return count;
+	}
+
+private:
+	std::atomic<STACK_NODE*> buckets[STACK_DEPOT_BUCKETS];
+	STACK_NODE** idblocks[MAX_STACK_ID_BLOCKS];
+	volatile UINT32 count;
+	PIN_LOCK insertLock;
+
+	static UINT32 hashFrames(const ADDRINT* frames, UINT32 depth)
+	{
+		// FNV-1a over the frame addresses
+		UINT32 hash = 2166136261u;
+		for (UINT32 i = 0; i < depth; i++)
+		{
+			hash = (hash ^ (UINT32) frames[i]) * 16777619u;
+#if defined(TARGET_INTEL64)
+			hash = (hash ^ (UINT32) (frames[i] >> 32)) * 16777619u;
+#endif
+		}
+		return hash;
+	}
+
+	static STACK_NODE* find(STACK_NODE* node, UINT32 hash, const ADDRINT* frames, UINT32 depth)
+	{
+		for (; node != NULL; node = node->next)
+		{
+			if (node->hash == hash && node->depth == depth && memcmp(node->frames, frames, depth * sizeof(ADDRINT)) == 0)
+			{
+				return node;
+			}
+		}
+		return NULL;
+	}
+};
+
+CStackDepot stackDepot;
+UINT32 nrStacksLogged = 0;				// stacks up to this id have been written to the log
+
+
+/* ================================================================== */
+// Call-site profile (-profile 1)
+/* ================================================================== */
+
+// operations are aggregated per caller, operation type and power of 2 size class
+// (and per call stack, with -stackdepth)
+struct PROFILE_KEY
+{
+	ADDRINT caller;
+	UINT32 stackid;
+	UINT8 operation;
+	UINT8 sizeclass;
+
+	bool operator==(const PROFILE_KEY& other) const
+	{
+		return caller == other.caller && stackid == other.stackid && operation == other.operation && sizeclass == other.sizeclass;
+	}
+};
+
+struct PROFILE_KEY_HASH
+{
+	size_t operator()(const PROFILE_KEY& key) const
+	{
+		return (size_t) (key.caller * 2654435761u) ^ ((size_t) key.stackid << 16) ^ ((size_t) key.operation << 8) ^ key.sizeclass;
+	}
+};
+
+struct PROFILE_SITE
+{
+	PROFILE_KEY key;
+	UINT64 calls;
+	UINT64 bytes;			// total bytes requested (or freed)
+	UINT64 livebytes;		// bytes allocated here that haven't been freed yet
+	UINT64 peakbytes;		// highest livebytes so far
+};
+
+bool compareSiteBytes(const PROFILE_SITE* a, const PROFILE_SITE* b)
+{
+	return a->bytes > b->bytes;
+}
+
+
+struct PROFILE_CHUNK
+{
+	PROFILE_SITE* site;
+	UINT32 size;
+};
+
+
+class CProfile
+{
+public:
+	// account for one heap event, caller must hold drainLock
+	void add(const HEAP_EVENT& ev)
+	{
+		PROFILE_SITE& site = getSite(ev);
+		site.calls++;
+		site.bytes += ev.chunk_size;
+
+		if (ev.isAlloc())
+		{
+			// a missed free would leave the old chunk behind
+			release(ev.chunk_start);
+			site.livebytes += ev.chunk_size;
+			if (site.livebytes > site.peakbytes)
+			{
+				site.peakbytes = site.livebytes;
+			}
+			PROFILE_CHUNK& chunk = livechunks[ev.chunk_start];
+			chunk.site = &site;
+			chunk.size = ev.chunk_size;
+		}
+		else
+		{
+			release(ev.chunk_start);
+		}
+	}
+
+	// a chunk that is gone without a free, after a realloc moved it
+	void release(ADDRINT chunk)
+	{
+		std::unordered_map<ADDRINT, PROFILE_CHUNK>::iterator it = livechunks.find(chunk);
+		if (it != livechunks.end())
+		{
+			PROFILE_SITE* site = it->second.site;
+			UINT32 size = it->second.size;
+			site->livebytes = (site->livebytes > size) ? site->livebytes - size : 0;
+			livechunks.erase(it);
+		}
+	}
+
+	// sites sorted by total bytes
+	vector<PROFILE_SITE*> getSortedSites()
+	{
+		vector<PROFILE_SITE*> result;
+		for (std::unordered_map<PROFILE_KEY, PROFILE_SITE, PROFILE_KEY_HASH>::iterator it = sites.begin(); it != sites.end(); ++it)
+		{
+			result.push_back(&it->second);
+		}
+		std::sort(result.begin(), result.end(), compareSiteBytes);
+		return result;
+	}
+
+private:
+	std::unordered_map<PROFILE_KEY, PROFILE_SITE, PROFILE_KEY_HASH> sites;
+	std::unordered_map<ADDRINT, PROFILE_CHUNK> livechunks;		// chunk -> site that allocated it
+
+	static UINT8 sizeClass(UINT32 size)
+	{
+		UINT8 sizeclass = 0;
+		while (size > 1)
+		{
+			size >>= 1;
+			sizeclass++;
+		}
+		return sizeclass;
+	}
+
+	PROFILE_SITE& getSite(const HEAP_EVENT& ev)
+	{
+		PROFILE_KEY key;
+		key.caller = ev.saved_return_pointer;
+		key.stackid = ev.stackid;
+		key.operation = ev.operation;
+		key.sizeclass = sizeClass(ev.chunk_size);
+		PROFILE_SITE& site = sites[key];
+		if (site.calls == 0)
+		{
+			site.key = key;
+		}
+		return site;
+	}
+};
+
+CProfile profile;
+
+
+/* ================================================================== */
+// Per-heap counters (-heapstats)
+/* ================================================================== */
+
+// pseudo heap handles for allocators that don't take one
+#define HEAP_DEFAULT 0			// malloc and friends
+#define HEAP_PAGES 1			// VirtualAlloc, mmap and munmap
+
+#define HEAP_DELTA_SLOTS 8		// heaps a thread can touch between two folds
+#define HEAP_FOLD_EVENTS 256	// heap operations of a thread between two folds
+
+// changes one thread made to one heap since its last fold
+struct HEAP_DELTA
+{
+	ADDRINT heap;
+	INT64 livebytes;
+	INT32 livechunks;
+	UINT32 allocs;
+	UINT32 frees;
+	UINT64 allocbytes;
+};
+
+// per thread, only touched by its own thread. Padded so threads don't share cache lines
+struct HEAP_DELTAS
+{
+	HEAP_DELTA slots[HEAP_DELTA_SLOTS];
+	UINT32 used;
+	UINT32 events;
+	UINT64 lastfold;				// cycle counter
+	std::atomic<UINT32> foldrequest;	// set by the drain thread, the thread folds on its next change
+	char padding[64];
+};
+
+struct HEAP_COUNTERS
+{
+	INT64 livebytes;
+	INT64 livechunks;
+	INT64 peakbytes;		// highest livebytes seen at a fold
+	UINT64 allocs;
+	UINT64 frees;
+	UINT64 allocbytes;
+	UINT64 sampledbytes;	// allocbytes at the previous row, for the rate
+	BOOL changed;			// since the previous row
+};
+
+struct HEAP_ROW
+{
+	ADDRINT heap;
+	HEAP_COUNTERS counters;
+};
+
+
+// Live bytes, live chunks, peak and allocation rate per heap handle. Application threads add
+// their changes to a small table of their own, and fold it into the shared counters every
+// HEAP_FOLD_EVENTS heap operations, every DRAIN_INTERVAL ms and when they exit, so the
+// analysis routines don't share anything per event. Only the owning thread touches its table:
+// every -heapstats ms the drain thread writes a CSV row for every heap that changed, and asks
+// all threads to fold on their next heap operation. Changes of a thread that went idle show
+// up in a row once it's busy again, or when it exits
+class CHeapStats
+{
+public:
+	CHeapStats()
+	{
+		csv = NULL;
+		interval = 0;
+		foldticks = 0;
+		starttime = lastrow = 0;
+		for (UINT32 i = 0; i < MAX_THREADS; i++)
+		{
+			deltas[i].store(NULL, std::memory_order_relaxed);
+		}
+		PIN_InitLock(&statsLock);
+	}
+
+	void init(FILE* file, UINT32 ms)
+	{
+		csv = file;
+		interval = ms;
+		foldticks = (UINT64) (eventClock.getTicksPerUs() * 1000 * DRAIN_INTERVAL);
+		starttime = lastrow = readWallClock();
+		fprintf(csv, "ms,heap,live_bytes,live_chunks,peak_bytes,allocs,frees,alloc_bytes_per_s\n");
+	}
+
+	// chunk allocated in heap. replaced is true if it was live already (realloc in place),
+	// replacedsize is its size then
+	void allocated(THREADID tid, ADDRINT heap, UINT32 size, BOOL replaced, UINT32 replacedsize, UINT64 clock)
+	{
+		HEAP_DELTA change;
+		memset(&change, 0, sizeof(change));
+		change.heap = heap;
+		change.livebytes = (INT64) size - (replaced ? replacedsize : 0);
+		change.livechunks = replaced ? 0 : 1;
+		change.allocs = 1;
+		change.allocbytes = size;
+		add(tid, change, clock);
+	}
+
+	// live chunk of size bytes freed from heap
+	void freed(THREADID tid, ADDRINT heap, UINT32 size, UINT64 clock)
+	{
+		HEAP_DELTA change;
+		memset(&change, 0, sizeof(change));
+		change.heap = heap;
+		change.livebytes = -(INT64) size;
+		change.livechunks = -1;
+		change.frees = 1;
+		add(tid, change, clock);
+	}
+
+	// move the changes of a thread into the shared counters. Only from the thread itself, or
+	// once it doesn't run any more
+	void fold(THREADID tid)
+	{
+		HEAP_DELTAS* thread = (tid < MAX_THREADS) ? deltas[tid].load(std::memory_order_acquire) : NULL;
+		if (thread != NULL)
+		{
+			foldThread(*thread);
+		}
+	}
+
+	// at exit, when the application threads don't run analysis code any more
+	void foldAll()
+	{
+		for (THREADID tid = 0; tid < MAX_THREADS; tid++)
+		{
+			fold(tid);
+		}
+	}
+
+	// ask every thread to fold on its next heap operation
+	void requestFolds()
+	{
+		for (THREADID tid = 0; tid < MAX_THREADS; tid++)
+		{
+			HEAP_DELTAS* thread = deltas[tid].load(std::memory_order_acquire);
+			if (thread != NULL)
+			{
+				thread->foldrequest.store(1, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// drain thread: a row per changed heap if the interval has passed, or always with force
+	void writeRows(BOOL force)
+	{
+		UINT64 now = readWallClock();
+		if (csv == NULL || (!force && now - lastrow < (UINT64) interval * 1000))
+		{
+			return;
+		}
+		// what the threads folded so far. The next row has the rest, of the threads that stay busy
+		requestFolds();
+		// copy under the lock, write without it
+		rows.clear();
+		PIN_GetLock(&statsLock, PIN_ThreadId() + 1);
+		for (std::map<ADDRINT, HEAP_COUNTERS>::iterator it = heaps.begin(); it != heaps.end(); ++it)
+		{
+			if (it->second.changed)
+			{
+				HEAP_ROW row;
+				row.heap = it->first;
+				row.counters = it->second;
+				rows.push_back(row);
+				it->second.changed = false;
+				it->second.sampledbytes = it->second.allocbytes;
+			}
+		}
+		PIN_ReleaseLock(&statsLock);
+
+		UINT64 elapsed = (now > lastrow) ? now - lastrow : 1;
+		for (size_t i = 0; i < rows.size(); i++)
+		{
+			const HEAP_COUNTERS& counters = rows[i].counters;
+			fprintf(csv, "%llu,0x%llx,%lld,%lld,%lld,%llu,%llu,%llu\n", (unsigned long long) ((now - starttime) / 1000),
+				(unsigned long long) rows[i].heap, (long long) counters.livebytes, (long long) counters.livechunks,
+				(long long) counters.peakbytes, (unsigned long long) counters.allocs, (unsigned long long) counters.frees,
+				(unsigned long long) ((counters.allocbytes - counters.sampledbytes) * 1000000 / elapsed));
+		}
+		fflush(csv);
+		lastrow = now;
+	}
+
+	// summary per heap, most live bytes at their peak first
+	void saveStatsToLog(FILE* file)
+	{
+		vector<HEAP_ROW> summary;
+		PIN_GetLock(&statsLock, PIN_ThreadId() + 1);
+		for (std::map<ADDRINT, HEAP_COUNTERS>::const_iterator it = heaps.begin(); it != heaps.end(); ++it)
+		{
+			HEAP_ROW row;
+			row.heap = it->first;
+			row.counters = it->second;
+			summary.push_back(row);
+		}
+		PIN_ReleaseLock(&statsLock);
+		std::sort(summary.begin(), summary.end(), comparePeak);
+		saveToLog(file, "\n\nHeaps: %u\n%18s %16s %12s %16s %12s %12s\n", (UINT32) summary.size(),
+			"heap", "live bytes", "live chunks", "peak bytes", "allocs", "frees");
+		for (size_t i = 0; i < summary.size(); i++)
+		{
+			const HEAP_COUNTERS& counters = summary[i].counters;
+			saveToLog(file, "%18p %16lld %12lld %16lld %12llu %12llu\n", summary[i].heap, (long long) counters.livebytes,
+				(long long) counters.livechunks, (long long) counters.peakbytes, (unsigned long long) counters.allocs,
+				(unsigned long long) counters.frees);
+		}
+	}
+
+	void close()
+	{
+		if (csv != NULL)
+		{
+			fclose(csv);
+			csv = NULL;
+		}
+	}
+
+private:
+	FILE* csv;
+	UINT32 interval;					// ms between two rows
+	UINT64 foldticks;					// cycles between two folds of a thread
+	UINT64 starttime;					// wall clock, us
+	UINT64 lastrow;
+	std::atomic<HEAP_DELTAS*> deltas[MAX_THREADS];	// created by their own thread
+	PIN_LOCK statsLock;					// protects heaps
+	std::map<ADDRINT, HEAP_COUNTERS> heaps;
+	vector<HEAP_ROW> rows;				// drain thread and Fini only
+
+	static bool comparePeak(const HEAP_ROW& a, const HEAP_ROW& b)
+	{
+		return a.counters.peakbytes > b.counters.peakbytes;
+	}
+
+	HEAP_COUNTERS& getCounters(ADDRINT heap)
+	{
+		std::map<ADDRINT, HEAP_COUNTERS>::iterator it = heaps.find(heap);
+		if (it == heaps.end())
+		{
+			HEAP_COUNTERS counters;
+			memset(&counters, 0, sizeof(counters));
+			it = heaps.insert(std::make_pair(heap, counters)).first;
+		}
+		return it->second;
+	}
+
+	// caller must be the thread that owns the table
+	void foldThread(HEAP_DELTAS& thread)
+	{
+		if (thread.used == 0)
+		{
+			return;
+		}
+		PIN_GetLock(&statsLock, PIN_ThreadId() + 1);
+		for (UINT32 i = 0; i < thread.used; i++)
+		{
+			apply(thread.slots[i]);
+		}
+		PIN_ReleaseLock(&statsLock);
+		thread.used = 0;
+		thread.events = 0;
+	}
+
+	// caller must hold statsLock
+	void apply(const HEAP_DELTA& delta)
+	{
+		HEAP_COUNTERS& counters = getCounters(delta.heap);
+		counters.livebytes += delta.livebytes;
+		counters.livechunks += delta.livechunks;
+		counters.allocs += delta.allocs;
+		counters.frees += delta.frees;
+		counters.allocbytes += delta.allocbytes;
+		if (counters.livebytes > counters.peakbytes)
+		{
+			counters.peakbytes = counters.livebytes;
+		}
+		counters.changed = true;
+	}
+
+	void add(THREADID tid, const HEAP_DELTA& change, UINT64 clock)
+	{
+		if (tid >= MAX_THREADS)
+		{
+			// no table for this thread
+			PIN_GetLock(&statsLock, tid + 1);
+			apply(change);
+			PIN_ReleaseLock(&statsLock);
+			return;
+		}
+		HEAP_DELTAS* thread = deltas[tid].load(std::memory_order_relaxed);
+		if (thread == NULL)
+		{
+			// first heap operation on this thread (or thread id), only this thread creates its table
+			thread = new HEAP_DELTAS();
+			thread->foldrequest.store(0, std::memory_order_relaxed);
+			thread->lastfold = clock;
+			deltas[tid].store(thread, std::memory_order_release);
+		}
+		UINT32 i = 0;
+		while (i < thread->used && thread->slots[i].heap != change.heap)
+		{
+			i++;
+		}
+		if (i == thread->used)
+		{
+			if (i == HEAP_DELTA_SLOTS)
+			{
+				foldThread(*thread);
+				i = 0;
+			}
+			thread->slots[i] = change;
+			thread->used++;
+		}
+		else
+		{
+			HEAP_DELTA& delta = thread->slots[i];
+			delta.livebytes += change.livebytes;
+			delta.livechunks += change.livechunks;
+			delta.allocs += change.allocs;
+			delta.frees += change.frees;
+			delta.allocbytes += change.allocbytes;
+		}
+		// a plain load, the flag's cache line is only written when the drain thread asks
+		if (++thread->events >= HEAP_FOLD_EVENTS || clock - thread->lastfold >= foldticks ||
+			thread->foldrequest.load(std::memory_order_relaxed) != 0)
+		{
+			thread->foldrequest.store(0, std::memory_order_relaxed);
+			foldThread(*thread);
+			thread->lastfold = clock;
+		}
+	}
+};
+
+CHeapStats heapStats;
+
+
+/* ================================================================== */
+// Use after free detection (-uafcheck 1)
+/* ================================================================== */
+
+// Shadow bitmap with one bit per 8 byte granule, set while the granule belongs to a freed
+// chunk that hasn't been handed out again. Every memory access is checked against it inline.
+// Each leaf covers 64KB. Untouched regions all point to the same all-zero leaf, so the check
+// needs no branches. On Intel64 regions 4GB apart share a leaf, the exact check sorts that out
+#define SHADOW_REGION_BITS 16
+#define SHADOW_GRANULE_BITS 3
+#define SHADOW_TOP_ENTRIES 0x10000
+#define SHADOW_LEAF_WORDS ((1 << (SHADOW_REGION_BITS - SHADOW_GRANULE_BITS)) / 32)
+
+UINT32 ShadowZeroLeaf[SHADOW_LEAF_WORDS];
+UINT32* ShadowTop[SHADOW_TOP_ENTRIES];
+
+struct UAF_CHUNK
+{
+	UINT32 size;
+	BOOL freed;
+	ADDRINT alloc_caller;
+	UINT32 alloc_stackid;
+	ADDRINT free_caller;
+	UINT32 free_stackid;
+};
+
+
+// Exact bookkeeping behind the shadow bitmap. The allocator hooks update it directly, because
+// a use after free can happen right after the free, long before the drain thread gets to it
+class CUafTracker
+{
+public:
+	CUafTracker()
+	{
+		PIN_InitLock(&uafLock);
+		for (UINT32 i = 0; i < SHADOW_TOP_ENTRIES; i++)
+		{
+			ShadowTop[i] = ShadowZeroLeaf;
+		}
+	}
+
+	void allocated(ADDRINT addr, UINT32 size, ADDRINT caller, UINT32 stackid)
+	{
+		PIN_GetLock(&uafLock, PIN_ThreadId() + 1);
+		// forget about freed chunks this allocation reuses
+		std::map<ADDRINT, UAF_CHUNK>::iterator it = chunks.lower_bound(addr + size);
+		while (it != chunks.begin())
+		{
+			--it;
+			if (it->first + it->second.size <= addr)
+			{
+				break;
+			}
+			if (it->second.freed)
+			{
+				setShadow(it->first, it->second.size, false);
+			}
+			chunks.erase(it++);
+		}
+		UAF_CHUNK& chunk = chunks[addr];
+		chunk.size = size;
+		chunk.freed = false;
+		chunk.alloc_caller = caller;
+		chunk.alloc_stackid = stackid;
+		chunk.free_caller = 0;
+		chunk.free_stackid = 0;
+		PIN_ReleaseLock(&uafLock);
+	}
+
+	void freed(ADDRINT addr, ADDRINT caller, UINT32 stackid)
+	{
+		PIN_GetLock(&uafLock, PIN_ThreadId() + 1);
+		std::map<ADDRINT, UAF_CHUNK>::iterator it = chunks.find(addr);
+		if (it != chunks.end() && !it->second.freed)
+		{
+			markFreed(it, caller, stackid);
+		}
+		PIN_ReleaseLock(&uafLock);
+	}
+
+	// size and allocation caller of the live chunk at addr, false if there is none
+	bool findLive(ADDRINT addr, UINT32& size, ADDRINT& alloccaller)
+	{
+		PIN_GetLock(&uafLock, PIN_ThreadId() + 1);
+		std::map<ADDRINT, UAF_CHUNK>::iterator it = chunks.find(addr);
+		bool found = it != chunks.end() && !it->second.freed;
+		if (found)
+		{
+			size = it->second.size;
+			alloccaller = it->second.alloc_caller;
+		}
+		PIN_ReleaseLock(&uafLock);
+		return found;
+	}
+
+	// like freed, but only if addr still holds the chunk findLive returned earlier
+	void freedIf(ADDRINT addr, UINT32 size, ADDRINT alloccaller, ADDRINT caller, UINT32 stackid)
+	{
+		PIN_GetLock(&uafLock, PIN_ThreadId() + 1);
+		std::map<ADDRINT, UAF_CHUNK>::iterator it = chunks.find(addr);
+		if (it != chunks.end() && !it->second.freed && it->second.size == size && it->second.alloc_caller == alloccaller)
+		{
+			markFreed(it, caller, stackid);
+		}
+		PIN_ReleaseLock(&uafLock);
+	}
+
+	// exact check behind a shadow hit. Fills in the chunk and returns true if address is really in a freed chunk
+	bool findFreed(ADDRINT address, ADDRINT& start, UAF_CHUNK& result)
+	{
+		bool found = false;
+		PIN_GetLock(&uafLock, PIN_ThreadId() + 1);
+		std::map<ADDRINT, UAF_CHUNK>::iterator it = chunks.upper_bound(address);
+		if (it != chunks.begin())
+		{
+			--it;
+			if (it->second.freed && address < it->first + it->second.size)
+			{
+				start = it->first;
+				result = it->second;
+				found = true;
+			}
+		}
+		PIN_ReleaseLock(&uafLock);
+		return found;
+	}
+
+	// true the first time an instruction is reported
+	bool firstReport(ADDRINT ip)
+	{
+		PIN_GetLock(&uafLock, PIN_ThreadId() + 1);
+		bool first = reported.insert(ip).second;
+		PIN_ReleaseLock(&uafLock);
+		return first;
+	}
+
+private:
+	std::map<ADDRINT, UAF_CHUNK> chunks;	// live and freed chunks by start address
+	std::set<ADDRINT> reported;				// instructions we already reported
+	PIN_LOCK uafLock;
+
+	// caller must hold uafLock
+	void markFreed(std::map<ADDRINT, UAF_CHUNK>::iterator it, ADDRINT caller, UINT32 stackid)
+	{
+		it->second.freed = true;
+		it->second.free_caller = caller;
+		it->second.free_stackid = stackid;
+		setShadow(it->first, it->second.size, true);
+	}
+
+	// caller must hold uafLock
+	void setShadow(ADDRINT addr, UINT32 size, bool value)
+	{
+		ADDRINT end = addr + size;
+		for (ADDRINT granule = addr & ~(ADDRINT) 7; granule < end; granule += 8)
+		{
+			UINT32*& leaf = ShadowTop[(granule >> SHADOW_REGION_BITS) & (SHADOW_TOP_ENTRIES - 1)];
+			if (leaf == ShadowZeroLeaf)
+			{
+				if (!value)
+				{
+					// nothing to clear in this region, skip to the next one
+					granule = (granule | ((1 << SHADOW_REGION_BITS) - 1)) - 7;
+					continue;
+				}
+				UINT32* newleaf = new UINT32[SHADOW_LEAF_WORDS];
+				memset(newleaf, 0, sizeof(UINT32) * SHADOW_LEAF_WORDS);
+				leaf = newleaf;
+			}
+			UINT32 bit = 1u << ((granule >> SHADOW_GRANULE_BITS) & 31);
+			UINT32& word = leaf[(granule & ((1 << SHADOW_REGION_BITS) - 1)) >> (SHADOW_GRANULE_BITS + 5)];
+			word = value ? (word | bit) : (word & ~bit);
+		}
+	}
+};
+
+CUafTracker uafTracker;
+
+
+/* ===================================================================== */
+// Command line switches
+/* ===================================================================== */
+
+KNOB<BOOL>   KnobLogAlloc(KNOB_MODE_WRITEONCE,  "pintool",
+	"logalloc", "1", "Log heap allocations (RtlAllocateHeap, RtlReAllocateHeap and VirtualAlloc)");
+
+KNOB<BOOL>   KnobLogFree(KNOB_MODE_WRITEONCE,  "pintool",
+	"logfree", "1", "Log heap free operations (RtlFreeHeap)");
+
+KNOB<BOOL>   KnobShowTimeStamp(KNOB_MODE_WRITEONCE,  "pintool",
+	"timestamp", "0", "Show timestamps in output");
+
+KNOB<BOOL>   KnobTimeStampUs(KNOB_MODE_WRITEONCE,  "pintool",
+	"timestampus", "0", "Add microseconds to the timestamps of -timestamp");
+
+KNOB<BOOL>   KnobSplitFiles(KNOB_MODE_WRITEONCE,  "pintool",
+	"splitfiles", "0", "Split output into PID-specific files");
+
+KNOB<BOOL>   KnobSharedClock(KNOB_MODE_WRITEONCE,  "pintool",
+	"sharedclock", "0", "Write a self-describing log per process, with the cycle counter on every heap event, for heaplog_merge");
+
+KNOB<BOOL>   KnobStaySilent(KNOB_MODE_WRITEONCE,  "pintool",
+	"silent", "0", "Silent mode, do not log allocs & frees to log file");
+
+KNOB<BOOL>   KnobBufferOutput(KNOB_MODE_WRITEONCE,  "pintool",
+	"bufferoutput", "1", "Buffer output in memory and write it to file from a separate thread");
+
+KNOB<UINT32> KnobBufferSize(KNOB_MODE_WRITEONCE,  "pintool",
+	"buffersize", "1024", "Size of each of the two output buffers, in KB");
+
+KNOB<UINT32> KnobFlushInterval(KNOB_MODE_WRITEONCE,  "pintool",
+	"flushinterval", "1000", "Write buffered output to file at least every <value> ms");
+
+KNOB<BOOL>   KnobCompress(KNOB_MODE_WRITEONCE,  "pintool",
+	"compress", "0", "Write the log as compressed blocks with a block index to corelan_heaplog_<pid>.hlz, read it with hlz_reader");
+
+KNOB<UINT32> KnobBlockSize(KNOB_MODE_WRITEONCE,  "pintool",
+	"blocksize", "256", "Uncompressed size of a compressed block, in KB");
+
+KNOB<BOOL>   KnobProfile(KNOB_MODE_WRITEONCE,  "pintool",
+	"profile", "0", "Don't log individual heap operations, print a per call site summary at exit");
+
+KNOB<UINT32> KnobSampleRate(KNOB_MODE_WRITEONCE,  "pintool",
+	"samplerate", "1", "Only record 1 in <value> allocations of each thread");
+
+KNOB<UINT32> KnobSampleBytes(KNOB_MODE_WRITEONCE,  "pintool",
+	"samplebytes", "0", "Record on average one allocation per <value> allocated bytes, allocations of at least <value> bytes are always recorded. 0 disables");
+
+KNOB<UINT32> KnobMinSize(KNOB_MODE_WRITEONCE,  "pintool",
+	"minsize", "0", "Only record allocations of at least <value> bytes");
+
+KNOB<UINT32> KnobMaxSize(KNOB_MODE_WRITEONCE,  "pintool",
+	"maxsize", "0", "Only record allocations of at most <value> bytes. 0 means no limit");
+
+KNOB<BOOL>   KnobUafCheck(KNOB_MODE_WRITEONCE,  "pintool",
+	"uafcheck", "0", "Check every memory read and write against freed heap chunks, and log use after free");
+
+KNOB<UINT32> KnobHistoryMB(KNOB_MODE_WRITEONCE,  "pintool",
+	"historymb", "256", "Memory budget for the chunk history in MB. The chunks that have been freed the longest are forgotten first. 0 means no limit");
+
+KNOB<UINT32> KnobLeakReport(KNOB_MODE_WRITEONCE,  "pintool",
+	"leakreport", "0", "Only show the top <value> allocation sites in the live heap report at exit. 0 shows all of them");
+
+KNOB<string> KnobHookMode(KNOB_MODE_WRITEONCE,  "pintool",
+	"hookmode", "insert", "How allocators are hooked: insert (analysis calls at entry and exit) or replace (a wrapper calls the original function)");
+
+KNOB<BOOL>   KnobControl(KNOB_MODE_WRITEONCE,  "pintool",
+	"control", "0", "Accept commands from heaplog_ctl while the application runs");
+
+KNOB<string> KnobModules(KNOB_MODE_APPEND,  "pintool",
+	"modules", "", "Only record allocations made from modules whose name contains <value>. Comma separated, can be given more than once");
+
+KNOB<string> KnobExcludeModules(KNOB_MODE_APPEND,  "pintool",
+	"excludemodules", "", "Don't record allocations made from modules whose name contains <value>. Comma separated, can be given more than once");
+
+KNOB<UINT32> KnobHeapStats(KNOB_MODE_WRITEONCE,  "pintool",
+	"heapstats", "0", "Write live bytes, live chunks, peak bytes and allocation rate per heap to corelan_heaplog_heaps_<pid>.csv every <value> ms. 0 disables");
+
+KNOB<BOOL>   KnobRecordTrace(KNOB_MODE_WRITEONCE,  "pintool",
+	"recordtrace", "0", "Record a replayable allocation trace to corelan_heaplog_<pid>.trace, replay it with heaplog_replay");
+
+KNOB<UINT32> KnobStackDepth(KNOB_MODE_WRITEONCE,  "pintool",
+	"stackdepth", "0", "Record call stacks of up to <value> frames (max 64), by walking the frame pointer chain. 0 disables");
+
+/* ===================================================================== */
+// Utilities
+/* ===================================================================== */
+
+INT32 Usage()
+{
+
+	return -1;
+}
+
+void CloseLogFile()
+{
+	// the exception handler may have closed it already
+	if (LogFile == NULL)
+	{
+		return;
+	}
+	const char * eof = "############## EOF\n";
+	if (CompressOutput)
+	{
+		// goes in the last block, before the block index
+		LogWriter.write(eof, strlen(eof));
+	}
+	// first dump remaining log entries to file, if any
+	LogWriter.close();
+	// wrap up
+	if (ExceptionLogFile != NULL)
+	{
+		std::fprintf(ExceptionLogFile,"\nClosing log file for PID %u\n", PIN_GetPid());
+	}
+	if (!CompressOutput)
+	{
+		std::fprintf(LogFile, "%s", eof);
+	}
+	fflush(LogFile);
+	fclose(LogFile);
+	LogFile = NULL;
+}
+
+void CloseExceptionLogFile()
+{
+	if (ExceptionLogFile == NULL)
+	{
+		return;
+	}
+	std::fprintf(ExceptionLogFile,"Closing exception log file for PID %u\n", PIN_GetPid());
+	std::fprintf(ExceptionLogFile, "############## EOF\n");
+	fflush(ExceptionLogFile);
+	fclose(ExceptionLogFile);
+	ExceptionLogFile = NULL;
+}
+
+
+string getCurrentDateTimeStr()
+{
+	time_t thistime;
+	thistime = time(0);
+	char * ascii_time;
+	struct tm * timeinfo;
+	time ( & thistime);
+	timeinfo = localtime ( & thistime);
+	ascii_time = strtok(asctime(timeinfo),"\n");
+	stringstream returnval;
+	returnval << ascii_time;
+	return returnval.str();
+}
+
+
+void saveOperation(const HEAP_EVENT& op)
+{
+	// keep the operation and make it findable by address
+	chunkIndex.add(op);
+}
+
+void saveModToArray(CModuleImage& modimage)
+{
+	// saving, just in case I want to do something with it later
+	arrLoadedModules.push_back(modimage);
+	moduleRanges.publish(arrLoadedModules);
+}
+
+void removeModFromArray(ADDRINT base)
+{
+	for (size_t i = 0; i < arrLoadedModules.size(); i++)
+	{
+		if (arrLoadedModules[i].getBase() == base)
+		{
+			arrLoadedModules.erase(arrLoadedModules.begin() + i);
+			break;
+		}
+	}
+	moduleRanges.publish(arrLoadedModules);
+}
+
+
+string getModuleImageNameByAddress(ADDRINT address)
+{
+	string returnval = "";
+	IMG theimage;
+	PIN_LockClient();
+	theimage = IMG_FindByAddress(address);
+	PIN_UnlockClient();
+	if (IMG_Valid(theimage))
+	{
+		returnval = IMG_Name(theimage);
+	}
+	return returnval;
+}
+
+
+// resolve the module a caller belongs to, without copying its name around or taking a lock
+UINT16 getModuleIdByAddress(THREADID tid, ADDRINT address)
+{
+	return moduleRanges.find(tid, address);
+}
+
+
+string getAddressInfo(ADDRINT address)
+{
+	stringstream ss;
+	string info = "";
+	string modulename = "";
+	if (address > 0)
+	{
+		// check if address belongs to module or is part of heap
+		modulename = getModuleImageNameByAddress(address);
+		if (!modulename.empty())
+		{
+			ss << "(" << modulename << ")";
+			info = ss.str();
+		}
+		else
+		{
+			ss << "";
+			vector<HISTORY_ENTRY> operations = chunkIndex.find(address);
+			for (size_t i = 0; i < operations.size(); i++)
+			{
+				const HEAP_EVENT& op = operations[i].ev;
+				ss << OperationNames[op.operation] << "(0x" << std::hex << op.chunk_size << ") ";
+			}
+			info = ss.str();
+		}
+	}
+	return info;
+}
+
+
+// write the stacks that were added to the depot since last time, up to and including 'lastid'
+void saveStacksToLog(UINT32 lastid)
+{
+	for (; nrStacksLogged < lastid; nrStacksLogged++)
+	{
+		const STACK_NODE* node = stackDepot.get(nrStacksLogged + 1);
+		if (node == NULL)
+		{
+			break;
+		}
+		eventText.str("** Stack ").dec(node->id).str(":");
+		for (UINT32 i = 0; i < node->depth; i++)
+		{
+			eventText.str(" 0x").ptr(node->frames[i]);
+		}
+		eventText.str(" **\n");
+	}
+}
+
+
+// caller address, with module and offset if we know them
+void formatCaller(ADDRINT caller, char* buffer, size_t size)
+{
+	MODULE_RANGE range;
+	if (moduleRanges.findRange(caller, range))
+	{
+		snprintf(buffer, size, "0x%p (%s+0x%x)", (void *) caller, moduleTable.getName(range.id), (UINT32) (caller - range.base));
+	}
+	else
+	{
+		snprintf(buffer, size, "0x%p", (void *) caller);
+	}
+}
+
+
+// print the call site summary, most bytes first
+void saveProfileToLog()
+{
+	vector<PROFILE_SITE*> sites = profile.getSortedSites();
+	saveToLog(LogFile, "\n\nHeap profile, %u call sites:\n", (UINT32) sites.size());
+	saveToLog(LogFile, "%-18s %-10s %12s %16s %16s %16s  %s\n", "operation", "size", "calls", "bytes", "live bytes", "peak bytes", "caller");
+	for (size_t i = 0; i < sites.size(); i++)
+	{
+		const PROFILE_SITE* site = sites[i];
+		char caller[300];
+		formatCaller(site->key.caller, caller, sizeof(caller));
+		char sizeclass[32];
+		snprintf(sizeclass, sizeof(sizeclass), "<0x%llx", 2ULL << site->key.sizeclass);
+		char stack[32] = "";
+		if (site->key.stackid != 0)
+		{
+			snprintf(stack, sizeof(stack), " stack %u", site->key.stackid);
+		}
+		saveToLog(LogFile, "%-18s %-10s %12llu %16llu %16llu %16llu  %s%s\n", OperationNames[site->key.operation], sizeclass,
+			site->calls, site->bytes, site->livebytes, site->peakbytes, caller, stack);
+	}
+}
+
+
+struct LEAK_SITE
+{
+	UINT32 site;				// stack id in stackDepot
+	UINT64 chunks;
+	UINT64 bytes;
+};
+
+bool compareLeakBytes(const LEAK_SITE* a, const LEAK_SITE* b)
+{
+	return a->bytes > b->bytes;
+}
+
+
+// adds the live chunks to their allocation site, in a single pass over chunkTable
+class CLeakAggregator
+{
+public:
+	UINT64 chunks;
+	UINT64 bytes;
+	std::unordered_map<UINT32, LEAK_SITE> sites;
+
+	CLeakAggregator()
+	{
+		chunks = 0;
+		bytes = 0;
+	}
+
+	void operator()(ADDRINT start, UINT32 size, UINT32 site)
+	{
+		LEAK_SITE& leak = sites[site];
+		leak.site = site;
+		leak.chunks++;
+		leak.bytes += size;
+		chunks++;
+		bytes += size;
+	}
+};
+
+
+// print the chunks that are still allocated, grouped by allocation site, most bytes first.
+// Only the top maxsites sites are shown, 0 shows all of them
+void saveLiveHeapToLog(FILE* file, UINT32 maxsites, const char * title)
+{
+	CLeakAggregator live;
+	chunkTable.forEachLive(live);
+
+	vector<const LEAK_SITE*> sorted;
+	sorted.reserve(live.sites.size());
+	for (std::unordered_map<UINT32, LEAK_SITE>::const_iterator it = live.sites.begin(); it != live.sites.end(); ++it)
+	{
+		sorted.push_back(&it->second);
+	}
+	size_t count = sorted.size();
+	if (maxsites > 0 && count > maxsites)
+	{
+		// only the top sites need to be in order
+		count = maxsites;
+		std::partial_sort(sorted.begin(), sorted.begin() + count, sorted.end(), compareLeakBytes);
+	}
+	else
+	{
+		std::sort(sorted.begin(), sorted.end(), compareLeakBytes);
+	}
+
+	saveToLog(file, "\n\n%s: %llu chunks, %llu bytes, %u allocation sites", title, live.chunks, live.bytes, (UINT32) sorted.size());
+	if (count < sorted.size())
+	{
+		saveToLog(file, " (top %u)", (UINT32) count);
+	}
+	saveToLog(file, ":\n%12s %16s  %s\n", "chunks", "bytes", "allocation site");
+	for (size_t i = 0; i < count; i++)
+	{
+		const LEAK_SITE* leak = sorted[i];
+		const STACK_NODE* node = stackDepot.get(leak->site);
+		char caller[300] = "unknown";
+		if (node != NULL && node->depth > 0)
+		{
+			formatCaller(node->frames[0], caller, sizeof(caller));
+		}
+		char stack[32] = "";
+		if (StackDepth > 0 && leak->site != 0)
+		{
+			snprintf(stack, sizeof(stack), " stack %u", leak->site);
+		}
+		saveToLog(file, "%12llu %16llu  %s%s\n", leak->chunks, leak->bytes, caller, stack);
+	}
+}
+
+
+// wrapper to either write output to LogFile directly, or to buffer it first
+void saveToLog(FILE* Log, const char * fmt, ...)
+{
+	va_list args;
+	// convert to string first
+		
+	char entry [512]; // truncate after that
+	va_start(args, fmt);
+	vsnprintf(entry, 511, fmt, args);
+	va_end(args);
+
+	if (BufferOutput && Log == LogFile)
+	{
+		LogWriter.write(entry, strlen(entry));
+	}
+	else if (Log != NULL)
+	{
+		// write to file directly
+		std::fprintf(Log, "%s", entry);
+	}
+	
+}
+
+
+
+/* ===================================================================== */
+// Event drain (runs on the drain thread, or on whoever needs all events processed right now)
+/* ===================================================================== */
+
+bool compareClock(const RING_ENTRY& a, const RING_ENTRY& b)
+{
+	return a.clock < b.clock;
+}
+
+
+// update the shared state for one heap event. Caller must hold drainLock
+VOID processHeapEvent(HEAP_EVENT& ev)
+{
+	if ((ev.flags & EV_MOVED_FROM) != 0)
+	{
+		// not logged, the realloc that follows is
+		traceWriter.add(ev);
+		if (ProfileMode)
+		{
+			profile.release(ev.chunk_start);
+		}
+		else
+		{
+			chunkIndex.retire(ev.chunk_start);
+		}
+		return;
+	}
+	nrHeapOperations++;
+	if (RecordTrace)
+	{
+		traceWriter.add(ev);
+	}
+	if (ev.stackid > nrStacksLogged)
+	{
+		saveStacksToLog(ev.stackid);
+	}
+	if (ProfileMode)
+	{
+		// only aggregate, no per event output or history
+		profile.add(ev);
+		checkHeapEvent(ev);
+	}
+	else
+	{
+		logHeapEvent(ev);
+		checkHeapEvent(ev);
+		saveOperation(ev);
+	}
+}
+
+
+// Move everything the application threads have queued so far into the shared state.
+// Only events stamped before we started are taken, and nothing stamped after the last queued
+// event of a thread that is stamping a new one (see CEventRing::hold). That event would be older,
+// so it gets picked up in a next pass, together with everything stamped after it. The log is
+// in clock order this way, which heaplog_merge relies on. Only threads past MAX_THREADS,
+// which have no ring, may log an event ahead of an older one
+VOID drainEvents()
+{
+	PIN_GetLock(&drainLock, PIN_ThreadId() + 1);
+	eventClock.calibrate();
+	UINT64 until = readClock();
+	UINT32 nrrings = nrThreadRings.load(std::memory_order_acquire);
+
+	for (UINT32 i = 0; i < nrrings; i++)
+	{
+		CEventRing* ring = threadRings[i].load(std::memory_order_acquire);
+		if (ring != NULL)
+		{
+			until = min(until, ring->heldSince());
+		}
+	}
+
+	drainBatch.clear();
+	for (UINT32 i = 0; i < nrrings; i++)
+	{
+		CEventRing* ring = threadRings[i].load(std::memory_order_acquire);
+		if (ring != NULL)
+		{
+			ring->take(until, drainBatch);
+		}
+	}
+
+	// each ring is already in order, stable_sort keeps it that way for identical stamps
+	std::stable_sort(drainBatch.begin(), drainBatch.end(), compareClock);
+	for (size_t i = 0; i < drainBatch.size(); i++)
+	{
+		processHeapEvent(drainBatch[i].ev);
+	}
+	eventText.flush();
+	PIN_ReleaseLock(&drainLock);
+}
+
+
+VOID DrainThread(VOID * arg)
+{
+	while (!DrainThreadExit)
+	{
+		PIN_SemaphoreTimedWait(&drainSemaphore, DRAIN_INTERVAL);
+		PIN_SemaphoreClear(&drainSemaphore);
+		drainEvents();
+		if (HeapStatsInterval > 0)
+		{
+			heapStats.writeRows(false);
+		}
+	}
+}
+
+
+CEventRing* getThreadRing(THREADID tid)
+{
+	CEventRing* ring = threadRings[tid].load(std::memory_order_relaxed);
+	if (ring == NULL)
+	{
+		// first event on this thread (or thread id), only this thread ever creates its ring
+		ring = new CEventRing();
+		threadRings[tid].store(ring, std::memory_order_release);
+		UINT32 nrrings = nrThreadRings.load(std::memory_order_relaxed);
+		while (nrrings < tid + 1 && !nrThreadRings.compare_exchange_weak(nrrings, tid + 1))
+		{
+		}
+	}
+	return ring;
+}
+
+
+// Read the clock for a new event of this thread. The event must be queued next, or dropped with
+// unstampEvent, the drain holds back everything stamped later until then (see drainEvents)
+UINT64 stampEvent(THREADID tid)
+{
+	if (tid < MAX_THREADS)
+	{
+		getThreadRing(tid)->hold();
+	}
+	return readClock();
+}
+
+
+VOID unstampEvent(THREADID tid)
+{
+	if (tid < MAX_THREADS)
+	{
+		getThreadRing(tid)->unhold();
+	}
+}
+
+
+
+/* ===================================================================== */
+// Control channel (-control 1)
+/* ===================================================================== */
+
+// heaplog_ctl drops a command in corelan_heaplog_<pid>.cmd, the control thread picks it up and
+// answers in corelan_heaplog_<pid>.reply. Both files are written under a temporary name and
+// renamed, so neither side ever reads a half written one. Files work the same on every OS
+// and need nothing from Pin's CRT beyond stdio
+#define CONTROL_INTERVAL 100		// ms between two looks at the command file
+
+string ControlCommandFile;
+string ControlReplyFile;
+
+
+// all events so far in the log, and the log on disk
+VOID controlFlush(FILE* reply)
+{
+	drainEvents();
+	if (BufferOutput)
+	{
+		LogWriter.flush(NULL, 0);
+	}
+	else if (LogFile != NULL)
+	{
+		fflush(LogFile);
+	}
+	fprintf(reply, "Log flushed, %llu heap operations so far\n", (unsigned long long) nrHeapOperations);
+}
+
+
+VOID controlStats(FILE* reply)
+{
+	drainEvents();
+	UINT64 livechunks, freedchunks, slots;
+	chunkTable.getCounts(livechunks, freedchunks, slots);
+	PIN_GetLock(&drainLock, PIN_ThreadId() + 1);
+	fprintf(reply, "Heap operations: %llu\n", (unsigned long long) nrHeapOperations);
+	fprintf(reply, "Logging: %s\n", StaySilent ? "off" : "on");
+	fprintf(reply, "Threads: %u\n", nrThreadRings.load(std::memory_order_acquire));
+	fprintf(reply, "Chunk table: %llu live, %llu freed chunks in %llu slots\n", livechunks, freedchunks, slots);
+	saveChunkIndexStats(reply);
+	PIN_ReleaseLock(&drainLock);
+	if (HeapStatsInterval > 0)
+	{
+		// what the threads folded so far
+		heapStats.requestFolds();
+		heapStats.saveStatsToLog(reply);
+	}
+}
+
+
+// everything the chunk history knows about the chunks that contain address
+VOID controlHistory(FILE* reply, ADDRINT address)
+{
+	drainEvents();
+	UINT32 size;
+	UINT32 state = chunkTable.lookup(address, size);
+	if (state == CHUNK_LIVE)
+	{
+		fprintf(reply, "0x%p: live chunk, size 0x%x\n", (void *) address, size);
+	}
+	else if (state == CHUNK_FREED)
+	{
+		fprintf(reply, "0x%p: freed chunk\n", (void *) address);
+	}
+	PIN_GetLock(&drainLock, PIN_ThreadId() + 1);
+	vector<HISTORY_ENTRY> operations = chunkIndex.find(address);
+	for (size_t i = 0; i < operations.size(); i++)
+	{
+		const HEAP_EVENT& op = operations[i].ev;
+		char caller[300];
+		formatCaller(op.saved_return_pointer, caller, sizeof(caller));
+		fprintf(reply, "%s | %s 0x%p size 0x%x thread %u from %s\n", eventClock.format(op.timestamp, ShowMicroseconds),
+			OperationNames[op.operation], (void *) (ADDRINT) op.chunk_start, op.chunk_size, op.threadid, caller);
+	}
+	PIN_ReleaseLock(&drainLock);
+	if (operations.empty())
+	{
+		fprintf(reply, "No operations on 0x%p remembered\n", (void *) address);
+	}
+}
+
+
+VOID controlLogging(FILE* reply, const char * value)
+{
+	PIN_GetLock(&drainLock, PIN_ThreadId() + 1);
+	if (strcmp(value, "on") == 0 || strcmp(value, "off") == 0)
+	{
+		// events queued until now are still written as the setting was
+		StaySilent = (strcmp(value, "off") == 0);
+	}
+	fprintf(reply, "Logging: %s\n", StaySilent ? "off" : "on");
+	PIN_ReleaseLock(&drainLock);
+}
+
+
+// run one command, "<sequence number> <command> [<argument>]"
+VOID runControlCommand(const char * line, FILE* reply)
+{
+	unsigned int seq = 0;
+	char command[32] = "";
+	char argument[64] = "";
+	if (sscanf(line, "%u %31s %63s", &seq, command, argument) < 2)
+	{
+		fprintf(reply, "0\nBad command\n");
+		return;
+	}
+	fprintf(reply, "%u\n", seq);
+	if (strcmp(command, "flush") == 0)
+	{
+		controlFlush(reply);
+	}
+	else if (strcmp(command, "stats") == 0)
+	{
+		controlStats(reply);
+	}
+	else if (strcmp(command, "live") == 0)
+	{
+		saveLiveHeapToLog(reply, (UINT32) strtoul(argument, NULL, 10), "Live heap");
+	}
+	else if (strcmp(command, "history") == 0 && argument[0] != 0)
+	{
+		controlHistory(reply, (ADDRINT) strtoull(argument, NULL, 16));
+	}
+	else if (strcmp(command, "log") == 0)
+	{
+		controlLogging(reply, argument);
+	}
+	else
+	{
+		fprintf(reply, "Unknown command %s. Commands: flush, stats, live [<sites>], history <address>, log [on|off]\n", command);
+	}
+}
+
+
+VOID ControlThread(VOID * arg)
+{
+	string replyTemp = ControlReplyFile + ".tmp";
+	while (!ControlThreadExit)
+	{
+		PIN_SemaphoreTimedWait(&controlSemaphore, CONTROL_INTERVAL);
+		FILE* commandFile = fopen(ControlCommandFile.c_str(), "r");
+		if (commandFile == NULL)
+		{
+			continue;
+		}
+		char line[128] = "";
+		if (fgets(line, sizeof(line), commandFile) == NULL)
+		{
+			line[0] = 0;
+		}
+		fclose(commandFile);
+		remove(ControlCommandFile.c_str());
+
+		FILE* reply = fopen(replyTemp.c_str(), "w");
+		if (reply == NULL)
+		{
+			continue;
+		}
+		runControlCommand(line, reply);
+		fclose(reply);
+		remove(ControlReplyFile.c_str());
+		rename(replyTemp.c_str(), ControlReplyFile.c_str());
+	}
+}
+
+
+/* ===================================================================== */
+// Analysis routines (runtime)
+/* ===================================================================== */
+
+// per thread sampling state, a cache line each so threads don't share them
+struct alignas(64) SAMPLE_STATE
+{
+	UINT32 counter;			// allocations since the last one we sampled (-samplerate)
+	INT64 bytesleft;		// bytes to go until the next sample (-samplebytes)
+	UINT32 random;			// xorshift state
+};
+
+static_assert(sizeof(SAMPLE_STATE) == 64, "SAMPLE_STATE should be one cache line");
+
+SAMPLE_STATE sampleStates[MAX_THREADS];
+
+
+// bytes until the next sample, exponentially distributed around SampleBytes, like tcmalloc does it
+INT64 nextSampleDistance(SAMPLE_STATE& state, THREADID tid)
+{
+	if (state.random == 0)
+	{
+		state.random = (UINT32) readClock() ^ (tid * 2654435761u) ^ 1;
+	}
+	state.random ^= state.random << 13;
+	state.random ^= state.random >> 17;
+	state.random ^= state.random << 5;
+	double u = (state.random >> 8) / 16777216.0 + 1.0 / 33554432.0;		// (0,1)
+	return (INT64) (-log(u) * SampleBytes) + 1;
+}
+
+
+// decide if an allocation gets recorded. Only touches this thread's own state
+BOOL sampleAllocation(THREADID tid, UINT32 size)
+{
+	if (size < MinSize || size > MaxSize)
+	{
+		return false;
+	}
+	if (tid >= MAX_THREADS)
+	{
+		return true;
+	}
+	SAMPLE_STATE& state = sampleStates[tid];
+	if (SampleRate > 1)
+	{
+		if (++state.counter < SampleRate)
+		{
+			return false;
+		}
+		state.counter = 0;
+	}
+	if (SampleBytes > 0)
+	{
+		state.bytesleft -= size;
+		if (state.bytesleft > 0 && size < SampleBytes)
+		{
+			return false;
+		}
+		state.bytesleft = nextSampleDistance(state, tid);
+	}
+	return true;
+}
+
+
+// Walk the frame pointer chain, starting from the frame of the function that called the
+// allocator. Memory is read with PIN_SafeCopy, so a bogus frame pointer just ends the walk
+UINT32 captureStack(ADDRINT caller, ADDRINT framepointer)
+{
+	ADDRINT frames[MAX_STACK_DEPTH];
+	UINT32 depth = 0;
+	frames[depth++] = caller;
+	while (depth < StackDepth)
+	{
+		ADDRINT frame[2];		// saved frame pointer, return address
+		if (framepointer == 0 || (framepointer & (sizeof(ADDRINT) - 1)) != 0 ||
+			PIN_SafeCopy(frame, (VOID *) framepointer, sizeof(frame)) != sizeof(frame))
+		{
+			break;
+		}
+		if (frame[1] == 0)
+		{
+			break;
+		}
+		frames[depth++] = frame[1];
+		// frames live at higher addresses as we go up, and not absurdly far apart
+		if (frame[0] <= framepointer || frame[0] - framepointer > 0x100000)
+		{
+			break;
+		}
+		framepointer = frame[0];
+	}
+	return stackDepot.put(frames, depth);
+}
+
+
+// hand a heap event over to the drain thread
+VOID queueHeapEvent(THREADID tid, UINT64 clock, HEAP_EVENT& ev)
+{
+	if (tid < MAX_THREADS)
+	{
+		CEventRing* ring = getThreadRing(tid);
+		if (!ring->push(clock, ev))
+		{
+			// The drain thread didn't keep up. Wait for it rather than drain here, which would
+			// make the application threads queue up on drainLock
+			nrRingStalls.fetch_add(1, std::memory_order_relaxed);
+			while (!ring->push(clock, ev))
+			{
+				if (DrainThreadStarted && !DrainThreadExit)
+				{
+					PIN_SemaphoreSet(&drainSemaphore);
+					PIN_Yield();
+				}
+				else
+				{
+					// no drain thread (anymore), at exit
+					drainEvents();
+				}
+			}
+		}
+		if (ring->used() == RING_WAKE)
+		{
+			PIN_SemaphoreSet(&drainSemaphore);
+		}
+	}
+	else
+	{
+		// no ring for this thread
+		PIN_GetLock(&drainLock, tid + 1);
+		processHeapEvent(ev);
+		eventText.flush();
+		PIN_ReleaseLock(&drainLock);
+	}
+}
+
+
+// fill in a new heap event and queue it for the drain thread. requestflags (EV_ZEROED) and
+// alignshift describe the request, for the allocation trace
+VOID captureHeapEvent(HEAP_OP operation, THREADID tid, ADDRINT addr, UINT32 size, ADDRINT heap, ADDRINT caller, ADDRINT framepointer,
+	UINT8 requestflags, UINT8 alignshift)
+{
+	// out of scope callers are dropped before anything gets resolved. Their frees are not, a chunk
+	// allocated in scope is tracked until it is freed, wherever that happens
+	BOOL sampled = isFreeOperation(operation) ||
+		((!ModuleFilter || moduleScope.contains(caller)) && (!Sampling || sampleAllocation(tid, size)));
+
+	UINT32 stackid = 0;
+	if (StackDepth > 0 && (sampled || UafCheck))
+	{
+		stackid = captureStack(caller, framepointer);
+	}
+
+	if (UafCheck && !isFreeOperation(operation))
+	{
+		// use after free detection looks at every chunk, sampled or not. Frees are shadowed
+		// once the allocator returns, see shadowFreedChunk
+		uafTracker.allocated(addr, size, caller, stackid);
+	}
+
+	if (!sampled)
+	{
+		// nothing global is touched for a dropped allocation. The table has no freed chunk at this
+		// address that could be reported as a double free later: with sampling or a module filter,
+		// freed chunks are deleted from it
+		return;
+	}
+
+	UINT64 clock = stampEvent(tid);
+	UINT8 flags = requestflags;
+	if (isFreeOperation(operation))
+	{
+		// one probe gets the size from the allocation, and tells if the chunk was freed already.
+		// Freed chunks are only remembered when every allocation is tracked, or a dropped
+		// allocation reusing the address would have to clear them
+		UINT32 state = chunkTable.freed(addr, size, !Sampling && !ModuleFilter);
+		if (state == CHUNK_LIVE && HeapStatsInterval > 0)
+		{
+			heapStats.freed(tid, heap, size, clock);
+		}
+		if (state == CHUNK_UNKNOWN && (Sampling || ModuleFilter))
+		{
+			// free of a chunk that wasn't sampled, or allocated out of scope
+			unstampEvent(tid);
+			return;
+		}
+		if (state == CHUNK_FREED && LogAlloc && LogFree)
+		{
+			flags |= EV_DOUBLE_FREE;
+		}
+	}
+	else
+	{
+		// without stacks, the depot still gives every caller a small id for the live heap report
+		UINT32 previoussize = 0;
+		UINT32 previous = chunkTable.allocated(addr, size, StackDepth > 0 ? stackid : stackDepot.put(&caller, 1), &previoussize);
+		if (HeapStatsInterval > 0)
+		{
+			heapStats.allocated(tid, heap, size, previous == CHUNK_LIVE, previoussize, clock);
+		}
+	}
+
+	HEAP_EVENT ev;
+	ev.timestamp = eventClock.toTimestamp(clock);
+	ev.threadid = tid;
+	ev.chunk_start = addr;
+	ev.chunk_size = size;
+	ev.saved_return_pointer = caller;
+	// the profile resolves modules only once, when it's printed
+	ev.moduleid = ProfileMode ? 0 : getModuleIdByAddress(tid, caller);
+	ev.operation = operation;
+	ev.flags = flags;
+	ev.alignshift = alignshift;
+	ev.stackid = stackid;
+
+	queueHeapEvent(tid, clock, ev);
+}
+
+
+// Allocator functions we hook, and how their arguments and return value map onto a heap event.
+// Argument numbers are 0 based, -1 means the function doesn't have that argument
+struct ALLOCATOR_DESC
+{
+	const char * name;
+	HEAP_OP operation;
+	INT32 sizearg;			// requested size
+	INT32 countarg;			// number of elements, the size gets multiplied by it
+	INT32 addrarg;			// chunk that is being freed
+	INT32 outarg;			// pointer the new chunk address is stored to, when it's not the return value
+	INT32 heaparg;			// heap handle, HEAP_DEFAULT or HEAP_PAGES is used without one
+	INT32 oldarg;			// chunk that is being reallocated
+	INT32 alignarg;			// requested alignment, for the allocation trace
+	INT32 nrargs;			// for -hookmode replace
+};
+
+ALLOCATOR_DESC Allocators[] =
+{
+#if defined(TARGET_WINDOWS)
+	// HeapHandle, Flags, Size
+	{ "RtlAllocateHeap",	OP_RTLALLOCATEHEAP,		2,	-1,	-1,	-1,	0,	-1,	-1,	3 },
+	// HeapHandle, Flags, MemoryPointer, Size
+	{ "RtlReAllocateHeap",	OP_RTLREALLOCATEHEAP,	3,	-1,	-1,	-1,	0,	2,	-1,	4 },
+	// lpAddress, dwSize, flAllocationType, flProtect
+	{ "VirtualAlloc",		OP_VIRTUALALLOC,		1,	-1,	-1,	-1,	-1,	-1,	-1,	4 },
+	// HeapHandle, Flags, MemoryPointer
+	{ "RtlFreeHeap",		OP_RTLFREEHEAP,			-1,	-1,	2,	-1,	0,	-1,	-1,	3 },
+#else
+	{ "malloc",				OP_RTLALLOCATEHEAP,		0,	-1,	-1,	-1,	-1,	-1,	-1,	1 },
+	{ "calloc",				OP_RTLALLOCATEHEAP,		1,	0,	-1,	-1,	-1,	-1,	-1,	2 },
+	{ "realloc",			OP_RTLREALLOCATEHEAP,	1,	-1,	-1,	-1,	-1,	0,	-1,	2 },
+	// memptr, alignment, size. Returns 0 on success
+	{ "posix_memalign",		OP_RTLALLOCATEHEAP,		2,	-1,	-1,	0,	-1,	-1,	1,	3 },
+	// addr, length, prot, flags, fd, offset
+	{ "mmap",				OP_MMAP,				1,	-1,	-1,	-1,	-1,	-1,	-1,	6 },
+	{ "free",				OP_RTLFREEHEAP,			-1,	-1,	0,	-1,	-1,	-1,	-1,	1 },
+	// addr, length
+	{ "munmap",				OP_MUNMAP,				-1,	-1,	0,	-1,	-1,	-1,	-1,	2 },
+#endif
+};
+
+#define NR_ALLOCATORS (sizeof(Allocators) / sizeof(Allocators[0]))
+#define MAX_ALLOCATOR_ARGS 6
+
+#if defined(TARGET_WINDOWS) && defined(TARGET_IA32)
+#define ALLOCATOR_CALLINGSTD CALLINGSTD_STDCALL
+#else
+#define ALLOCATOR_CALLINGSTD CALLINGSTD_DEFAULT
+#endif
+
+#if defined(TARGET_IA32)
+#define MAX_HEAP_ADDRESS 0x7fffffff
+#else
+#define MAX_HEAP_ADDRESS 0x7fffffffffff
+#endif
+
+
+// avoid noise
+inline bool isHeapAddress(ADDRINT addr)
+{
+	return addr > 0x1000 && addr < MAX_HEAP_ADDRESS;
+}
+
+
+#define MAX_PENDING_CALLS 8		// nested allocator calls per thread
+
+// what we remember between entry and exit of an allocator function
+struct PENDING_CALL
+{
+	ADDRINT stackpointer;		// at entry, finds the call again at exit
+	UINT32 index;				// in Allocators
+	UINT32 size;
+	ADDRINT heap;
+	ADDRINT oldaddr;			// chunk being reallocated
+	UINT8 flags;				// EV_ZEROED for calloc
+	UINT8 alignshift;
+	ADDRINT out;
+	ADDRINT caller;
+	ADDRINT framepointer;
+	BOOL oldlive;				// the chunk at oldaddr when the realloc started, see releaseMovedChunk
+	UINT32 oldsize;
+	UINT32 oldsite;
+	BOOL olduaflive;			// same, in the use after free tracker
+	UINT32 olduafsize;
+	ADDRINT olduafcaller;
+};
+
+// Pending calls of a thread, innermost last. An allocator can call another one (VirtualAlloc
+// from RtlAllocateHeap, mmap from malloc) or itself, so each call gets its own entry and
+// is matched at exit by the stack pointer. Frees only get an entry with -uafcheck, which
+// needs to know when they return. Cache line aligned so threads don't share them
+struct alignas(64) CALL_CONTEXT
+{
+	PENDING_CALL calls[MAX_PENDING_CALLS];
+	UINT32 depth;
+};
+
+static_assert(sizeof(CALL_CONTEXT) % 64 == 0, "CALL_CONTEXT should fill whole cache lines");
+
+CALL_CONTEXT callContexts[MAX_THREADS];
+
+
+// Start a pending call at function entry. Returns NULL if the thread has no context or is nested too deep
+PENDING_CALL* enterCall(THREADID tid, ADDRINT stackpointer)
+{
+	if (tid >= MAX_THREADS)
+	{
+		return NULL;
+	}
+	CALL_CONTEXT& context = callContexts[tid];
+	// calls at the same or a deeper stack level are gone without returning (a tail call into
+	// another allocator, an exception, longjmp)
+	while (context.depth > 0 && context.calls[context.depth - 1].stackpointer <= stackpointer)
+	{
+		context.depth--;
+	}
+	if (context.depth == MAX_PENDING_CALLS)
+	{
+		return NULL;
+	}
+	PENDING_CALL& call = context.calls[context.depth++];
+	call.stackpointer = stackpointer;
+	return &call;
+}
+
+
+// End the pending call of Allocators[index] at function exit. Returns NULL if its entry wasn't seen
+// or the thread was nested too deep. The entry stays valid until the thread enters the next call
+PENDING_CALL* leaveCall(THREADID tid, UINT32 index, ADDRINT stackpointer)
+{
+	if (tid >= MAX_THREADS)
+	{
+		return NULL;
+	}
+	CALL_CONTEXT& context = callContexts[tid];
+	while (context.depth > 0 && context.calls[context.depth - 1].stackpointer < stackpointer)
+	{
+		context.depth--;
+	}
+	if (context.depth == 0 || context.calls[context.depth - 1].stackpointer != stackpointer ||
+		context.calls[context.depth - 1].index != index)
+	{
+		return NULL;
+	}
+	return &context.calls[--context.depth];
+}
+
+
+// true while the thread is inside one of the allocator functions
+inline bool inAllocator(THREADID tid)
+{
+	return tid < MAX_THREADS && callContexts[tid].depth > 0;
+}
+
+
+// With -uafcheck, a freed chunk is shadowed once the allocator returns. Until then the allocator
+// writes its free list links into it, which isn't a use after free
+VOID shadowFreedChunk(ADDRINT addr, ADDRINT caller, ADDRINT framepointer)
+{
+	if (isHeapAddress(addr))
+	{
+		uafTracker.freed(addr, caller, StackDepth > 0 ? captureStack(caller, framepointer) : 0);
+	}
+}
+
+
+// A realloc that moves the chunk frees the old one without a free call we'd see. Drop it from
+// the live chunks (and the heap counters), so it doesn't show up as a leak, and a later free
+// of it is a double free. The drain retires it in the profile, the chunk history and the
+// allocation trace (which is told where the object went).
+// By the time the realloc returns, another thread may have been handed the old address already,
+// so the chunk is only retired if it is still the one captureReallocEntry saw
+VOID releaseMovedChunk(THREADID tid, const PENDING_CALL& call)
+{
+	if (call.olduaflive)
+	{
+		uafTracker.freedIf(call.oldaddr, call.olduafsize, call.olduafcaller, call.caller,
+			StackDepth > 0 ? captureStack(call.caller, call.framepointer) : 0);
+	}
+	if (!call.oldlive || !chunkTable.freedIf(call.oldaddr, call.oldsize, call.oldsite, !Sampling && !ModuleFilter))
+	{
+		return;
+	}
+	UINT32 size = call.oldsize;
+	UINT64 clock = stampEvent(tid);
+	if (HeapStatsInterval > 0)
+	{
+		heapStats.freed(tid, call.heap, size, clock);
+	}
+	HEAP_EVENT ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.timestamp = eventClock.toTimestamp(clock);
+	ev.threadid = tid;
+	ev.chunk_start = call.oldaddr;
+	ev.chunk_size = size;
+	ev.saved_return_pointer = call.caller;
+	ev.operation = OP_RTLREALLOCATEHEAP;
+	ev.flags = EV_MOVED_FROM;
+	queueHeapEvent(tid, clock, ev);
+}
+
+
+// log2 of a requested alignment
+UINT8 alignmentShift(ADDRINT alignment)
+{
+	UINT8 shift = 0;
+	while (shift < 8 * sizeof(ADDRINT) - 1 && ((ADDRINT) 2 << shift) <= alignment)
+	{
+		shift++;
+	}
+	return shift;
+}
+
+
+// heap handle argument, or a pseudo handle for allocators without one
+ADDRINT getHeapHandle(const ALLOCATOR_DESC& desc, ADDRINT heap)
+{
+	if (desc.heaparg >= 0)
 	{
-		return it->second;
+		return heap;
 	}
-	return 0;
+	return (desc.operation == OP_VIRTUALALLOC || desc.operation == OP_MMAP || desc.operation == OP_MUNMAP) ? HEAP_PAGES : HEAP_DEFAULT;
 }
 
-void saveModToArray(CModuleImage& modimage)
+
+// remember the arguments of an allocator call that are needed once it returns
+VOID rememberCall(PENDING_CALL& call, UINT32 index, ADDRINT size, ADDRINT count, ADDRINT out, ADDRINT heap, ADDRINT oldaddr,
+	ADDRINT alignment, ADDRINT caller, ADDRINT framepointer)
 {
-	// saving, just in case I want to do something with it later
-	arrLoadedModules.push_back(modimage);
+	const ALLOCATOR_DESC& desc = Allocators[index];
+	call.index = index;
+	call.size = (UINT32) (desc.countarg >= 0 ? size * count : size);
+	call.heap = getHeapHandle(desc, heap);
+	call.oldaddr = (desc.oldarg >= 0) ? oldaddr : 0;
+	call.flags = (desc.countarg >= 0) ? EV_ZEROED : 0;
+	call.alignshift = (desc.alignarg >= 0) ? alignmentShift(alignment) : 0;
+	call.out = out;
+	call.caller = caller;
+	call.framepointer = framepointer;
 }
 
 
-string getModuleImageNameByAddress(ADDRINT address)
+// realloc(p, 0) frees p and returns NULL on Linux (RtlReAllocateHeap hands out a zero sized chunk)
+bool reallocFrees(const PENDING_CALL& call)
 {
-	string returnval = "";
-	IMG theimage;
-	PIN_LockClient();
-	theimage = IMG_FindByAddress(address);
-	PIN_UnlockClient();
-	if (IMG_Valid(theimage))
-	{
-		returnval = IMG_Name(theimage);
-	}
-	return returnval;
+#if defined(TARGET_WINDOWS)
+	return false;
+#else
+	return Allocators[call.index].operation == OP_RTLREALLOCATEHEAP && call.size == 0 && call.oldaddr != 0;
+#endif
 }
 
 
-string getAddressInfo(ADDRINT address)
+// called at realloc entry. A realloc that frees is logged as a free before the call, like free
+// itself, so the event is queued before the chunk can be handed out again. For any other realloc
+// the chunk it starts from is looked up now, releaseMovedChunk retires it only if it's unchanged
+VOID captureReallocEntry(THREADID tid, PENDING_CALL& call)
 {
-	stringstream ss;
-	string info = "";
-	string modulename = "";
-	if (address > 0)
+	call.oldlive = false;
+	call.olduaflive = false;
+	if (call.oldaddr == 0)
 	{
-		// check if address belongs to module or is part of heap
-		modulename = getModuleImageNameByAddress(address);
-		if (!modulename.empty())
-		{
-			ss << "(" << modulename << ")";
-			info = ss.str();
-		}
-		else
+		return;
+	}
+	if (reallocFrees(call))
+	{
+		if (LogFree && isHeapAddress(call.oldaddr))
 		{
-			ss << "";
-			for (CHeapOperation op : arrAllOperations)
-			{
-				if (op.chunk_start <= address && address <= op.chunk_end)
-				{
-					ss << op.operation_type << "(0x" << std::hex << op.chunk_size << ") ";
-				}
-			}
-			info = ss.str();
+			captureHeapEvent(OP_RTLFREEHEAP, tid, call.oldaddr, 0, call.heap, call.caller, call.framepointer, 0, 0);
 		}
+		return;
+	}
+	call.oldlive = chunkTable.lookup(call.oldaddr, call.oldsize, &call.oldsite) == CHUNK_LIVE;
+	if (UafCheck)
+	{
+		call.olduaflive = uafTracker.findLive(call.oldaddr, call.olduafsize, call.olduafcaller);
 	}
-	return info;
 }
 
 
-// wrapper to either write output to LogFile directly, or to buffer it first
-void saveToLog(FILE* Log, const char * fmt, ...)
+// an allocator call returned ret
+VOID captureAllocation(THREADID tid, const PENDING_CALL& call, ADDRINT ret)
 {
-	va_list args;
-	// convert to string first
-		
-	char entry [512]; // truncate after that
-	va_start(args, fmt);
-	vsnprintf(entry, 511, fmt, args);
-	va_end(args);
-
-	if (BufferOutput)
+	const ALLOCATOR_DESC& desc = Allocators[call.index];
+	if (reallocFrees(call) && ret == 0)
 	{
-		CLogEntry thisentry(Log, entry);
-		arrOutputBuffer.push_back(thisentry);
-		++nrLogEntries;
-		// check if we should dump to file now
-		if (nrLogEntries > 5000)
+		// logged at entry already
+		if (UafCheck)
 		{
-			dumpBufferToFile();
-			nrLogEntries = 0;
+			shadowFreedChunk(call.oldaddr, call.caller, call.framepointer);
 		}
+		return;
 	}
-	else
+	ADDRINT addr = ret;
+	if (desc.outarg >= 0)
 	{
-		// write to file directly
-		std::fprintf(Log, "%s", entry);
+		// the return value is an (int) error code, the chunk address was written to the out pointer
+		if ((INT32) ret != 0 || PIN_SafeCopy(&addr, (VOID *) call.out, sizeof(addr)) != sizeof(addr))
+		{
+			return;
+		}
 	}
-	
+	if (desc.operation != OP_VIRTUALALLOC && !isHeapAddress(addr))
+	{
+		return;
+	}
+	if (call.oldaddr != 0 && call.oldaddr != addr)
+	{
+		releaseMovedChunk(tid, call);
+	}
+	captureHeapEvent(desc.operation, tid, addr, call.size, call.heap, call.caller, call.framepointer, call.flags, call.alignshift);
 }
 
 
-
-/* ===================================================================== */
-// Analysis routines (runtime)
-/* ===================================================================== */
-
-VOID CaptureRtlAllocateHeapBefore(THREADID tid, UINT32 flags, int size)
+VOID PIN_FAST_ANALYSIS_CALL CaptureAllocBefore(THREADID tid, UINT32 index, ADDRINT size, ADDRINT count, ADDRINT out, ADDRINT heap, ADDRINT oldaddr,
+	ADDRINT alignment, ADDRINT caller, ADDRINT framepointer, ADDRINT stackpointer)
 {
-	// At start of function, simply remember the requested size in TLS
-	PIN_SetThreadData(alloc_key, (void *) size, tid);
+	// At start of function, simply remember the arguments we need at the end
+	PENDING_CALL* call = enterCall(tid, stackpointer);
+	if (call != NULL)
+	{
+		rememberCall(*call, index, size, count, out, heap, oldaddr, alignment, caller, framepointer);
+		captureReallocEntry(tid, *call);
+	}
 }
 
 
-VOID CaptureRtlAllocateHeapAfter(THREADID tid, ADDRINT addr, ADDRINT caller)
+VOID PIN_FAST_ANALYSIS_CALL CaptureAllocAfter(THREADID tid, UINT32 index, ADDRINT ret, ADDRINT stackpointer)
 {
-	// At end of function restore requested size and save data
-	// avoid noise
-	if (addr > 0x1000 && addr < 0x7fffffff)
+	// At end of function restore the arguments and save data
+	PENDING_CALL* call = leaveCall(tid, index, stackpointer);
+	if (call != NULL)
 	{
-		//restore size (dwBytes) argument that was stored at start of function
-		int size = (int) PIN_GetThreadData(alloc_key, tid);
-		
-		// create new object
-		CHeapOperation ho_alloc(true);
-		ho_alloc.operation_type = "rtlallocateheap";
-		ho_alloc.chunk_start = addr;
-		ho_alloc.chunk_size = size;
-		ho_alloc.chunk_end = addr + size;
-		ho_alloc.saved_return_pointer = caller;
-		ho_alloc.operation_timestamp = time(0);
-		string imagename = getModuleImageNameByAddress(caller);
-		ho_alloc.srp_imagename = imagename;
-
-		ho_alloc.save_to_log();
-		ho_alloc.check_addy();
-
-		arrAllOperations.push_back(ho_alloc);
-		// add to map chunksizes (or update existing entry)
-		chunksizes[addr] = size;
-
+		const PENDING_CALL pending = *call;
+		captureAllocation(tid, pending, ret);
 	}
 }
 
 
-VOID CaptureRtlReAllocateHeapBefore(THREADID tid, UINT32 flags, int size)
+VOID PIN_FAST_ANALYSIS_CALL CaptureFreeBefore(THREADID tid, UINT32 index, ADDRINT addr, ADDRINT heap, ADDRINT caller, ADDRINT framepointer,
+	ADDRINT stackpointer)
 {
-	// At start of function, simply remember the requested size in TLS
-	PIN_SetThreadData(alloc_key, (void *) size, tid);
+	if (UafCheck)
+	{
+		PENDING_CALL* call = enterCall(tid, stackpointer);
+		if (call != NULL)
+		{
+			call->index = index;
+			call->oldaddr = addr;
+			call->caller = caller;
+			call->framepointer = framepointer;
+		}
+	}
+	if (isHeapAddress(addr))
+	{
+		// size is filled in by the drain thread, from the previous allocation
+		captureHeapEvent(Allocators[index].operation, tid, addr, 0, getHeapHandle(Allocators[index], heap), caller, framepointer, 0, 0);
+	}
 }
 
 
-VOID CaptureRtlReAllocateHeapAfter(THREADID tid, ADDRINT addr, ADDRINT caller)
+// only inserted with -uafcheck
+VOID PIN_FAST_ANALYSIS_CALL CaptureFreeAfter(THREADID tid, UINT32 index, ADDRINT stackpointer)
 {
-	// At end of function restore requested size and save data
-	// avoid noise
-	if (addr > 0x1000 && addr < 0x7fffffff)
+	PENDING_CALL* call = leaveCall(tid, index, stackpointer);
+	if (call != NULL)
 	{
-		//restore size argument that was stored at start of function
-		int size = (int) PIN_GetThreadData(alloc_key, tid);
-		
-		// create new object
-		CHeapOperation ho_alloc(true);
-		ho_alloc.operation_type = "rtlreallocateheap";
-		ho_alloc.chunk_start = addr;
-		ho_alloc.chunk_size = size;
-		ho_alloc.chunk_end = addr + size;
-		ho_alloc.saved_return_pointer = caller;
-		ho_alloc.operation_timestamp = time(0);
-		string imagename = getModuleImageNameByAddress(caller);
-		ho_alloc.srp_imagename = imagename;
-
-		ho_alloc.save_to_log();
-		ho_alloc.check_addy();
-
-		arrAllOperations.push_back(ho_alloc);
-		// add to map chunksizes
-		chunksizes[addr] = size;
-
+		shadowFreedChunk(call->oldaddr, call->caller, call->framepointer);
 	}
 }
 
 
-VOID CaptureVirtualAllocBefore(THREADID tid, int size, int flProtect)
+// inlined in front of every memory access with -uafcheck, keep it branch free
+ADDRINT PIN_FAST_ANALYSIS_CALL IsFreedMemory(ADDRINT ea)
 {
-	// At start of function, simply remember the requested size in TLS
-	PIN_SetThreadData(alloc_key, (void *) size, tid);
+	return (ShadowTop[(ea >> SHADOW_REGION_BITS) & (SHADOW_TOP_ENTRIES - 1)][(ea & ((1 << SHADOW_REGION_BITS) - 1)) >> (SHADOW_GRANULE_BITS + 5)] >> ((ea >> SHADOW_GRANULE_BITS) & 31)) & 1;
 }
 
 
-VOID CaptureVirtualAllocAfter(THREADID tid, ADDRINT addr, ADDRINT caller)
+// only called when the shadow bitmap says ea is in a freed chunk
+VOID ReportUseAfterFree(THREADID tid, ADDRINT ip, ADDRINT ea, BOOL iswrite)
 {
-	// At end of function restore requested size and save data
-	// avoid noise
-		
-	//restore size argument that was stored at start of function
-	int size = (int) PIN_GetThreadData(alloc_key, tid);
-		
-	// create new object
-	CHeapOperation ho_alloc(true);
-	ho_alloc.operation_type = "virtualalloc";
-	ho_alloc.chunk_start = addr;
-	ho_alloc.chunk_size = size;
-	ho_alloc.chunk_end = addr + size;
-	ho_alloc.saved_return_pointer = caller;
-	ho_alloc.operation_timestamp = time(0);
-	string imagename = getModuleImageNameByAddress(caller);
-	ho_alloc.srp_imagename = imagename;
-
-	ho_alloc.save_to_log();
-	ho_alloc.check_addy();
-
-	arrAllOperations.push_back(ho_alloc);
-	// add to map chunksizes
-	chunksizes[addr] = size;
+	if (inAllocator(tid))
+	{
+		// the allocator keeps its own bookkeeping in freed chunks
+		return;
+	}
+	ADDRINT start;
+	UAF_CHUNK chunk;
+	if (!uafTracker.findFreed(ea, start, chunk) || !uafTracker.firstReport(ip))
+	{
+		return;
+	}
+	char allocstack[24] = "";
+	char freestack[24] = "";
+	if (chunk.alloc_stackid != 0)
+	{
+		snprintf(allocstack, sizeof(allocstack), " [stack %u]", chunk.alloc_stackid);
+	}
+	if (chunk.free_stackid != 0)
+	{
+		snprintf(freestack, sizeof(freestack), " [stack %u]", chunk.free_stackid);
+	}
+	saveToLog(LogFile, "PID: %u >>> Use after free: %s of 0x%p (chunk 0x%p + 0x%x, size 0x%x) at 0x%p (%s), allocated from 0x%p (%s)%s, freed from 0x%p (%s)%s <<<\n",
+		CurrentPid, iswrite ? "write" : "read", ea, start, (UINT32) (ea - start), chunk.size,
+		ip, moduleTable.getName(getModuleIdByAddress(tid, ip)),
+		chunk.alloc_caller, moduleTable.getName(getModuleIdByAddress(tid, chunk.alloc_caller)), allocstack,
+		chunk.free_caller, moduleTable.getName(getModuleIdByAddress(tid, chunk.free_caller)), freestack);
 }
 
 
-VOID CaptureRtlFreeHeapBefore(ADDRINT addr, ADDRINT caller)
+// -hookmode replace: the allocator is called from here, so its arguments and its return value
+// are seen in one place, no matter how the function returns
+ADDRINT callOriginal(const CONTEXT* ctxt, THREADID tid, AFUNPTR original, INT32 nrargs, const ADDRINT* args)
 {
-	
-	// avoid noise
-	if (addr > 0x1000 && addr < 0x7fffffff)
+	// functions that return nothing (free) or less than an ADDRINT leave the rest undefined, it is ignored
+	ADDRINT ret = 0;
+	// one case for every number of arguments in Allocators
+	switch (nrargs)
 	{
-		// create new object
-		CHeapOperation ho_free(false);
-		ho_free.operation_type = "rtlfreeheap";
-		ho_free.chunk_start = addr;
-		ho_free.saved_return_pointer = caller;
-		ho_free.operation_timestamp = time(0);
-
-		string imagename = getModuleImageNameByAddress(caller);
-
-
-		// see if we can get size from previous allocation
-		WINDOWS::DWORD size = findSize(addr);		
-		ho_free.chunk_size = size;
-		ho_free.chunk_end = ho_free.chunk_start + size;
-		ho_free.srp_imagename = imagename;
-
-		ho_free.save_to_log();
-		ho_free.check_addy();
-
-		arrAllOperations.push_back(ho_free);
+	case 1:
+		PIN_CallApplicationFunction(ctxt, tid, ALLOCATOR_CALLINGSTD, original, NULL, PIN_PARG(ADDRINT), &ret,
+			PIN_PARG(ADDRINT), args[0], PIN_PARG_END());
+		break;
+	case 2:
+		PIN_CallApplicationFunction(ctxt, tid, ALLOCATOR_CALLINGSTD, original, NULL, PIN_PARG(ADDRINT), &ret,
+			PIN_PARG(ADDRINT), args[0], PIN_PARG(ADDRINT), args[1], PIN_PARG_END());
+		break;
+	case 3:
+		PIN_CallApplicationFunction(ctxt, tid, ALLOCATOR_CALLINGSTD, original, NULL, PIN_PARG(ADDRINT), &ret,
+			PIN_PARG(ADDRINT), args[0], PIN_PARG(ADDRINT), args[1], PIN_PARG(ADDRINT), args[2], PIN_PARG_END());
+		break;
+	case 4:
+		PIN_CallApplicationFunction(ctxt, tid, ALLOCATOR_CALLINGSTD, original, NULL, PIN_PARG(ADDRINT), &ret,
+			PIN_PARG(ADDRINT), args[0], PIN_PARG(ADDRINT), args[1], PIN_PARG(ADDRINT), args[2], PIN_PARG(ADDRINT), args[3],
+			PIN_PARG_END());
+		break;
+	case 6:
+		PIN_CallApplicationFunction(ctxt, tid, ALLOCATOR_CALLINGSTD, original, NULL, PIN_PARG(ADDRINT), &ret,
+			PIN_PARG(ADDRINT), args[0], PIN_PARG(ADDRINT), args[1], PIN_PARG(ADDRINT), args[2], PIN_PARG(ADDRINT), args[3],
+			PIN_PARG(ADDRINT), args[4], PIN_PARG(ADDRINT), args[5], PIN_PARG_END());
+		break;
+	}
+	return ret;
+}
 
-		// remove from chunksizes, because no longer relevant
-		chunksizes.erase(addr);
 
+ADDRINT ReplacedAllocator(const CONTEXT* ctxt, THREADID tid, UINT32 index, AFUNPTR original, ADDRINT caller,
+	ADDRINT arg0, ADDRINT arg1, ADDRINT arg2, ADDRINT arg3, ADDRINT arg4, ADDRINT arg5)
+{
+	const ALLOCATOR_DESC& desc = Allocators[index];
+	ADDRINT args[MAX_ALLOCATOR_ARGS] = { arg0, arg1, arg2, arg3, arg4, arg5 };
+	ADDRINT framepointer = PIN_GetContextReg(ctxt, REG_GBP);
+	ADDRINT stackpointer = PIN_GetContextReg(ctxt, REG_STACK_PTR);
+	if (isFreeOperation(desc.operation))
+	{
+		// before the call, like -hookmode insert, so the event is queued before the chunk can be handed out again
+		CaptureFreeBefore(tid, index, args[desc.addrarg], args[max(desc.heaparg, 0)], caller, framepointer, stackpointer);
+		ADDRINT ret = callOriginal(ctxt, tid, original, desc.nrargs, args);
+		if (UafCheck)
+		{
+			CaptureFreeAfter(tid, index, stackpointer);
+		}
+		return ret;
+	}
+	// the call is pending in the thread's context as well, so -uafcheck knows the allocator is running
+	PENDING_CALL call;
+	rememberCall(call, index, args[desc.sizearg], args[max(desc.countarg, 0)], args[max(desc.outarg, 0)],
+		args[max(desc.heaparg, 0)], args[max(desc.oldarg, 0)], args[max(desc.alignarg, 0)], caller, framepointer);
+	captureReallocEntry(tid, call);
+	PENDING_CALL* pending = enterCall(tid, stackpointer);
+	if (pending != NULL)
+	{
+		pending->index = index;
 	}
+	ADDRINT ret = callOriginal(ctxt, tid, original, desc.nrargs, args);
+	leaveCall(tid, index, stackpointer);
+	captureAllocation(tid, call, ret);
+	return ret;
 }
 
 
+// signature of an allocator, every argument is treated as an ADDRINT
+PROTO allocatorPrototype(const ALLOCATOR_DESC& desc)
+{
+	switch (desc.nrargs)
+	{
+	case 1:
+		return PROTO_Allocate(PIN_PARG(ADDRINT), ALLOCATOR_CALLINGSTD, desc.name, PIN_PARG(ADDRINT), PIN_PARG_END());
+	case 2:
+		return PROTO_Allocate(PIN_PARG(ADDRINT), ALLOCATOR_CALLINGSTD, desc.name, PIN_PARG(ADDRINT), PIN_PARG(ADDRINT), PIN_PARG_END());
+	case 3:
+		return PROTO_Allocate(PIN_PARG(ADDRINT), ALLOCATOR_CALLINGSTD, desc.name, PIN_PARG(ADDRINT), PIN_PARG(ADDRINT),
+			PIN_PARG(ADDRINT), PIN_PARG_END());
+	case 4:
+		return PROTO_Allocate(PIN_PARG(ADDRINT), ALLOCATOR_CALLINGSTD, desc.name, PIN_PARG(ADDRINT), PIN_PARG(ADDRINT),
+			PIN_PARG(ADDRINT), PIN_PARG(ADDRINT), PIN_PARG_END());
+	default:
+		return PROTO_Allocate(PIN_PARG(ADDRINT), ALLOCATOR_CALLINGSTD, desc.name, PIN_PARG(ADDRINT), PIN_PARG(ADDRINT),
+			PIN_PARG(ADDRINT), PIN_PARG(ADDRINT), PIN_PARG(ADDRINT), PIN_PARG(ADDRINT), PIN_PARG_END());
+	}
+}
 
 
 /* ===================================================================== */
@@ -593,160 +2977,179 @@ VOID AddInstrumentation(IMG img, VOID *v)
 	// this instrumentation routine gets executed when an image is loaded
 
 	// first, add image information to global array
-	ADDRINT BaseAddy = IMG_LowAddress(img);
 	CModuleImage thisimage(img);
+	thisimage.setId(moduleTable.intern(IMG_Name(img)));
 	saveModToArray(thisimage);
 	thisimage.save_to_log();
-
-	// next, walk through the symbols in the symbol table to see if it contains the Heap related functions that we want to monitor
-	//
-	for (SYM sym = IMG_RegsymHead(img); SYM_Valid(sym); sym = SYM_Next(sym))
+	if (ModuleFilter)
 	{
-		string undFuncName = PIN_UndecorateSymbolName(SYM_Name(sym), UNDECORATION_NAME_ONLY);
+		moduleScope.imageLoaded(IMG_Name(img), IMG_LowAddress(img), IMG_HighAddress(img));
+	}
 
-		//  Find the RtlAllocateHeap() function.
-		if (undFuncName == "RtlAllocateHeap" && LogAlloc)
+	// next, see if the image contains any of the allocator functions that we want to monitor
+	for (UINT32 i = 0; i < NR_ALLOCATORS; i++)
+	{
+		const ALLOCATOR_DESC& desc = Allocators[i];
+		bool isfree = isFreeOperation(desc.operation);
+		if (isfree ? !LogFree : !LogAlloc)
 		{
-			RTN allocRtn = LEVEL_PINCLIENT::RTN_FindByAddress(IMG_LowAddress(img) + SYM_Value(sym));
-            
-			if (LEVEL_PINCLIENT::RTN_Valid(allocRtn))
-			{
-				// Instrument to capture allocation address and original function arguments
-				// at end of the RtlAllocateHeap function
-
-				LEVEL_PINCLIENT::RTN_Open(allocRtn);
-
-				saveToLog(LogFile,"Adding instrumentation for RtlAllocateHeap (0x%p) %s \n", (BaseAddy + SYM_Value(sym)), IMG_Name(img));
-                				
-				LEVEL_PINCLIENT::RTN_InsertCall(allocRtn, IPOINT_BEFORE, (AFUNPTR) &CaptureRtlAllocateHeapBefore,
-					IARG_THREAD_ID, IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
-					IARG_FUNCARG_ENTRYPOINT_VALUE, 2, IARG_END);
-
-				// return value is the address that has been allocated
-				LEVEL_PINCLIENT::RTN_InsertCall(allocRtn, IPOINT_AFTER, (AFUNPTR) &CaptureRtlAllocateHeapAfter,
-					IARG_THREAD_ID, IARG_FUNCRET_EXITPOINT_VALUE, IARG_G_ARG0_CALLER, IARG_END);
-
-				LEVEL_PINCLIENT::RTN_Close(allocRtn);
-			}
+			continue;
 		}
 
-		//  Find the RtlReAllocateHeap() function.
-		else if (undFuncName == "RtlReAllocateHeap" && LogAlloc)
+		RTN rtn = RTN_FindByName(img, desc.name);
+		if (!RTN_Valid(rtn))
 		{
-			RTN reallocRtn = LEVEL_PINCLIENT::RTN_FindByAddress(IMG_LowAddress(img) + SYM_Value(sym));
-            
-			if (LEVEL_PINCLIENT::RTN_Valid(reallocRtn))
-			{
-				// Instrument to capture allocation address and original function arguments
-				// at end of the RtlAllocateHeap function
+			continue;
+		}
 
-				LEVEL_PINCLIENT::RTN_Open(reallocRtn);
+		saveToLog(LogFile, "Adding instrumentation for %s (0x%p) %s\n", desc.name, RTN_Address(rtn), IMG_Name(img).c_str());
 
-				saveToLog(LogFile,"Adding instrumentation for RtlReAllocateHeap (0x%p) %s \n", (BaseAddy + SYM_Value(sym)), IMG_Name(img));
-				// HeapHandle
-				// Flags
-				// MemoryPointer
-				// Size
-				LEVEL_PINCLIENT::RTN_InsertCall(reallocRtn, IPOINT_BEFORE, (AFUNPTR) &CaptureRtlReAllocateHeapBefore,
-					IARG_THREAD_ID, IARG_FUNCARG_ENTRYPOINT_VALUE, 2,
-					IARG_FUNCARG_ENTRYPOINT_VALUE, 3, IARG_END);
+		if (ReplaceHooks)
+		{
+			// arguments the function doesn't have are passed as copies of its last one, and ignored
+			PROTO prototype = allocatorPrototype(desc);
+			RTN_ReplaceSignature(rtn, (AFUNPTR) &ReplacedAllocator,
+				IARG_PROTOTYPE, prototype,
+				IARG_CONST_CONTEXT, IARG_THREAD_ID, IARG_UINT32, i, IARG_ORIG_FUNCPTR,
+				IARG_RETURN_IP,									// saved return pointer
+				IARG_FUNCARG_ENTRYPOINT_VALUE, min(0, desc.nrargs - 1),
+				IARG_FUNCARG_ENTRYPOINT_VALUE, min(1, desc.nrargs - 1),
+				IARG_FUNCARG_ENTRYPOINT_VALUE, min(2, desc.nrargs - 1),
+				IARG_FUNCARG_ENTRYPOINT_VALUE, min(3, desc.nrargs - 1),
+				IARG_FUNCARG_ENTRYPOINT_VALUE, min(4, desc.nrargs - 1),
+				IARG_FUNCARG_ENTRYPOINT_VALUE, min(5, desc.nrargs - 1),
+				IARG_END);
+			PROTO_Free(prototype);
+			continue;
+		}
 
-				// return value is the address that has been allocated
-				LEVEL_PINCLIENT::RTN_InsertCall(reallocRtn, IPOINT_AFTER, (AFUNPTR) &CaptureRtlReAllocateHeapAfter,
-					IARG_THREAD_ID, IARG_FUNCRET_EXITPOINT_VALUE, IARG_G_ARG0_CALLER, IARG_END);
+		RTN_Open(rtn);
 
-				LEVEL_PINCLIENT::RTN_Close(reallocRtn);
+		if (isfree)
+		{
+			RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR) &CaptureFreeBefore, IARG_FAST_ANALYSIS_CALL,
+				IARG_THREAD_ID, IARG_UINT32, i,
+				IARG_FUNCARG_ENTRYPOINT_VALUE, desc.addrarg,	// address
+				IARG_FUNCARG_ENTRYPOINT_VALUE, max(desc.heaparg, 0),
+				IARG_RETURN_IP,									// saved return pointer
+				IARG_REG_VALUE, REG_GBP,						// frame pointer of the caller
+				IARG_REG_VALUE, REG_STACK_PTR,					// identifies the call at exit
+				IARG_END);
+			if (UafCheck)
+			{
+				RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR) &CaptureFreeAfter, IARG_FAST_ANALYSIS_CALL,
+					IARG_THREAD_ID, IARG_UINT32, i, IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
 			}
 		}
-
-		//  Find the VirtualAlloc() function.
-		else if (undFuncName == "VirtualAlloc" && LogAlloc)
+		else
 		{
-			RTN vaallocRtn = LEVEL_PINCLIENT::RTN_FindByAddress(IMG_LowAddress(img) + SYM_Value(sym));
-            
-			if (LEVEL_PINCLIENT::RTN_Valid(vaallocRtn))
-			{
-				// Instrument to capture allocation address and original function arguments
-				// at end of the VirtualAlloc function
-
-				LEVEL_PINCLIENT::RTN_Open(vaallocRtn);
+			// arguments the function doesn't have are read anyway (as argument 0), and ignored
+			RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR) &CaptureAllocBefore, IARG_FAST_ANALYSIS_CALL,
+				IARG_THREAD_ID, IARG_UINT32, i,
+				IARG_FUNCARG_ENTRYPOINT_VALUE, desc.sizearg,
+				IARG_FUNCARG_ENTRYPOINT_VALUE, max(desc.countarg, 0),
+				IARG_FUNCARG_ENTRYPOINT_VALUE, max(desc.outarg, 0),
+				IARG_FUNCARG_ENTRYPOINT_VALUE, max(desc.heaparg, 0),
+				IARG_FUNCARG_ENTRYPOINT_VALUE, max(desc.oldarg, 0),
+				IARG_FUNCARG_ENTRYPOINT_VALUE, max(desc.alignarg, 0),
+				IARG_RETURN_IP,									// saved return pointer
+				IARG_REG_VALUE, REG_GBP,						// frame pointer of the caller
+				IARG_REG_VALUE, REG_STACK_PTR,					// identifies the call at exit
+				IARG_END);
+
+			// return value is the address that has been allocated
+			RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR) &CaptureAllocAfter, IARG_FAST_ANALYSIS_CALL,
+				IARG_THREAD_ID, IARG_UINT32, i, IARG_FUNCRET_EXITPOINT_VALUE, IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+		}
 
-				saveToLog(LogFile,"Adding instrumentation for VirtualAlloc (0x%p) %s\n", (BaseAddy + SYM_Value(sym)), IMG_Name(img));
-				// lpAddress
-				// dwSize
-				// flAllocationType
-				// flProtect
-				LEVEL_PINCLIENT::RTN_InsertCall(vaallocRtn, IPOINT_BEFORE, (AFUNPTR) &CaptureVirtualAllocBefore,
-					IARG_THREAD_ID, IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
-					IARG_FUNCARG_ENTRYPOINT_VALUE, 3, IARG_END);
+		RTN_Close(rtn);
+	}
+}
 
-				// return value is the address that has been allocated
-				LEVEL_PINCLIENT::RTN_InsertCall(vaallocRtn, IPOINT_AFTER, (AFUNPTR) &CaptureVirtualAllocAfter,
-					IARG_THREAD_ID, IARG_FUNCRET_EXITPOINT_VALUE, IARG_G_ARG0_CALLER, IARG_END);
 
-				LEVEL_PINCLIENT::RTN_Close(vaallocRtn);
-			}
+VOID InstrumentMemoryAccess(INS ins, VOID *v)
+{
+	// stack accesses can't touch heap chunks
+	if (INS_IsStackRead(ins) || INS_IsStackWrite(ins) || INS_IsPrefetch(ins))
+	{
+		return;
+	}
+	UINT32 memOperands = INS_MemoryOperandCount(ins);
+	for (UINT32 memOp = 0; memOp < memOperands; memOp++)
+	{
+		BOOL iswrite = INS_MemoryOperandIsWritten(ins, memOp);
+		if (!iswrite && !INS_MemoryOperandIsRead(ins, memOp))
+		{
+			continue;
 		}
+		INS_InsertIfPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR) &IsFreedMemory,
+			IARG_FAST_ANALYSIS_CALL, IARG_MEMORYOP_EA, memOp, IARG_END);
+		INS_InsertThenPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR) &ReportUseAfterFree,
+			IARG_THREAD_ID, IARG_INST_PTR, IARG_MEMORYOP_EA, memOp, IARG_BOOL, iswrite, IARG_END);
+	}
+}
 
 
-		//  Find the RtlFreeHeap() function.
-		else if (undFuncName == "RtlFreeHeap" && LogFree)
-		{
-			RTN freeRtn = RTN_FindByAddress(IMG_LowAddress(img) + SYM_Value(sym));
-            
-			if (RTN_Valid(freeRtn))
-			{
-				LEVEL_PINCLIENT::RTN_Open(freeRtn);
+VOID RemoveImage(IMG img, VOID *v)
+{
+	// this gets executed when an image is unloaded
+	removeModFromArray(IMG_LowAddress(img));
+	if (ModuleFilter)
+	{
+		moduleScope.imageUnloaded(IMG_Name(img), IMG_LowAddress(img), IMG_HighAddress(img));
+	}
+}
 
-				saveToLog(LogFile,"Adding instrumentation for RtlFreeHeap (0x%p) %s\n", (BaseAddy + SYM_Value(sym)), IMG_Name(img));
-                
-				LEVEL_PINCLIENT::RTN_InsertCall(freeRtn, IPOINT_BEFORE, (AFUNPTR) &CaptureRtlFreeHeapBefore,
-					IARG_FUNCARG_ENTRYPOINT_VALUE, 2,	// address
-					IARG_G_ARG0_CALLER,					// saved return pointer
-					IARG_END);
 
-				LEVEL_PINCLIENT::RTN_Close(freeRtn);
-			}
-		}
+// registers written to the exception log, the full width ones on Intel64
+struct CONTEXT_REGISTER
+{
+	const char * name;
+	REG reg;
+};
 
-	}
-}
+#if defined(TARGET_IA32)
+const CONTEXT_REGISTER ContextRegisters[] = { { "EIP", REG_INST_PTR }, { "EAX", REG_GAX }, { "EBX", REG_GBX }, { "ECX", REG_GCX },
+	{ "EDX", REG_GDX }, { "EBP", REG_GBP }, { "ESP", REG_STACK_PTR }, { "ESI", REG_GSI }, { "EDI", REG_GDI } };
+#else
+const CONTEXT_REGISTER ContextRegisters[] = { { "RIP", REG_INST_PTR }, { "RAX", REG_GAX }, { "RBX", REG_GBX }, { "RCX", REG_GCX },
+	{ "RDX", REG_GDX }, { "RBP", REG_GBP }, { "RSP", REG_STACK_PTR }, { "RSI", REG_GSI }, { "RDI", REG_GDI } };
+#endif
+
+#define NR_CONTEXT_REGISTERS (sizeof(ContextRegisters) / sizeof(ContextRegisters[0]))
 
 
 VOID LogContext(const CONTEXT *ctxt)
 {
+	// a second fatal signal finds the exception log closed
+	if (ExceptionLogFile == NULL)
+	{
+		return;
+	}
 	string exceptiontimestamp = getCurrentDateTimeStr();
-	std::fprintf(ExceptionLogFile, "Exception timestamp: %s\n", exceptiontimestamp);
+	std::fprintf(ExceptionLogFile, "Exception timestamp: %s\n", exceptiontimestamp.c_str());
 	std::fprintf(ExceptionLogFile, "PID %u | Exception context:\n", PIN_GetPid());
-	ADDRINT EIP = PIN_GetContextReg( ctxt, REG_INST_PTR );
-	ADDRINT EAX = PIN_GetContextReg( ctxt, REG_EAX );
-	ADDRINT EBX = PIN_GetContextReg( ctxt, REG_EBX );
-	ADDRINT ECX = PIN_GetContextReg( ctxt, REG_ECX );
-	ADDRINT EDX = PIN_GetContextReg( ctxt, REG_EDX );
-	ADDRINT ESP = PIN_GetContextReg( ctxt, REG_ESP );
-	ADDRINT EBP = PIN_GetContextReg( ctxt, REG_EBP );
-	ADDRINT ESI = PIN_GetContextReg( ctxt, REG_ESI );
-	ADDRINT EDI = PIN_GetContextReg( ctxt, REG_EDI );
-
-	string EIPinfo = getAddressInfo(EIP);
-	string EAXinfo = getAddressInfo(EAX);
-	string EBXinfo = getAddressInfo(EBX);
-	string ECXinfo = getAddressInfo(ECX);
-	string EDXinfo = getAddressInfo(EDX);
-	string EBPinfo = getAddressInfo(EBP);
-	string ESPinfo = getAddressInfo(ESP);
-	string ESIinfo = getAddressInfo(ESI);
-	string EDIinfo = getAddressInfo(EDI);
-
-	std::fprintf(ExceptionLogFile, "EIP: 0x%p %s\n", EIP, EIPinfo);
-	std::fprintf(ExceptionLogFile, "EAX: 0x%p %s\n", EAX, EAXinfo);
-	std::fprintf(ExceptionLogFile, "EBX: 0x%p %s\n", EBX, EBXinfo);
-	std::fprintf(ExceptionLogFile, "ECX: 0x%p %s\n", ECX, ECXinfo);
-	std::fprintf(ExceptionLogFile, "EDX: 0x%p %s\n", EDX, EDXinfo);
-	std::fprintf(ExceptionLogFile, "EBP: 0x%p %s\n", EBP, EBPinfo);
-	std::fprintf(ExceptionLogFile, "ESP: 0x%p %s\n", ESP, ESPinfo);
-	std::fprintf(ExceptionLogFile, "ESI: 0x%p %s\n", ESI, ESIinfo);
-	std::fprintf(ExceptionLogFile, "EDI: 0x%p %s\n", EDI, EDIinfo);
+	ADDRINT values[NR_CONTEXT_REGISTERS];
+	for (UINT32 i = 0; i < NR_CONTEXT_REGISTERS; i++)
+	{
+		values[i] = PIN_GetContextReg(ctxt, ContextRegisters[i].reg);
+	}
+
+	// make sure the chunk history is up to date, and keep the drain thread out while we read it
+	drainEvents();
+	string info[NR_CONTEXT_REGISTERS];
+	PIN_GetLock(&drainLock, PIN_ThreadId() + 1);
+	for (UINT32 i = 0; i < NR_CONTEXT_REGISTERS; i++)
+	{
+		info[i] = getAddressInfo(values[i]);
+	}
+	PIN_ReleaseLock(&drainLock);
+
+	// %p prints the full pointer width
+	for (UINT32 i = 0; i < NR_CONTEXT_REGISTERS; i++)
+	{
+		std::fprintf(ExceptionLogFile, "%s: 0x%p %s\n", ContextRegisters[i].name, (void *) values[i], info[i].c_str());
+	}
 	std::fprintf(ExceptionLogFile, "\n");
 }
 
@@ -754,6 +3157,17 @@ VOID LogContext(const CONTEXT *ctxt)
 
 VOID OnException(THREADID threadIndex, CONTEXT_CHANGE_REASON reason, const CONTEXT *ctxtFrom, CONTEXT *ctxtTo, INT32 info, VOID *v)
 {
+#if !defined(TARGET_WINDOWS)
+	// no exception codes here, log the context of any signal that is going to kill the process
+	if (reason == CONTEXT_CHANGE_REASON_FATALSIGNAL)
+	{
+		saveToLog(LogFile, "\n\n*** Fatal signal %d at 0x%p ***\n", info, PIN_GetContextReg(ctxtFrom, REG_INST_PTR));
+		saveToLog(LogFile, "%s\n", "For more info about this signal, see exception log file ***");
+		LogContext(ctxtFrom);
+		CloseLogFile();
+		CloseExceptionLogFile();
+	}
+#endif
 	if (reason != CONTEXT_CHANGE_REASON_EXCEPTION)
 		return;
 
@@ -764,8 +3178,8 @@ VOID OnException(THREADID threadIndex, CONTEXT_CHANGE_REASON reason, const CONTE
 	{
 		saveToLog(LogFile, "%s\n", "For more info about this exception, see exception log file ***");
 		LogContext(ctxtFrom);
-		CloseExceptionLogFile();
 		CloseLogFile();
+		CloseExceptionLogFile();
 		PIN_ExitProcess(-1);
 	}
 }
@@ -774,14 +3188,72 @@ VOID OnException(THREADID threadIndex, CONTEXT_CHANGE_REASON reason, const CONTE
 BOOL FollowChild(CHILD_PROCESS childProcess, VOID * userData)
 {
 	saveToLog(LogFile, "\n*******************************\nCreating child process from parent PID %u\n*******************************\n\n", PIN_GetPid());
+	// the child may append to the same log file, get our output in there first
+	drainEvents();
+	LogWriter.flush(NULL, 0);
 	return true;
 }
 
 
 
+VOID WriterThread(VOID * arg)
+{
+	LogWriter.run();
+}
+
+
+VOID PrepareForFini(VOID *v)
+{
+	// stop the internal threads, Fini takes care of whatever is still queued or buffered
+	if (ControlThreadStarted)
+	{
+		ControlThreadExit = true;
+		PIN_SemaphoreSet(&controlSemaphore);
+		PIN_WaitForThreadTermination(ControlThreadUid, PIN_INFINITE_TIMEOUT, NULL);
+	}
+	if (DrainThreadStarted)
+	{
+		DrainThreadExit = true;
+		PIN_SemaphoreSet(&drainSemaphore);
+		PIN_WaitForThreadTermination(DrainThreadUid, PIN_INFINITE_TIMEOUT, NULL);
+	}
+	if (WriterThreadStarted)
+	{
+		LogWriter.stop();
+		PIN_WaitForThreadTermination(WriterThreadUid, PIN_INFINITE_TIMEOUT, NULL);
+	}
+}
+
+
 VOID Fini(INT32 code, VOID *v)
 {
-	saveToLog(LogFile,"\n\nNumber of heap operations logged: %d\n",arrAllOperations.size());
+	drainEvents();
+	if (ProfileMode)
+	{
+		saveProfileToLog();
+	}
+	else
+	{
+		saveChunkIndexStats(LogFile);
+	}
+	saveLiveHeapToLog(LogFile, LeakReportSites, "Live heap at exit");
+	if (RecordTrace)
+	{
+		traceWriter.close();
+		saveToLog(LogFile, "Allocation trace: %llu records\n", traceWriter.getRecordCount());
+	}
+	if (HeapStatsInterval > 0)
+	{
+		heapStats.foldAll();
+		heapStats.writeRows(true);
+		heapStats.close();
+		heapStats.saveStatsToLog(LogFile);
+	}
+	UINT64 livechunks, freedchunks, slots;
+	chunkTable.getCounts(livechunks, freedchunks, slots);
+	saveToLog(LogFile, "Chunk table: %llu live, %llu freed chunks in %llu slots\n", livechunks, freedchunks, slots);
+	saveToLog(LogFile, "Event ring stalls: %llu\n", (unsigned long long) nrRingStalls.load());
+	saveToLog(LogFile,"\n\nNumber of heap operations logged: %llu\n",nrHeapOperations);
 	CloseLogFile();
 }
 
@@ -795,6 +3267,11 @@ VOID ThreadStart(THREADID threadid, CONTEXT *ctxt, INT32 flags, VOID *v)
 
 VOID ThreadStop(THREADID threadid, const CONTEXT *ctxt, INT32 code, VOID *v)
 {
+	if (HeapStatsInterval > 0)
+	{
+		// the thread's last changes, it won't get to fold them otherwise
+		heapStats.fold(threadid);
+	}
     PIN_GetLock(&lock, threadid+1);
     saveToLog(LogFile, "PID: %u | Closed thread id %d\n",PIN_GetPid(),threadid);
     PIN_ReleaseLock(&lock);
@@ -806,20 +3283,70 @@ int main(int argc, char *argv[])
 {
 	// init PIN Lock
 	PIN_InitLock(&lock);
+	PIN_InitLock(&drainLock);
+	PIN_SemaphoreInit(&drainSemaphore);
+	PIN_SemaphoreInit(&controlSemaphore);
 
     // Initialize PIN library.
 	PIN_Init(argc,argv);
 
+	// events are stamped with the cycle counter, find out how fast it runs
+	eventClock.init();
+
 	// convert command line options into Global options
 	LogAlloc = KnobLogAlloc.Value();
 	LogFree = KnobLogFree.Value();
 	ShowTimeStamp = KnobShowTimeStamp.Value(); 
+	ShowMicroseconds = KnobTimeStampUs.Value();
 	SplitFiles = KnobSplitFiles.Value();
+	SharedClock = KnobSharedClock.Value();
+	if (SharedClock)
+	{
+		// processes can only be merged if each has its own log
+		SplitFiles = true;
+	}
 	StaySilent = KnobStaySilent.Value();
 	BufferOutput = KnobBufferOutput.Value();
+	CompressOutput = KnobCompress.Value() && KnobBlockSize.Value() > 0;
+	if (CompressOutput)
+	{
+		// the writer thread does the compression
+		BufferOutput = true;
+	}
+	ProfileMode = KnobProfile.Value();
+	SampleRate = KnobSampleRate.Value();
+	SampleBytes = KnobSampleBytes.Value();
+	MinSize = KnobMinSize.Value();
+	if (KnobMaxSize.Value() > 0)
+	{
+		MaxSize = KnobMaxSize.Value();
+	}
+	StackDepth = KnobStackDepth.Value();
+	HistoryMB = KnobHistoryMB.Value();
+	LeakReportSites = KnobLeakReport.Value();
+	HeapStatsInterval = KnobHeapStats.Value();
+	chunkIndex.setBudget(HistoryMB);
+	UafCheck = KnobUafCheck.Value() && LogAlloc && LogFree;
+	if (StackDepth > MAX_STACK_DEPTH)
+	{
+		StackDepth = MAX_STACK_DEPTH;
+	}
+	Sampling = (SampleRate > 1 || SampleBytes > 0 || MinSize > 0 || MaxSize != 0xffffffff);
+	for (UINT32 i = 0; i < KnobModules.NumberOfValues(); i++)
+	{
+		moduleScope.addIncludes(KnobModules.Value(i));
+	}
+	for (UINT32 i = 0; i < KnobExcludeModules.NumberOfValues(); i++)
+	{
+		moduleScope.addExcludes(KnobExcludeModules.Value(i));
+	}
+	ModuleFilter = moduleScope.isActive();
+	ReplaceHooks = (KnobHookMode.Value() == "replace");
+	RecordTrace = KnobRecordTrace.Value() && LogAlloc && LogFree;
 
 	// define logfile name and behaviour
 	int currentpid = PIN_GetPid();
+	CurrentPid = currentpid;
 	stringstream ss;
 	ss << "corelan_heaplog_";
 	ss << currentpid;
@@ -827,7 +3354,15 @@ int main(int argc, char *argv[])
 	string fileName = ss.str();
 	char * openMode = "w+";
 
-	if (!SplitFiles)
+	if (CompressOutput)
+	{
+		// a compressed log can't be appended to, so every process gets its own
+		ss.str("");
+		ss << "corelan_heaplog_" << currentpid << ".hlz";
+		fileName = ss.str();
+		openMode = "wb";
+	}
+	else if (!SplitFiles)
 	{
 		fileName = "corelan_heaplog.log";
 		openMode = "a+";
@@ -836,15 +3371,54 @@ int main(int argc, char *argv[])
 	LogFile = fopen(fileName.c_str(),openMode);
 	ExceptionLogFile = fopen("corelan_heaplog_exception.log","a+");
 
+	if (HeapStatsInterval > 0)
+	{
+		ss.str("");
+		ss << "corelan_heaplog_heaps_" << currentpid << ".csv";
+		FILE* heapStatsFile = fopen(ss.str().c_str(), "w");
+		if (heapStatsFile != NULL)
+		{
+			heapStats.init(heapStatsFile, HeapStatsInterval);
+		}
+		else
+		{
+			HeapStatsInterval = 0;
+		}
+	}
+
+	if (RecordTrace)
+	{
+		ss.str("");
+		ss << "corelan_heaplog_" << currentpid << ".trace";
+		FILE* traceFile = fopen(ss.str().c_str(), "wb");
+		if (traceFile != NULL)
+		{
+			traceWriter.open(traceFile, currentpid);
+		}
+		else
+		{
+			RecordTrace = false;
+		}
+	}
+
+	if (BufferOutput)
+	{
+		LogWriter.init(LogFile, (size_t) KnobBufferSize.Value() * 1024, KnobFlushInterval.Value(),
+			CompressOutput ? KnobBlockSize.Value() * 1024 : 0);
+		WriterThreadStarted = (PIN_SpawnInternalThread(WriterThread, 0, 0, &WriterThreadUid) != INVALID_THREADID);
+	}
+
+	if (SharedClock)
+	{
+		// first line, tells heaplog_merge which process this is and how to read its clock
+		saveToLog(LogFile, "Trace: pid %u, clock tsc, base 0x%llx, %.3f ticks/us, started %llu us\n", currentpid,
+			(unsigned long long) eventClock.getBase(), eventClock.getTicksPerUs(), (unsigned long long) eventClock.getStartWall());
+	}
 	saveToLog(LogFile, "Instrumentation started\n");
 
 	// load symbols. 
 	PIN_InitSymbols();
 
-
-	// we will need a way to pass data around, so we'll store stuff in TLS
-	alloc_key = PIN_CreateThreadDataKey(0);
-
 	std::string ascii_time;
 	ascii_time = getCurrentDateTimeStr();
 
@@ -856,6 +3430,18 @@ int main(int argc, char *argv[])
 	if (LogAlloc) 	saveToLog(LogFile, "Logging heap alloc: YES\n"); else saveToLog(LogFile, "Logging heap alloc: NO\n");
 	if (LogFree) 	saveToLog(LogFile, "Logging heap free: YES\n"); else saveToLog(LogFile, "Logging heap free: NO\n");
 	if (BufferOutput) saveToLog(LogFile, "Buffering output: YES\n"); else saveToLog(LogFile, "Buffering output: NO\n");
+	if (SharedClock) saveToLog(LogFile, "Shared clock: YES\n"); else saveToLog(LogFile, "Shared clock: NO\n");
+	if (CompressOutput) saveToLog(LogFile, "Compressed output: YES, %u KB blocks\n", KnobBlockSize.Value()); else saveToLog(LogFile, "Compressed output: NO\n");
+	if (ProfileMode) saveToLog(LogFile, "Call site profile: YES\n"); else saveToLog(LogFile, "Call site profile: NO\n");
+	if (HistoryMB > 0) saveToLog(LogFile, "Chunk history budget: %u MB\n", HistoryMB); else saveToLog(LogFile, "Chunk history budget: no limit\n");
+	if (StackDepth > 0) saveToLog(LogFile, "Call stack depth: %u\n", StackDepth); else saveToLog(LogFile, "Call stack depth: NO\n");
+	if (UafCheck) saveToLog(LogFile, "Use after free check: YES\n"); else saveToLog(LogFile, "Use after free check: NO\n");
+	if (HeapStatsInterval > 0) saveToLog(LogFile, "Heap counters: every %u ms\n", HeapStatsInterval); else saveToLog(LogFile, "Heap counters: NO\n");
+	if (ReplaceHooks) saveToLog(LogFile, "Hook mode: replace\n"); else saveToLog(LogFile, "Hook mode: insert\n");
+	if (KnobControl.Value()) saveToLog(LogFile, "Control channel: corelan_heaplog_%u.cmd\n", currentpid); else saveToLog(LogFile, "Control channel: NO\n");
+	if (ModuleFilter) saveToLog(LogFile, "Modules: %s\n", moduleScope.describe().c_str()); else saveToLog(LogFile, "Modules: all\n");
+	if (RecordTrace) saveToLog(LogFile, "Allocation trace: corelan_heaplog_%u.trace\n", currentpid); else saveToLog(LogFile, "Allocation trace: NO\n");
+	if (Sampling) saveToLog(LogFile, "Sampling: 1 in %u, every %u bytes, size 0x%x - 0x%x\n", SampleRate, SampleBytes, MinSize, MaxSize); else saveToLog(LogFile, "Sampling: NO\n");
 	
 	// notify when following child process
 	PIN_AddFollowChildProcessFunction(FollowChild, 0);
@@ -871,10 +3457,40 @@ int main(int argc, char *argv[])
 	{
 		// Register function to be called to instrument traces
 		IMG_AddInstrumentFunction(AddInstrumentation, 0);
+		IMG_AddUnloadFunction(RemoveImage, 0);
+
+		// check every memory access against freed chunks
+		if (UafCheck)
+		{
+			INS_AddInstrumentFunction(InstrumentMemoryAccess, 0);
+		}
 
 		// Register function to be called when the application exits
 		PIN_AddFiniFunction(Fini, 0);
+
+		// analysis routines only queue events, this thread processes them
+		DrainThreadStarted = (PIN_SpawnInternalThread(DrainThread, 0, 0, &DrainThreadUid) != INVALID_THREADID);
+		if (!DrainThreadStarted)
+		{
+			saveToLog(LogFile, "***Error: Unable to start drain thread\n");
+		}
+
+		if (KnobControl.Value())
+		{
+			ss.str("");
+			ss << "corelan_heaplog_" << currentpid;
+			ControlCommandFile = ss.str() + ".cmd";
+			ControlReplyFile = ss.str() + ".reply";
+			// a command left behind by an earlier process with the same pid
+			remove(ControlCommandFile.c_str());
+			ControlThreadStarted = (PIN_SpawnInternalThread(ControlThread, 0, 0, &ControlThreadUid) != INVALID_THREADID);
+			if (!ControlThreadStarted)
+			{
+				saveToLog(LogFile, "***Error: Unable to start control thread\n");
+			}
+		}
 	}
+	PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
 
 	//Handle exceptions
 	PIN_AddContextChangeFunction(OnException, 0);
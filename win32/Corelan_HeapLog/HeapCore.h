@@ -0,0 +1,1102 @@
+/*
+	The Pin-independent core of Corelan_HeapLog: the heap event model, the per-thread event
+	rings, the chunk history index, the allocation trace writer, the log line formatter and
+	the buffered log writer
+
+	Kept out of Corelan_HeapLog.cpp, like ChunkTable.h and BlockFile.h, so it can be measured
+	and reused without Pin (see heapcore_bench.cpp). Locks and events come from HeapPlatform.h.
+	The pintool defines HEAPLOG_PIN and includes pin.H first. Anything else defines ADDRINT,
+	UINT8, UINT16, UINT32, UINT64, INT32 and INT64 before including this file, and may define
+	CHUNKTABLE_YIELD(), see ChunkTable.h.
+
+	Same license as Corelan_HeapLog.cpp
+*/
+
+#ifndef HEAPCORE_H
+#define HEAPCORE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include "HeapPlatform.h"
+#include "ChunkTable.h"
+#include "BlockFile.h"
+#include "AllocTrace.h"
+
+
+/* ================================================================== */
+// Heap events
+/* ================================================================== */
+
+enum HEAP_OP
+{
+	OP_RTLALLOCATEHEAP = 0,
+	OP_RTLREALLOCATEHEAP,
+	OP_VIRTUALALLOC,
+	OP_MMAP,
+	OP_RTLFREEHEAP,
+	OP_MUNMAP,
+	OP_LAST
+};
+
+// names used in the exception log
+static const char * const OperationNames[OP_LAST] = { "rtlallocateheap", "rtlreallocateheap", "virtualalloc", "mmap", "rtlfreeheap", "munmap" };
+
+inline bool isFreeOperation(UINT32 operation)
+{
+	return operation == OP_RTLFREEHEAP || operation == OP_MUNMAP;
+}
+
+
+// One intercepted heap operation. Plain old data, no strings or other heap allocated members:
+// 32 bytes on IA-32 and Intel64. User space addresses fit in 48 bits on Intel64 (Windows and Linux
+// with 4 level page tables), so the small fields share a quadword with each of them
+struct HEAP_EVENT
+{
+	UINT64 timestamp : 48;			// cycle counter since startup, in units of 1 << TIMESTAMP_SHIFT cycles
+	UINT64 threadid : 16;
+	UINT64 chunk_start : 48;
+	UINT64 moduleid : 16;			// module of saved_return_pointer, see moduleTable
+	UINT64 saved_return_pointer : 48;
+	UINT64 operation : 4;			// HEAP_OP
+	UINT64 flags : 4;				// EV_*
+	UINT64 alignshift : 8;			// log2 of the requested alignment, 0 for the allocator's default
+	UINT32 chunk_size;
+	UINT32 stackid;					// call stack in stackDepot, 0 if we don't capture stacks
+
+	ADDRINT chunk_end() const
+	{
+		return (ADDRINT) chunk_start + chunk_size;
+	}
+
+	bool isAlloc() const
+	{
+		return operation <= OP_MMAP;
+	}
+};
+
+// HEAP_EVENT flags
+#define EV_DOUBLE_FREE 0x01				// chunk was freed already
+#define EV_ZEROED 0x02					// calloc
+#define EV_MOVED_FROM 0x04				// not an operation: a realloc moved chunk_start, the realloc itself follows
+
+static_assert(sizeof(HEAP_EVENT) == 32, "HEAP_EVENT should fit in 32 bytes");
+
+
+/* ================================================================== */
+// Per-thread event rings
+/* ================================================================== */
+
+// Every application thread queues its heap events in its own ring, and a single consumer
+// merges them in clock order
+#define RING_SIZE 8192			// events per thread, must be a power of 2
+#define RING_WAKE (RING_SIZE / 4)	// queued events that wake up the consumer early
+#define RING_NOT_HELD (~(UINT64) 0)
+
+struct RING_ENTRY
+{
+	UINT64 clock;				// cycle counter at capture time, orders events across threads
+	HEAP_EVENT ev;
+};
+
+class CEventRing
+{
+public:
+	CEventRing()
+	{
+		head = 0;
+		tail = 0;
+		lastclock = 0;
+		held = RING_NOT_HELD;
+	}
+
+	// Producer side, called before the clock of the next event is read. Until that event is pushed
+	// (or unhold is called), heldSince tells the consumer not to take anything stamped after the
+	// last event of this ring: the new event will be older than that
+	void hold()
+	{
+		held.store(lastclock, std::memory_order_seq_cst);
+	}
+
+	void unhold()
+	{
+		held.store(RING_NOT_HELD, std::memory_order_release);
+	}
+
+	// consumer side, RING_NOT_HELD if the producer isn't between hold and push
+	UINT64 heldSince()
+	{
+		return held.load(std::memory_order_seq_cst);
+	}
+
+	// producer side, only called by the thread that owns the ring
+	bool push(UINT64 clock, const HEAP_EVENT& ev)
+	{
+		UINT32 h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) == RING_SIZE)
+		{
+			return false;
+		}
+		RING_ENTRY& entry = entries[h & (RING_SIZE - 1)];
+		entry.clock = clock;
+		entry.ev = ev;
+		head.store(h + 1, std::memory_order_release);
+		lastclock = clock;
+		held.store(RING_NOT_HELD, std::memory_order_release);
+		return true;
+	}
+
+	UINT32 used()
+	{
+		return head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire);
+	}
+
+	// consumer side, copy all events captured before 'until' into batch
+	void take(UINT64 until, std::vector<RING_ENTRY>& batch)
+	{
+		UINT32 t = tail.load(std::memory_order_relaxed);
+		UINT32 h = head.load(std::memory_order_acquire);
+		while (t != h && entries[t & (RING_SIZE - 1)].clock < until)
+		{
+			batch.push_back(entries[t & (RING_SIZE - 1)]);
+			t++;
+		}
+		tail.store(t, std::memory_order_release);
+	}
+
+private:
+	std::atomic<UINT32> head;	// next slot the producer writes
+	std::atomic<UINT64> held;	// see hold
+	UINT64 lastclock;			// clock of the last event pushed, only used by the producer
+	char padding[64];			// keep producer and consumer index on separate cache lines
+	std::atomic<UINT32> tail;	// next slot the consumer reads
+	RING_ENTRY entries[RING_SIZE];
+};
+
+
+/* ================================================================== */
+// Chunk history
+/* ================================================================== */
+
+// chunk histories are grouped by span (the highest end ever seen minus the start), rounded up
+// to a power of 2: class k holds the spans from 2^(k-1) + 1 up to 2^k, in buckets of 2^k bytes
+// of address space
+#define NR_SPAN_BITS (sizeof(ADDRINT) * 8)
+#define NR_SPAN_CLASSES (NR_SPAN_BITS + 1)
+
+// number of operations remembered per chunk start address, older ones are overwritten
+#define CHUNK_HISTORY_OPS 8
+
+struct HISTORY_ENTRY
+{
+	UINT64 seq;						// orders operations across chunks
+	HEAP_EVENT ev;
+};
+
+class CChunkHistory
+{
+public:
+	ADDRINT chunk_start;
+	ADDRINT max_end;				// highest chunk_end ever seen for this start address
+	HISTORY_ENTRY operations[CHUNK_HISTORY_OPS];	// ring with the most recent operations
+	UINT32 nroperations;			// operations ever seen, the newest one is at (nroperations - 1) % CHUNK_HISTORY_OPS
+	bool dead;						// last operation was a free
+	CChunkHistory* older;			// position in the eviction list of the chunk
+	CChunkHistory* newer;
+	CChunkHistory* samebucket;		// next history in the span bucket of the chunk
+
+	CChunkHistory()
+	{
+		chunk_start = 0;
+		max_end = 0;
+		nroperations = 0;
+		dead = false;
+		older = NULL;
+		newer = NULL;
+		samebucket = NULL;
+	}
+};
+
+
+// doubly linked list of chunk histories, oldest first
+struct HISTORY_LIST
+{
+	CChunkHistory* oldest;
+	CChunkHistory* newest;
+};
+
+
+// Address-range index with the last few operations of every chunk, maintained as heap operations are saved.
+// A chunk that contains an address starts at most its span class size below it, so a lookup only
+// visits two buckets per span class in use: the one of the address and the one below. The chunks
+// in a bucket are at least half the bucket size, so there are only a few unless they overlap in
+// time, whatever the number of chunks packed around the address.
+// The number of chunks is capped by -historymb. When the cap is hit, the chunk that has been dead (freed)
+// the longest is evicted, or the least recently used live chunk if nothing is dead
+class CChunkIndex
+{
+public:
+	// freed chunks that get evicted are forgotten in the chunk table as well
+	CChunkIndex(CChunkTable* chunks)
+	{
+		table = chunks;
+		maxhistories = 0;
+		nrsaved = 0;
+		evicteddead = 0;
+		evictedlive = 0;
+		deadlist.oldest = deadlist.newest = NULL;
+		livelist.oldest = livelist.newest = NULL;
+	}
+
+	void setBudget(UINT32 megabytes)
+	{
+		// map node overhead is about 4 pointers, a span bucket costs about 2 on top of its entry
+		maxhistories = (UINT64) megabytes * 1024 * 1024 / (sizeof(std::pair<const ADDRINT, CChunkHistory>) + 4 * sizeof(void*) +
+			sizeof(std::pair<const ADDRINT, CChunkHistory*>) + 2 * sizeof(void*));
+	}
+
+	void add(const HEAP_EVENT& op)
+	{
+		std::map<ADDRINT, CChunkHistory>::iterator it = histories.find(op.chunk_start);
+		if (it == histories.end())
+		{
+			if (maxhistories > 0 && histories.size() >= maxhistories)
+			{
+				evict();
+			}
+			it = histories.insert(std::make_pair(op.chunk_start, CChunkHistory())).first;
+			it->second.chunk_start = op.chunk_start;
+			it->second.max_end = op.chunk_start;
+			insertSpan(it->second, 0);
+		}
+		else
+		{
+			unlink(it->second);
+		}
+
+		CChunkHistory& history = it->second;
+		HISTORY_ENTRY& entry = history.operations[history.nroperations % CHUNK_HISTORY_OPS];
+		entry.seq = nrsaved++;
+		entry.ev = op;
+		history.nroperations++;
+		history.dead = !op.isAlloc();
+		append(history.dead ? deadlist : livelist, history);
+
+		if (op.chunk_end() > history.max_end)
+		{
+			UINT32 oldclass = spanClass(history);
+			history.max_end = op.chunk_end();
+			UINT32 newclass = spanClass(history);
+			if (newclass != oldclass)
+			{
+				removeSpan(history, oldclass);
+				insertSpan(history, newclass);
+			}
+		}
+	}
+
+	// a realloc moved the chunk away: it is dead from now on, without an operation of its own
+	void retire(ADDRINT chunk_start)
+	{
+		std::map<ADDRINT, CChunkHistory>::iterator it = histories.find(chunk_start);
+		if (it != histories.end() && !it->second.dead)
+		{
+			unlink(it->second);
+			it->second.dead = true;
+			append(deadlist, it->second);
+		}
+	}
+
+	// returns the remembered operations on chunks that contain address, oldest first
+	std::vector<HISTORY_ENTRY> find(ADDRINT address)
+	{
+		std::vector<HISTORY_ENTRY> result;
+
+		for (UINT32 k = 0; k < NR_SPAN_CLASSES; k++)
+		{
+			if (spans[k].empty())
+			{
+				continue;
+			}
+			ADDRINT bucket = bucketOf(address, k);
+			collectBucket(k, bucket, address, result);
+			if (bucket > 0)
+			{
+				collectBucket(k, bucket - 1, address, result);
+			}
+		}
+
+		std::sort(result.begin(), result.end(), olderEntry);
+		return result;
+	}
+
+	void getStats(UINT64& kept, UINT64& dead, UINT64& live) const
+	{
+		kept = histories.size();
+		dead = evicteddead;
+		live = evictedlive;
+	}
+
+private:
+	CChunkTable* table;
+	std::map<ADDRINT, CChunkHistory> histories;		// keyed by chunk start
+	std::unordered_map<ADDRINT, CChunkHistory*> spans[NR_SPAN_CLASSES];	// per span class, first history in each bucket
+	HISTORY_LIST deadlist;							// freed chunks, in order of the free
+	HISTORY_LIST livelist;							// allocated chunks, in order of the last operation
+	UINT64 maxhistories;							// 0 means no limit
+	UINT64 nrsaved;
+	UINT64 evicteddead;
+	UINT64 evictedlive;
+
+	static UINT32 spanClass(const CChunkHistory& history)
+	{
+		ADDRINT span = history.max_end - history.chunk_start;
+		UINT32 k = 0;
+		while (k < NR_SPAN_BITS && ((ADDRINT) 1 << k) < span)
+		{
+			k++;
+		}
+		return k;
+	}
+
+	static ADDRINT bucketOf(ADDRINT address, UINT32 spanclass)
+	{
+		return spanclass < NR_SPAN_BITS ? address >> spanclass : 0;
+	}
+
+	void insertSpan(CChunkHistory& history, UINT32 spanclass)
+	{
+		CChunkHistory*& first = spans[spanclass][bucketOf(history.chunk_start, spanclass)];
+		history.samebucket = first;
+		first = &history;
+	}
+
+	void removeSpan(CChunkHistory& history, UINT32 spanclass)
+	{
+		std::unordered_map<ADDRINT, CChunkHistory*>::iterator it = spans[spanclass].find(bucketOf(history.chunk_start, spanclass));
+		CChunkHistory** link = &it->second;
+		while (*link != &history)
+		{
+			link = &(*link)->samebucket;
+		}
+		*link = history.samebucket;
+		if (it->second == NULL)
+		{
+			spans[spanclass].erase(it);
+		}
+	}
+
+	static bool olderEntry(const HISTORY_ENTRY& a, const HISTORY_ENTRY& b)
+	{
+		return a.seq < b.seq;
+	}
+
+	void append(HISTORY_LIST& list, CChunkHistory& history)
+	{
+		history.older = list.newest;
+		history.newer = NULL;
+		if (list.newest != NULL)
+		{
+			list.newest->newer = &history;
+		}
+		else
+		{
+			list.oldest = &history;
+		}
+		list.newest = &history;
+	}
+
+	void unlink(CChunkHistory& history)
+	{
+		HISTORY_LIST& list = history.dead ? deadlist : livelist;
+		if (history.older != NULL)
+		{
+			history.older->newer = history.newer;
+		}
+		else
+		{
+			list.oldest = history.newer;
+		}
+		if (history.newer != NULL)
+		{
+			history.newer->older = history.older;
+		}
+		else
+		{
+			list.newest = history.older;
+		}
+		history.older = NULL;
+		history.newer = NULL;
+	}
+
+	void evict()
+	{
+		CChunkHistory* victim = deadlist.oldest;
+		if (victim != NULL)
+		{
+			evicteddead++;
+			// a free this old isn't worth a double free report anymore
+			table->forget(victim->chunk_start, CHUNK_FREED);
+		}
+		else
+		{
+			victim = livelist.oldest;
+			evictedlive++;
+		}
+		unlink(*victim);
+		removeSpan(*victim, spanClass(*victim));
+		histories.erase(victim->chunk_start);
+	}
+
+	void collectBucket(UINT32 spanclass, ADDRINT bucket, ADDRINT address, std::vector<HISTORY_ENTRY>& result)
+	{
+		std::unordered_map<ADDRINT, CChunkHistory*>::iterator it = spans[spanclass].find(bucket);
+		if (it == spans[spanclass].end())
+		{
+			return;
+		}
+		for (CChunkHistory* history = it->second; history != NULL; history = history->samebucket)
+		{
+			if (history->chunk_start <= address)
+			{
+				collect(*history, address, result);
+			}
+		}
+	}
+
+	void collect(const CChunkHistory& history, ADDRINT address, std::vector<HISTORY_ENTRY>& result)
+	{
+		if (address > history.max_end)
+		{
+			return;
+		}
+		UINT32 count = history.nroperations < CHUNK_HISTORY_OPS ? history.nroperations : CHUNK_HISTORY_OPS;
+		for (UINT32 i = 0; i < count; i++)
+		{
+			const HISTORY_ENTRY& entry = history.operations[i];
+			if (entry.ev.chunk_start <= address && address <= entry.ev.chunk_end())
+			{
+				result.push_back(entry);
+			}
+		}
+	}
+};
+
+
+/* ================================================================== */
+// Allocation trace
+/* ================================================================== */
+
+// Turns heap events, in clock order, into the records of an allocation trace (see AllocTrace.h).
+// Live chunk addresses are mapped to object numbers. Not thread safe, the pintool only uses it
+// from the drain, under drainLock
+class CTraceWriter
+{
+public:
+	CTraceWriter()
+	{
+		file = NULL;
+		memset(&header, 0, sizeof(header));
+	}
+
+	// takes over traceFile, which is closed by close()
+	void open(FILE* traceFile, UINT32 pid)
+	{
+		file = traceFile;
+		setvbuf(file, NULL, _IOFBF, 1 << 20);
+		memcpy(header.magic, ALLOC_TRACE_MAGIC, sizeof(header.magic));
+		header.version = ALLOC_TRACE_VERSION;
+		header.pid = pid;
+		fwrite(&header, sizeof(header), 1, file);
+	}
+
+	void add(const HEAP_EVENT& ev)
+	{
+		if (file == NULL || ev.operation == OP_VIRTUALALLOC || ev.operation == OP_MMAP || ev.operation == OP_MUNMAP)
+		{
+			return;
+		}
+		UINT16 thread = (UINT16) ev.threadid;
+		if (thread >= moves.size())
+		{
+			moves.resize(thread + 1, 0);
+		}
+		if ((ev.flags & EV_MOVED_FROM) != 0)
+		{
+			// the object goes with the realloc this thread logs next
+			dropMove(thread);
+			moves[thread] = takeObject(ev.chunk_start);
+			return;
+		}
+		UINT64 moved = moves[thread];
+		moves[thread] = 0;
+
+		switch (ev.operation)
+		{
+		case OP_RTLALLOCATEHEAP:
+			dropObject(ev.chunk_start, thread);
+			addRecord(newObject(ev.chunk_start), ev.chunk_size, thread, (ev.flags & EV_ZEROED) != 0 ? TRACE_CALLOC : TRACE_MALLOC, ev.alignshift);
+			break;
+		case OP_RTLREALLOCATEHEAP:
+		{
+			if (moved == 0)
+			{
+				// resized in place. realloc(NULL, size) is an allocation
+				std::unordered_map<ADDRINT, UINT64>::iterator it = objects.find(ev.chunk_start);
+				if (it == objects.end())
+				{
+					addRecord(newObject(ev.chunk_start), ev.chunk_size, thread, TRACE_MALLOC, ev.alignshift);
+					break;
+				}
+				moved = it->second;
+			}
+			else
+			{
+				dropObject(ev.chunk_start, thread);
+				objects[ev.chunk_start] = moved;
+			}
+			addRecord(moved, ev.chunk_size, thread, TRACE_REALLOC, 0);
+			break;
+		}
+		case OP_RTLFREEHEAP:
+			dropObject(ev.chunk_start, thread);
+			break;
+		}
+		if (moved != 0 && ev.operation != OP_RTLREALLOCATEHEAP)
+		{
+			// the realloc that moved the object wasn't recorded, as far as the trace knows it was freed
+			addRecord(moved, 0, thread, TRACE_FREE, 0);
+		}
+	}
+
+	// write the counts into the header and close the trace
+	void close()
+	{
+		if (file == NULL)
+		{
+			return;
+		}
+		for (size_t thread = 0; thread < moves.size(); thread++)
+		{
+			dropMove((UINT16) thread);
+		}
+		fseek(file, 0, SEEK_SET);
+		fwrite(&header, sizeof(header), 1, file);
+		fclose(file);
+		file = NULL;
+	}
+
+	UINT64 getRecordCount() const
+	{
+		return header.nrrecords;
+	}
+
+private:
+	FILE* file;
+	ALLOC_TRACE_HEADER header;					// counts are kept up to date in here
+	std::unordered_map<ADDRINT, UINT64> objects;	// live chunks
+	std::vector<UINT64> moves;					// per thread, object of a moved chunk waiting for its realloc
+
+	UINT64 newObject(ADDRINT address)
+	{
+		UINT64 id = ++header.nrobjects;
+		objects[address] = id;
+		return id;
+	}
+
+	// number of the object at address, which is no longer there. 0 if it isn't known
+	UINT64 takeObject(ADDRINT address)
+	{
+		std::unordered_map<ADDRINT, UINT64>::iterator it = objects.find(address);
+		if (it == objects.end())
+		{
+			return 0;
+		}
+		UINT64 id = it->second;
+		objects.erase(it);
+		return id;
+	}
+
+	// free whatever object is at address. Frees of chunks we never saw (or double frees) are dropped,
+	// and a chunk that is handed out again without a free we saw was freed before
+	void dropObject(ADDRINT address, UINT16 thread)
+	{
+		UINT64 id = takeObject(address);
+		if (id != 0)
+		{
+			addRecord(id, 0, thread, TRACE_FREE, 0);
+		}
+	}
+
+	void dropMove(UINT16 thread)
+	{
+		if (moves[thread] != 0)
+		{
+			addRecord(moves[thread], 0, thread, TRACE_FREE, 0);
+			moves[thread] = 0;
+		}
+	}
+
+	void addRecord(UINT64 id, UINT32 size, UINT16 thread, UINT8 op, UINT8 alignshift)
+	{
+		ALLOC_TRACE_RECORD record;
+		record.objectid = id;
+		record.size = size;
+		record.thread = thread;
+		record.op = op;
+		record.alignshift = alignshift;
+		fwrite(&record, sizeof(record), 1, file);
+		header.nrrecords++;
+		if ((UINT32) thread + 1 > header.nrthreads)
+		{
+			header.nrthreads = thread + 1;
+		}
+	}
+};
+
+
+/* ================================================================== */
+// Log output
+/* ================================================================== */
+
+#define TEXT_BLOCK_SIZE 0x10000
+
+// Heap events are rendered straight into a large block with the appenders below, which produce
+// exactly what the printf formats they replace did. The block goes to the log in one piece,
+// when it is full or at the end of a drain pass, to the output function it was created with.
+// Not thread safe, the pintool only uses it from the drain, under drainLock
+typedef void (*TEXT_OUTPUT)(const char * data, size_t len, const BLOCK_META* meta);
+
+class CTextBlock
+{
+public:
+	CTextBlock(TEXT_OUTPUT out)
+	{
+		output = out;
+		used = 0;
+		clearBlockMeta(meta);
+	}
+
+	// the text that follows is about a heap event at wall clock time (in us) on chunk [start, end)
+	void note(UINT64 time, ADDRINT start, ADDRINT end)
+	{
+		BLOCK_META event = { time, time, start, end };
+		mergeBlockMeta(meta, event);
+	}
+
+	CTextBlock& str(const char * s)
+	{
+		return raw(s, strlen(s));
+	}
+
+	CTextBlock& raw(const char * s, size_t len)
+	{
+		while (len > 0)
+		{
+			if (used == TEXT_BLOCK_SIZE)
+			{
+				flush();
+			}
+			size_t part = (len < TEXT_BLOCK_SIZE - used) ? len : TEXT_BLOCK_SIZE - used;
+			memcpy(data + used, s, part);
+			used += part;
+			s += part;
+			len -= part;
+		}
+		return *this;
+	}
+
+	// %u
+	CTextBlock& dec(UINT64 value)
+	{
+		char digits[24];
+		char* p = digits + sizeof(digits);
+		do
+		{
+			*--p = (char) ('0' + value % 10);
+			value /= 10;
+		}
+		while (value != 0);
+		return raw(p, digits + sizeof(digits) - p);
+	}
+
+	// %x
+	CTextBlock& hex(UINT64 value)
+	{
+		return hexDigits(value, 1, "0123456789abcdef");
+	}
+
+	// %p
+	CTextBlock& ptr(ADDRINT value)
+	{
+#if defined(TARGET_WINDOWS)
+		// all digits, upper case
+		return hexDigits(value, 2 * sizeof(ADDRINT), "0123456789ABCDEF");
+#else
+		// glibc style
+		if (value == 0)
+		{
+			return str("(nil)");
+		}
+		return str("0x").hexDigits(value, 1, "0123456789abcdef");
+#endif
+	}
+
+	void flush()
+	{
+		if (used > 0)
+		{
+			output(data, used, meta.firsttime != 0 ? &meta : NULL);
+			used = 0;
+			clearBlockMeta(meta);
+		}
+	}
+
+private:
+	TEXT_OUTPUT output;
+	char data[TEXT_BLOCK_SIZE];
+	size_t used;
+	BLOCK_META meta;			// of the heap events in data, see note()
+
+	CTextBlock& hexDigits(UINT64 value, UINT32 mindigits, const char * digitchars)
+	{
+		char digits[16];
+		char* p = digits + sizeof(digits);
+		do
+		{
+			*--p = digitchars[value & 0xf];
+			value >>= 4;
+		}
+		while (value != 0 || digits + sizeof(digits) - p < (INT32) mindigits);
+		return raw(p, digits + sizeof(digits) - p);
+	}
+};
+
+// "PID: %u | <time> [@<clock>] | <operation> from 0x%p (<module>) [stack <id>]\n", one log line per heap event.
+// time is "" and clock is NULL when they are not shown
+inline void formatHeapEvent(CTextBlock& text, const HEAP_EVENT& ev, UINT32 pid, const char * time, const UINT64* clock, const char * module)
+{
+	text.str("PID: ").dec(pid).str(" | ").str(time);
+	if (clock != NULL)
+	{
+		// "@%llx", the raw cycle counter orders events across processes
+		text.str(time[0] != 0 ? " @" : "@").hex(*clock);
+	}
+	text.str(" | ");
+	switch (ev.operation)
+	{
+	case OP_RTLALLOCATEHEAP:
+		// "alloc(0x%x) = 0x%p from 0x%p (%s)"
+		text.str("alloc(0x").hex(ev.chunk_size).str(") = 0x").ptr(ev.chunk_start);
+		break;
+	case OP_RTLREALLOCATEHEAP:
+	case OP_VIRTUALALLOC:
+	case OP_MMAP:
+		// "realloc(0x%x) at 0x%p from 0x%p (%s)"
+		text.str(ev.operation == OP_RTLREALLOCATEHEAP ? "realloc(0x" : ev.operation == OP_VIRTUALALLOC ? "virtualalloc(0x" : "mmap(0x")
+			.hex(ev.chunk_size).str(") at 0x").ptr(ev.chunk_start);
+		break;
+	case OP_RTLFREEHEAP:
+	case OP_MUNMAP:
+		// "free(0x%p) from 0x%p (size was 0x%x) (%s)"
+		text.str(ev.operation == OP_RTLFREEHEAP ? "free(0x" : "munmap(0x").ptr(ev.chunk_start)
+			.str(") from 0x").ptr(ev.saved_return_pointer).str(" (size was 0x").hex(ev.chunk_size).str(") (")
+			.str(module).str(")");
+		break;
+	}
+	if (ev.isAlloc())
+	{
+		text.str(" from 0x").ptr(ev.saved_return_pointer).str(" (").str(module).str(")");
+	}
+	if (ev.stackid != 0)
+	{
+		text.str(" [stack ").dec(ev.stackid).str("]");
+	}
+	text.str("\n");
+}
+
+// "PID: %u >>> Double Free of 0x%p from 0x%p (%s) <<<\n"
+inline void formatDoubleFree(CTextBlock& text, const HEAP_EVENT& ev, UINT32 pid, const char * module)
+{
+	text.str("PID: ").dec(pid).str(" >>> Double Free of 0x").ptr(ev.chunk_start)
+		.str(" from 0x").ptr(ev.saved_return_pointer).str(" (").str(module).str(") <<<\n");
+}
+
+
+// part of a log buffer that holds heap events, for the block index of compressed output
+struct META_RECORD
+{
+	size_t start;
+	size_t end;
+	BLOCK_META meta;
+};
+
+// ranges per buffer, further ones are merged into the last one
+#define LOG_BUFFER_RECORDS 64
+
+struct LOG_BUFFER
+{
+	char* data;
+	size_t used;
+	UINT32 nrrecords;
+	META_RECORD records[LOG_BUFFER_RECORDS];
+};
+
+// Double buffered log writer. Threads that log something only copy it into the active
+// buffer. When that one is full, it is swapped with the spare one and handed to the
+// writer thread, which writes it to disk in one go. With compressed output, the writer
+// thread also cuts the text into blocks and compresses them, see BlockFile.h
+class CLogWriter
+{
+public:
+	CLogWriter()
+	{
+		file = NULL;
+		active = NULL;
+		pending = NULL;
+		spare = NULL;
+		buffersize = 0;
+		flushinterval = 0;
+		compress = false;
+		running = false;
+		stopping = false;
+	}
+
+	// blocksize is the uncompressed size of a compressed block, 0 to write plain text
+	void init(FILE* LogF, size_t size, UINT32 interval, UINT32 blocksize)
+	{
+		file = LogF;
+		buffersize = size;
+		flushinterval = interval;
+		active = newBuffer();
+		spare = newBuffer();
+		compress = (blocksize > 0);
+		if (compress)
+		{
+			blockFile.open(file, blocksize);
+		}
+	}
+
+	// copy data into the active buffer, called by any thread.
+	// meta describes the heap events in data, if any, for the block index
+	void write(const char * data, size_t len, const BLOCK_META* meta = NULL)
+	{
+		if (len > buffersize)
+		{
+			// doesn't fit in a buffer anyway
+			flush(data, len, meta);
+			return;
+		}
+		bufferLock.lock();
+		if (active->used + len > buffersize)
+		{
+			// wait until the writer thread is done with the previous buffer
+			while (pending != NULL)
+			{
+				if (!running)
+				{
+					bufferLock.unlock();
+					flush(NULL, 0);
+					bufferLock.lock();
+					continue;
+				}
+				bufferFree.clear();
+				bufferLock.unlock();
+				bufferFree.timedWait(flushinterval);
+				bufferLock.lock();
+			}
+			handOffLocked();
+		}
+		if (meta != NULL)
+		{
+			addRecord(active, active->used, active->used + len, *meta);
+		}
+		memcpy(active->data + active->used, data, len);
+		active->used += len;
+		bufferLock.unlock();
+	}
+
+	// write everything (plus optional extra data) to disk right now, from the calling thread.
+	// Compressed output is only written a block at a time, the last one when the log is closed
+	void flush(const char * data, size_t len, const BLOCK_META* meta = NULL)
+	{
+		fileLock.lock();
+		bufferLock.lock();
+		if (pending != NULL)
+		{
+			writeToFile(pending);
+			releasePendingLocked();
+		}
+		writeToFile(active);
+		clearBuffer(active);
+		writeToFile(data, len, meta);
+		if (file != NULL)
+		{
+			fflush(file);
+		}
+		bufferLock.unlock();
+		fileLock.unlock();
+	}
+
+	// flush and detach from the log file, anything written afterwards is dropped
+	void close()
+	{
+		flush(NULL, 0);
+		fileLock.lock();
+		if (compress && file != NULL)
+		{
+			// last block and the block index
+			blockFile.close();
+			fflush(file);
+		}
+		file = NULL;
+		fileLock.unlock();
+	}
+
+	// body of the writer thread
+	void run()
+	{
+		running = true;
+		while (!stopping)
+		{
+			bool handedoff = dataReady.timedWait(flushinterval);
+			dataReady.clear();
+			if (!handedoff)
+			{
+				// nothing filled up for a while, write what we have so far
+				bufferLock.lock();
+				if (pending == NULL && active->used > 0)
+				{
+					handOffLocked();
+				}
+				bufferLock.unlock();
+			}
+			writePending();
+		}
+		running = false;
+		bufferFree.set();
+	}
+
+	void stop()
+	{
+		stopping = true;
+		dataReady.set();
+	}
+
+private:
+	FILE* file;
+	LOG_BUFFER* active;			// buffer that is being filled
+	LOG_BUFFER* pending;		// full buffer handed to the writer thread, NULL when there is none
+	LOG_BUFFER* spare;			// free buffer, NULL while the other one is pending
+	size_t buffersize;
+	UINT32 flushinterval;		// ms
+	bool compress;
+	CBlockFileWriter blockFile;	// with compressed output, only used with fileLock held
+	volatile bool running;
+	volatile bool stopping;
+	CPlatformLock bufferLock;	// protects the buffer pointers, never held while writing except in flush()
+	CPlatformLock fileLock;		// serializes writes to file, taken before bufferLock
+	CPlatformEvent dataReady;	// a buffer has been handed off
+	CPlatformEvent bufferFree;	// the pending buffer has been written
+
+	LOG_BUFFER* newBuffer()
+	{
+		LOG_BUFFER* buffer = new LOG_BUFFER;
+		buffer->data = new char[buffersize];
+		clearBuffer(buffer);
+		return buffer;
+	}
+
+	static void clearBuffer(LOG_BUFFER* buffer)
+	{
+		buffer->used = 0;
+		buffer->nrrecords = 0;
+	}
+
+	// remember what is in data[start, end) of buffer, merged with the previous range if it is adjacent
+	static void addRecord(LOG_BUFFER* buffer, size_t start, size_t end, const BLOCK_META& meta)
+	{
+		if (buffer->nrrecords > 0 &&
+			(buffer->nrrecords == LOG_BUFFER_RECORDS || buffer->records[buffer->nrrecords - 1].end == start))
+		{
+			META_RECORD& last = buffer->records[buffer->nrrecords - 1];
+			last.end = end;
+			mergeBlockMeta(last.meta, meta);
+			return;
+		}
+		META_RECORD& record = buffer->records[buffer->nrrecords++];
+		record.start = start;
+		record.end = end;
+		record.meta = meta;
+	}
+
+	// swap the active buffer for the spare one, caller must hold bufferLock and make sure there is no pending buffer
+	void handOffLocked()
+	{
+		pending = active;
+		active = spare;
+		spare = NULL;
+		dataReady.set();
+	}
+
+	void releasePendingLocked()
+	{
+		clearBuffer(pending);
+		spare = pending;
+		pending = NULL;
+		bufferFree.set();
+	}
+
+	void writePending()
+	{
+		fileLock.lock();
+		bufferLock.lock();
+		LOG_BUFFER* buffer = pending;
+		bufferLock.unlock();
+		if (buffer != NULL)
+		{
+			// nobody else touches the pending buffer, and flush() can't run while we hold fileLock
+			writeToFile(buffer);
+			bufferLock.lock();
+			releasePendingLocked();
+			bufferLock.unlock();
+		}
+		fileLock.unlock();
+	}
+
+	// caller must hold fileLock
+	void writeToFile(const LOG_BUFFER* buffer)
+	{
+		size_t done = 0;
+		for (UINT32 i = 0; i < buffer->nrrecords; i++)
+		{
+			const META_RECORD& record = buffer->records[i];
+			writeToFile(buffer->data + done, record.start - done, NULL);
+			writeToFile(buffer->data + record.start, record.end - record.start, &record.meta);
+			done = record.end;
+		}
+		writeToFile(buffer->data + done, buffer->used - done, NULL);
+	}
+
+	// caller must hold fileLock
+	void writeToFile(const char * data, size_t len, const BLOCK_META* meta)
+	{
+		if (file != NULL && len > 0)
+		{
+			if (compress)
+			{
+				blockFile.write(data, len, meta);
+			}
+			else
+			{
+				fwrite(data, 1, len, file);
+			}
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,132 @@
+/*
+	Locks and events used by the Pin-independent core of Corelan_HeapLog (HeapCore.h)
+
+	The pintool defines HEAPLOG_PIN after including pin.H, and these wrap PIN_LOCK and
+	PIN_SEMAPHORE. Without it they are built on the C++11 thread library, so the core can
+	be used and measured outside of Pin (see heapcore_bench.cpp).
+
+	Same license as Corelan_HeapLog.cpp
+*/
+
+#ifndef HEAPPLATFORM_H
+#define HEAPPLATFORM_H
+
+#if !defined(HEAPLOG_PIN)
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#endif
+
+
+#if defined(HEAPLOG_PIN)
+
+class CPlatformLock
+{
+public:
+	CPlatformLock()
+	{
+		PIN_InitLock(&pinlock);
+	}
+
+	void lock()
+	{
+		PIN_GetLock(&pinlock, PIN_ThreadId() + 1);
+	}
+
+	void unlock()
+	{
+		PIN_ReleaseLock(&pinlock);
+	}
+
+private:
+	PIN_LOCK pinlock;
+};
+
+
+// stays set until it is cleared, like PIN_SEMAPHORE
+class CPlatformEvent
+{
+public:
+	CPlatformEvent()
+	{
+		PIN_SemaphoreInit(&semaphore);
+	}
+
+	void set()
+	{
+		PIN_SemaphoreSet(&semaphore);
+	}
+
+	void clear()
+	{
+		PIN_SemaphoreClear(&semaphore);
+	}
+
+	// true if the event is set, false if ms went by first
+	bool timedWait(UINT32 ms)
+	{
+		return PIN_SemaphoreTimedWait(&semaphore, ms) ? true : false;
+	}
+
+private:
+	PIN_SEMAPHORE semaphore;
+};
+
+#else
+
+class CPlatformLock
+{
+public:
+	void lock()
+	{
+		mutex.lock();
+	}
+
+	void unlock()
+	{
+		mutex.unlock();
+	}
+
+private:
+	std::mutex mutex;
+};
+
+
+// stays set until it is cleared, like PIN_SEMAPHORE
+class CPlatformEvent
+{
+public:
+	CPlatformEvent()
+	{
+		isset = false;
+	}
+
+	void set()
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		isset = true;
+		condition.notify_all();
+	}
+
+	void clear()
+	{
+		std::lock_guard<std::mutex> guard(mutex);
+		isset = false;
+	}
+
+	// true if the event is set, false if ms went by first
+	bool timedWait(UINT32 ms)
+	{
+		std::unique_lock<std::mutex> guard(mutex);
+		return condition.wait_for(guard, std::chrono::milliseconds(ms), [this] { return isset; });
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool isset;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,209 @@
+/*
+	Multithreaded allocation stress program, used as a target to measure the
+	overhead of Corelan_HeapLog on Linux (see bench_alloc_stress.py)
+
+	Every thread runs the same deterministic mix of malloc, calloc, realloc,
+	posix_memalign, mmap, free and munmap calls on its own table of slots, so
+	runs are reproducible and can be compared with and without the pintool.
+
+	usage: alloc_stress [threads] [operations per thread] [slots per thread] [max size]
+
+	Same license as Corelan_HeapLog.cpp
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <vector>
+
+
+struct SLOT
+{
+	void * ptr;
+	size_t size;
+	bool mapped;
+};
+
+struct THREAD_ARGS
+{
+	unsigned int index;
+	unsigned long operations;
+	unsigned int slots;
+	size_t maxsize;
+	unsigned long events;		// calls the pintool is expected to log
+	unsigned long checksum;		// keeps the compiler from optimizing the writes away
+};
+
+pthread_barrier_t startBarrier;
+
+
+static inline uint32_t nextRandom(uint32_t& state)
+{
+	// xorshift32
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+
+static void releaseSlot(SLOT& slot, unsigned long& events)
+{
+	if (slot.ptr == NULL)
+	{
+		return;
+	}
+	if (slot.mapped)
+	{
+		munmap(slot.ptr, slot.size);
+	}
+	else
+	{
+		free(slot.ptr);
+	}
+	slot.ptr = NULL;
+	events++;
+}
+
+
+static void* stressThread(void* param)
+{
+	THREAD_ARGS* args = (THREAD_ARGS*) param;
+	std::vector<SLOT> slots(args->slots);
+	memset(&slots[0], 0, sizeof(SLOT) * slots.size());
+	uint32_t random = 0x9e3779b9u * (args->index + 1);
+	unsigned long events = 0;
+	unsigned long checksum = 0;
+
+	pthread_barrier_wait(&startBarrier);
+
+	for (unsigned long i = 0; i < args->operations; i++)
+	{
+		SLOT& slot = slots[nextRandom(random) % args->slots];
+		uint32_t choice = nextRandom(random) % 100;
+		size_t size = 1 + nextRandom(random) % args->maxsize;
+
+		if (slot.ptr != NULL && choice < 45)
+		{
+			releaseSlot(slot, events);
+			continue;
+		}
+		if (slot.ptr != NULL && choice < 55 && !slot.mapped)
+		{
+			void* newptr = realloc(slot.ptr, size);
+			events++;
+			if (newptr != NULL)
+			{
+				slot.ptr = newptr;
+				slot.size = size;
+				((char*) newptr)[0] = (char) i;
+			}
+			continue;
+		}
+
+		releaseSlot(slot, events);
+		slot.mapped = false;
+		if (choice < 70)
+		{
+			slot.ptr = malloc(size);
+		}
+		else if (choice < 85)
+		{
+			slot.ptr = calloc(1, size);
+		}
+		else if (choice < 95)
+		{
+			if (posix_memalign(&slot.ptr, 64, size) != 0)
+			{
+				slot.ptr = NULL;
+			}
+		}
+		else
+		{
+			// big enough to be a mapping of its own
+			size = 0x10000 + size;
+			slot.ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			slot.mapped = true;
+			if (slot.ptr == MAP_FAILED)
+			{
+				slot.ptr = NULL;
+			}
+		}
+		events++;
+		if (slot.ptr != NULL)
+		{
+			slot.size = size;
+			((char*) slot.ptr)[size - 1] = (char) i;
+			checksum += ((unsigned char*) slot.ptr)[0];
+		}
+	}
+
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+		releaseSlot(slots[i], events);
+	}
+
+	args->events = events;
+	args->checksum = checksum;
+	return NULL;
+}
+
+
+int main(int argc, char* argv[])
+{
+	unsigned int nrthreads = argc > 1 ? strtoul(argv[1], NULL, 0) : 4;
+	unsigned long operations = argc > 2 ? strtoul(argv[2], NULL, 0) : 1000000;
+	unsigned int nrslots = argc > 3 ? strtoul(argv[3], NULL, 0) : 1024;
+	size_t maxsize = argc > 4 ? strtoul(argv[4], NULL, 0) : 4096;
+
+	if (nrthreads == 0 || nrslots == 0 || maxsize == 0)
+	{
+		fprintf(stderr, "usage: %s [threads] [operations per thread] [slots per thread] [max size]\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<pthread_t> threads(nrthreads);
+	std::vector<THREAD_ARGS> args(nrthreads);
+	pthread_barrier_init(&startBarrier, NULL, nrthreads + 1);
+
+	for (unsigned int t = 0; t < nrthreads; t++)
+	{
+		args[t].index = t;
+		args[t].operations = operations;
+		args[t].slots = nrslots;
+		args[t].maxsize = maxsize;
+		args[t].events = 0;
+		args[t].checksum = 0;
+		if (pthread_create(&threads[t], NULL, stressThread, &args[t]) != 0)
+		{
+			fprintf(stderr, "Unable to create thread %u\n", t);
+			return 1;
+		}
+	}
+
+	struct timespec start, end;
+	pthread_barrier_wait(&startBarrier);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	unsigned long events = 0;
+	unsigned long checksum = 0;
+	for (unsigned int t = 0; t < nrthreads; t++)
+	{
+		pthread_join(threads[t], NULL);
+		events += args[t].events;
+		checksum += args[t].checksum;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_barrier_destroy(&startBarrier);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	// one line, parsed by bench_alloc_stress.py
+	printf("threads=%u events=%lu seconds=%.6f events_per_sec=%.0f checksum=%lu\n",
+		nrthreads, events, seconds, seconds > 0 ? events / seconds : 0.0, checksum);
+	return 0;
+}
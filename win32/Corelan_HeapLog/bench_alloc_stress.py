@@ -0,0 +1,91 @@
+#
+# Measure the overhead of Corelan_HeapLog on Linux
+#
+# Runs alloc_stress natively and under pin with the pintool, and reports
+# heap events per second and the slowdown versus the native run.
+# Build the pintool and alloc_stress first (make), then run from this folder:
+#
+#   python bench_alloc_stress.py --pin /path/to/pin [options] [-- extra pintool options]
+#
+# With --hookmodes insert,replace every hook mode is run on the same workload,
+# one line per mode.
+#
+# Every configuration is run a few times, the median wall clock time is used.
+
+import os, sys, subprocess, time, argparse
+
+
+def parse_result(output):
+	# alloc_stress prints a single line of key=value pairs
+	for line in output.splitlines():
+		if line.startswith("threads="):
+			return dict(field.split("=", 1) for field in line.split())
+	return None
+
+
+def run_once(cmdline, workdir):
+	start = time.time()
+	proc = subprocess.Popen(cmdline, stdout=subprocess.PIPE, stderr=subprocess.PIPE, cwd=workdir)
+	out, err = proc.communicate()
+	elapsed = time.time() - start
+	if proc.returncode != 0:
+		sys.stderr.write(err.decode("latin-1"))
+		raise RuntimeError("%s failed with exit code %d" % (" ".join(cmdline), proc.returncode))
+	result = parse_result(out.decode("latin-1"))
+	if result is None:
+		raise RuntimeError("no result line in the output of %s" % " ".join(cmdline))
+	return elapsed, result
+
+
+def run_median(cmdline, workdir, repeat):
+	runs = sorted([run_once(cmdline, workdir) for i in range(repeat)], key=lambda run: run[0])
+	return runs[len(runs) // 2]
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Report events/sec and slowdown of Corelan_HeapLog versus native")
+	parser.add_argument("--pin", default=os.path.join(os.environ.get("PIN_ROOT", ""), "pin"), help="pin launcher (default $PIN_ROOT/pin)")
+	parser.add_argument("--objdir", default="obj-intel64", help="folder with the pintool and alloc_stress builds")
+	parser.add_argument("--threads", default="1,2,4,8", help="comma separated thread counts")
+	parser.add_argument("--operations", type=int, default=200000, help="operations per thread")
+	parser.add_argument("--slots", type=int, default=1024, help="live chunk slots per thread")
+	parser.add_argument("--maxsize", type=int, default=4096, help="maximum allocation size")
+	parser.add_argument("--repeat", type=int, default=3, help="runs per configuration")
+	parser.add_argument("--hookmodes", default="", help="comma separated -hookmode values to compare (insert,replace)")
+	parser.add_argument("tooloptions", nargs="*", help="extra pintool options, after --")
+	args = parser.parse_args()
+
+	objdir = os.path.abspath(args.objdir)
+	pin = os.path.abspath(args.pin)
+	stress = os.path.join(objdir, "alloc_stress")
+	tool = os.path.join(objdir, "Corelan_HeapLog.so")
+	for needed in (stress, tool, pin):
+		if not os.path.exists(needed):
+			print("[-] %s not found" % needed)
+			return 1
+
+	# log files end up in a scratch folder, not next to the sources
+	workdir = os.path.join(objdir, "bench")
+	if not os.path.isdir(workdir):
+		os.makedirs(workdir)
+
+	print("[+] Pintool options: %s" % (" ".join(args.tooloptions) or "(defaults)"))
+	modes = [mode for mode in args.hookmodes.split(",") if mode] or [None]
+	print("%8s %8s %12s %12s %14s %12s %14s %9s" % ("threads", "hooks", "events", "native s", "native ev/s", "pin s", "pin ev/s", "slowdown"))
+	for threads in [int(t) for t in args.threads.split(",")]:
+		stressargs = [str(threads), str(args.operations), str(args.slots), str(args.maxsize)]
+		native_time, native = run_median([stress] + stressargs, workdir, args.repeat)
+		for mode in modes:
+			modeoptions = ["-hookmode", mode] if mode else []
+			pin_time, pinned = run_median([pin, "-t", tool] + modeoptions + args.tooloptions + ["--", stress] + stressargs, workdir, args.repeat)
+			events = int(pinned["events"])
+			# wall clock of the whole process, so pin startup and the log flush at exit are included
+			print("%8d %8s %12d %12.3f %14.0f %12.3f %14.0f %8.1fx" % (threads, mode or "-", events,
+				native_time, int(native["events"]) / native_time,
+				pin_time, events / pin_time,
+				pin_time / native_time))
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
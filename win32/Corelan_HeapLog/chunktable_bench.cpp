@@ -0,0 +1,201 @@
+/*
+	Microbenchmark of the chunk table in ChunkTable.h against the two std::maps
+	(chunksizes and mapFree, behind one lock) that Corelan_HeapLog used before
+
+	Every thread replays the same kind of work the pintool does per heap
+	operation: record an allocation, or look up the size of a freed chunk and
+	check it for a double free. Addresses come from a per thread pool of slots,
+	like a real heap that keeps reusing chunks.
+
+	usage: chunktable_bench [max threads] [operations per thread] [slots per thread]
+
+	Same license as Corelan_HeapLog.cpp
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <map>
+#include <vector>
+
+typedef uintptr_t ADDRINT;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+#define CHUNKTABLE_YIELD() sched_yield()
+
+#include "ChunkTable.h"
+
+
+// what the pintool did before: two trees and a single lock
+class CMapTable
+{
+public:
+	CMapTable()
+	{
+		pthread_mutex_init(&mutex, NULL);
+	}
+
+	void allocated(ADDRINT start, UINT32 size)
+	{
+		pthread_mutex_lock(&mutex);
+		mapFree.erase(start);
+		chunksizes[start] = size;
+		pthread_mutex_unlock(&mutex);
+	}
+
+	bool freed(ADDRINT start, UINT32& size)
+	{
+		pthread_mutex_lock(&mutex);
+		std::map<ADDRINT, UINT32>::iterator it = chunksizes.find(start);
+		size = (it != chunksizes.end()) ? it->second : 0;
+		if (it != chunksizes.end())
+		{
+			chunksizes.erase(it);
+		}
+		bool doublefree = mapFree.find(start) != mapFree.end();
+		if (!doublefree)
+		{
+			mapFree[start] = start;
+		}
+		pthread_mutex_unlock(&mutex);
+		return doublefree;
+	}
+
+private:
+	std::map<ADDRINT, UINT32> chunksizes;
+	std::map<ADDRINT, ADDRINT> mapFree;
+	pthread_mutex_t mutex;
+};
+
+
+class CShardedTable
+{
+public:
+	void allocated(ADDRINT start, UINT32 size)
+	{
+		table.allocated(start, size, 0);
+	}
+
+	bool freed(ADDRINT start, UINT32& size)
+	{
+		return table.freed(start, size, true) == CHUNK_FREED;
+	}
+
+private:
+	CChunkTable table;
+};
+
+
+struct THREAD_ARGS
+{
+	void* table;
+	unsigned int index;
+	unsigned long operations;
+	unsigned int slots;
+	unsigned long checksum;
+};
+
+pthread_barrier_t startBarrier;
+
+
+template <class TABLE>
+void* benchThread(void* param)
+{
+	THREAD_ARGS* args = (THREAD_ARGS*) param;
+	TABLE* table = (TABLE*) args->table;
+	// every thread gets its own address range, 16 byte aligned chunks like a real heap
+	ADDRINT base = 0x10000000 + (ADDRINT) args->index * 0x1000000;
+	std::vector<bool> live(args->slots, false);
+	uint32_t random = 0x9e3779b9u * (args->index + 1);
+	unsigned long checksum = 0;
+
+	pthread_barrier_wait(&startBarrier);
+	for (unsigned long i = 0; i < args->operations; i++)
+	{
+		random ^= random << 13;
+		random ^= random >> 17;
+		random ^= random << 5;
+		unsigned int slot = random % args->slots;
+		ADDRINT chunk = base + (ADDRINT) slot * 16;
+		if (live[slot])
+		{
+			UINT32 size;
+			checksum += table->freed(chunk, size) ? 1 : size;
+		}
+		else
+		{
+			table->allocated(chunk, random & 0xfff);
+		}
+		live[slot] = !live[slot];
+	}
+	args->checksum = checksum;
+	return NULL;
+}
+
+
+template <class TABLE>
+double runBench(unsigned int nrthreads, unsigned long operations, unsigned int slots, unsigned long& checksum)
+{
+	TABLE table;
+	std::vector<pthread_t> threads(nrthreads);
+	std::vector<THREAD_ARGS> args(nrthreads);
+	pthread_barrier_init(&startBarrier, NULL, nrthreads + 1);
+	for (unsigned int t = 0; t < nrthreads; t++)
+	{
+		args[t].table = &table;
+		args[t].index = t;
+		args[t].operations = operations;
+		args[t].slots = slots;
+		args[t].checksum = 0;
+		pthread_create(&threads[t], NULL, benchThread<TABLE>, &args[t]);
+	}
+
+	struct timespec start, end;
+	pthread_barrier_wait(&startBarrier);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	checksum = 0;
+	for (unsigned int t = 0; t < nrthreads; t++)
+	{
+		pthread_join(threads[t], NULL);
+		checksum += args[t].checksum;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_barrier_destroy(&startBarrier);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	// ns per operation, as seen by one thread
+	return seconds * 1e9 / operations;
+}
+
+
+int main(int argc, char* argv[])
+{
+	unsigned int maxthreads = argc > 1 ? strtoul(argv[1], NULL, 0) : 8;
+	unsigned long operations = argc > 2 ? strtoul(argv[2], NULL, 0) : 2000000;
+	unsigned int slots = argc > 3 ? strtoul(argv[3], NULL, 0) : 65536;
+
+	if (maxthreads == 0 || slots == 0)
+	{
+		fprintf(stderr, "usage: %s [max threads] [operations per thread] [slots per thread]\n", argv[0]);
+		return 1;
+	}
+
+	printf("%8s %16s %16s %16s %16s\n", "threads", "maps ns/op", "maps Mops/s", "table ns/op", "table Mops/s");
+	for (unsigned int nrthreads = 1; nrthreads <= maxthreads; nrthreads *= 2)
+	{
+		unsigned long mapchecksum, tablechecksum;
+		double mapns = runBench<CMapTable>(nrthreads, operations, slots, mapchecksum);
+		double tablens = runBench<CShardedTable>(nrthreads, operations, slots, tablechecksum);
+		if (mapchecksum != tablechecksum)
+		{
+			fprintf(stderr, "checksum mismatch: %lu vs %lu\n", mapchecksum, tablechecksum);
+			return 1;
+		}
+		printf("%8u %16.1f %16.2f %16.1f %16.2f\n", nrthreads,
+			mapns, nrthreads * 1e3 / mapns, tablens, nrthreads * 1e3 / tablens);
+	}
+	return 0;
+}
@@ -0,0 +1,514 @@
+/*
+	Benchmark of the Pin-independent core of Corelan_HeapLog (HeapCore.h) on Linux
+
+	Three measurements, for 1, 2, 4 ... max threads:
+	- ingestion: every thread does what the analysis routines do per heap operation (update
+	  the chunk table, queue the event in its own ring) while a drain thread does what the
+	  pintool's drain does (merge the rings in clock order, update the chunk history, format
+	  the log line). The log writer thread writes everything to a file. Shows the cost per
+	  event seen by an application thread, and the end to end rate until the log is closed
+	- lookup: threads look up random addresses in the chunk history, under one lock like
+	  the pintool's drainLock, and in the chunk table. ns per lookup, seen by one thread
+	- output: threads format log lines into their own text block and write them through one
+	  log writer, plain and compressed. ns per line seen by one thread, and MB/s of log text
+
+	The log goes to a temporary file, which is removed afterwards.
+
+	usage: heapcore_bench [max threads] [events per thread]
+
+	Same license as Corelan_HeapLog.cpp
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+typedef uintptr_t ADDRINT;
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int32_t INT32;
+typedef int64_t INT64;
+#define CHUNKTABLE_YIELD() sched_yield()
+
+#include "HeapCore.h"
+
+#define MAX_BENCH_THREADS 256
+#define DRAIN_INTERVAL 10			// ms between two drain passes, as in the pintool
+#define SLOTS_PER_THREAD 65536		// chunks each thread keeps reusing
+#define BUFFER_SIZE (1024 * 1024)	// log writer buffers, -buffersize default
+#define FLUSH_INTERVAL 1000			// ms, -flushinterval default
+#define BLOCK_SIZE (256 * 1024)		// compressed blocks, -blocksize default
+
+
+// ns since some point in the past, the same for all threads
+UINT64 readClock()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (UINT64) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+UINT32 nextRandom(UINT32& random)
+{
+	random ^= random << 13;
+	random ^= random >> 17;
+	random ^= random << 5;
+	return random;
+}
+
+// what the analysis routines capture for an allocation or a free of chunk
+HEAP_EVENT makeEvent(UINT32 thread, ADDRINT chunk, UINT32 size, bool isfree)
+{
+	HEAP_EVENT ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.threadid = thread;
+	ev.chunk_start = chunk;
+	ev.chunk_size = size;
+	ev.saved_return_pointer = 0x400000 + (chunk & 0xfff0);
+	ev.operation = isfree ? OP_RTLFREEHEAP : OP_RTLALLOCATEHEAP;
+	return ev;
+}
+
+// every thread gets its own address range, 16 byte aligned chunks like a real heap
+ADDRINT chunkAddress(UINT32 thread, UINT32 slot)
+{
+	return 0x10000000 + (ADDRINT) thread * 0x1000000 + (ADDRINT) slot * 16;
+}
+
+
+CLogWriter* logWriter;
+
+void writeToLog(const char * data, size_t len, const BLOCK_META* meta)
+{
+	logWriter->write(data, len, meta);
+}
+
+void* writerThread(void*)
+{
+	logWriter->run();
+	return NULL;
+}
+
+// a log writer on a temporary file, with its writer thread
+class CBenchLog
+{
+public:
+	CBenchLog(UINT32 blocksize)
+	{
+		char name[] = "/tmp/heapcore_bench_XXXXXX";
+		int fd = mkstemp(name);
+		file = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+		if (file == NULL)
+		{
+			fprintf(stderr, "Unable to create a temporary log file\n");
+			exit(1);
+		}
+		unlink(name);
+		logWriter = &writer;
+		writer.init(file, BUFFER_SIZE, FLUSH_INTERVAL, blocksize);
+		pthread_create(&thread, NULL, writerThread, NULL);
+	}
+
+	// stop the writer thread and write the rest, returns the size of the log
+	UINT64 close()
+	{
+		writer.stop();
+		pthread_join(thread, NULL);
+		writer.close();
+		fseeko(file, 0, SEEK_END);
+		UINT64 size = (UINT64) ftello(file);
+		fclose(file);
+		return size;
+	}
+
+private:
+	CLogWriter writer;
+	FILE* file;
+	pthread_t thread;
+};
+
+
+double secondsSince(UINT64 start)
+{
+	return (readClock() - start) / 1e9;
+}
+
+
+/* ================================================================== */
+// Ingestion
+/* ================================================================== */
+
+struct INGEST_THREAD
+{
+	UINT32 index;
+	UINT64 events;
+	CEventRing* ring;
+	double nsperevent;
+};
+
+CChunkTable* benchTable;
+CChunkIndex* benchIndex;
+CTextBlock* benchText;
+CPlatformLock drainLock;
+CPlatformEvent drainEvent;
+std::vector<INGEST_THREAD> ingestThreads;
+std::vector<RING_ENTRY> drainBatch;
+volatile bool producersDone;
+pthread_barrier_t startBarrier;
+
+bool compareClock(const RING_ENTRY& a, const RING_ENTRY& b)
+{
+	return a.clock < b.clock;
+}
+
+// one drain pass, as in the pintool. Returns the number of events drained
+size_t drainEvents()
+{
+	drainLock.lock();
+	UINT64 until = readClock();
+	drainBatch.clear();
+	for (size_t i = 0; i < ingestThreads.size(); i++)
+	{
+		ingestThreads[i].ring->take(until, drainBatch);
+	}
+	std::stable_sort(drainBatch.begin(), drainBatch.end(), compareClock);
+	for (size_t i = 0; i < drainBatch.size(); i++)
+	{
+		const HEAP_EVENT& ev = drainBatch[i].ev;
+		benchIndex->add(ev);
+		if ((ev.flags & EV_DOUBLE_FREE) != 0)
+		{
+			formatDoubleFree(*benchText, ev, 1234, "bench.so");
+		}
+		formatHeapEvent(*benchText, ev, 1234, "", &drainBatch[i].clock, "bench.so");
+	}
+	benchText->flush();
+	size_t drained = drainBatch.size();
+	drainLock.unlock();
+	return drained;
+}
+
+void* drainThread(void*)
+{
+	while (!producersDone)
+	{
+		drainEvent.timedWait(DRAIN_INTERVAL);
+		drainEvent.clear();
+		drainEvents();
+	}
+	while (drainEvents() > 0)
+	{
+	}
+	return NULL;
+}
+
+void* ingestThread(void* param)
+{
+	INGEST_THREAD* args = (INGEST_THREAD*) param;
+	std::vector<bool> live(SLOTS_PER_THREAD, false);
+	UINT32 random = 0x9e3779b9u * (args->index + 1);
+
+	pthread_barrier_wait(&startBarrier);
+	UINT64 start = readClock();
+	for (UINT64 i = 0; i < args->events; i++)
+	{
+		UINT32 slot = nextRandom(random) % SLOTS_PER_THREAD;
+		ADDRINT chunk = chunkAddress(args->index, slot);
+		UINT32 size = random & 0xfff;
+		HEAP_EVENT ev;
+		if (live[slot])
+		{
+			ev = makeEvent(args->index, chunk, 0, true);
+			UINT32 state = benchTable->freed(chunk, size, true);
+			ev.chunk_size = size;
+			if (state == CHUNK_FREED)
+			{
+				ev.flags |= EV_DOUBLE_FREE;
+			}
+		}
+		else
+		{
+			ev = makeEvent(args->index, chunk, size, false);
+			benchTable->allocated(chunk, size, 0);
+		}
+		live[slot] = !live[slot];
+
+		UINT64 clock = readClock();
+		while (!args->ring->push(clock, ev))
+		{
+			// ring is full, wait for the drain thread like the pintool does
+			drainEvent.set();
+			sched_yield();
+		}
+		if (args->ring->used() == RING_WAKE)
+		{
+			drainEvent.set();
+		}
+	}
+	args->nsperevent = secondsSince(start) * 1e9 / args->events;
+	return NULL;
+}
+
+void benchIngestion(UINT32 nrthreads, UINT64 events)
+{
+	CChunkTable table;
+	CChunkIndex index(&table);
+	index.setBudget(64);
+	CTextBlock text(writeToLog);
+	benchTable = &table;
+	benchIndex = &index;
+	benchText = &text;
+	CBenchLog log(0);
+
+	ingestThreads.resize(nrthreads);
+	std::vector<pthread_t> threads(nrthreads);
+	pthread_barrier_init(&startBarrier, NULL, nrthreads + 1);
+	producersDone = false;
+	for (UINT32 t = 0; t < nrthreads; t++)
+	{
+		ingestThreads[t].index = t;
+		ingestThreads[t].events = events;
+		ingestThreads[t].ring = new CEventRing();
+		pthread_create(&threads[t], NULL, ingestThread, &ingestThreads[t]);
+	}
+	pthread_t drain;
+	pthread_create(&drain, NULL, drainThread, NULL);
+
+	pthread_barrier_wait(&startBarrier);
+	UINT64 start = readClock();
+	double producerns = 0;
+	for (UINT32 t = 0; t < nrthreads; t++)
+	{
+		pthread_join(threads[t], NULL);
+		producerns += ingestThreads[t].nsperevent;
+	}
+	producersDone = true;
+	drainEvent.set();
+	pthread_join(drain, NULL);
+	UINT64 logsize = log.close();
+	double seconds = secondsSince(start);
+	pthread_barrier_destroy(&startBarrier);
+
+	for (UINT32 t = 0; t < nrthreads; t++)
+	{
+		delete ingestThreads[t].ring;
+	}
+	ingestThreads.clear();
+	UINT64 kept, evicteddead, evictedlive;
+	index.getStats(kept, evicteddead, evictedlive);
+	printf("%8u %16.1f %16.2f %16.1f %12llu\n", nrthreads, producerns / nrthreads,
+		nrthreads * events / seconds / 1e6, seconds * 1e9 / (nrthreads * events),
+		(unsigned long long) (logsize / (1024 * 1024)));
+}
+
+
+/* ================================================================== */
+// Lookup
+/* ================================================================== */
+
+struct LOOKUP_THREAD
+{
+	UINT32 index;
+	UINT32 nrranges;			// address ranges in the index, see fillIndex
+	UINT64 lookups;
+	double indexns;
+	double tablens;
+	UINT64 found;				// operations found in the chunk history
+	UINT64 known;				// chunks found in the chunk table
+};
+
+void* lookupThread(void* param)
+{
+	LOOKUP_THREAD* args = (LOOKUP_THREAD*) param;
+	UINT32 random = 0x85ebca6bu * (args->index + 1);
+	args->found = 0;
+	args->known = 0;
+
+	pthread_barrier_wait(&startBarrier);
+	UINT64 start = readClock();
+	for (UINT64 i = 0; i < args->lookups; i++)
+	{
+		UINT32 slot = nextRandom(random) % SLOTS_PER_THREAD;
+		// somewhere inside a chunk, not just at its start
+		ADDRINT address = chunkAddress(random % args->nrranges, slot) + (random >> 28);
+		drainLock.lock();
+		args->found += benchIndex->find(address).size();
+		drainLock.unlock();
+	}
+	args->indexns = secondsSince(start) * 1e9 / args->lookups;
+
+	start = readClock();
+	for (UINT64 i = 0; i < args->lookups; i++)
+	{
+		UINT32 slot = nextRandom(random) % SLOTS_PER_THREAD;
+		UINT32 size;
+		args->known += benchTable->lookup(chunkAddress(random % args->nrranges, slot), size) != CHUNK_UNKNOWN;
+	}
+	args->tablens = secondsSince(start) * 1e9 / args->lookups;
+	return NULL;
+}
+
+// every chunk of nrranges threads allocated once, a quarter of them freed again
+void fillIndex(CChunkTable& table, CChunkIndex& index, UINT32 nrranges)
+{
+	UINT32 random = 1;
+	for (UINT32 thread = 0; thread < nrranges; thread++)
+	{
+		for (UINT32 slot = 0; slot < SLOTS_PER_THREAD; slot++)
+		{
+			ADDRINT chunk = chunkAddress(thread, slot);
+			UINT32 size = 16 + nextRandom(random) % 0x100;
+			index.add(makeEvent(thread, chunk, size, false));
+			table.allocated(chunk, size, 0);
+			if ((random & 3) == 0)
+			{
+				index.add(makeEvent(thread, chunk, size, true));
+				table.freed(chunk, size, true);
+			}
+		}
+	}
+}
+
+void benchLookup(UINT32 nrthreads, UINT64 lookups, CChunkTable& table, CChunkIndex& index, UINT32 nrranges)
+{
+	benchTable = &table;
+	benchIndex = &index;
+	std::vector<LOOKUP_THREAD> args(nrthreads);
+	std::vector<pthread_t> threads(nrthreads);
+	pthread_barrier_init(&startBarrier, NULL, nrthreads + 1);
+	for (UINT32 t = 0; t < nrthreads; t++)
+	{
+		args[t].index = t;
+		args[t].nrranges = nrranges;
+		args[t].lookups = lookups;
+		pthread_create(&threads[t], NULL, lookupThread, &args[t]);
+	}
+	pthread_barrier_wait(&startBarrier);
+	double indexns = 0;
+	double tablens = 0;
+	UINT64 found = 0;
+	UINT64 known = 0;
+	for (UINT32 t = 0; t < nrthreads; t++)
+	{
+		pthread_join(threads[t], NULL);
+		indexns += args[t].indexns;
+		tablens += args[t].tablens;
+		found += args[t].found;
+		known += args[t].known;
+	}
+	pthread_barrier_destroy(&startBarrier);
+	printf("%8u %16.1f %16.1f %16.2f %16.2f\n", nrthreads, indexns / nrthreads, tablens / nrthreads,
+		(double) found / (nrthreads * lookups), (double) known / (nrthreads * lookups));
+}
+
+
+/* ================================================================== */
+// Output
+/* ================================================================== */
+
+struct OUTPUT_THREAD
+{
+	UINT32 index;
+	UINT64 lines;
+	double nsperline;
+};
+
+void* outputThread(void* param)
+{
+	OUTPUT_THREAD* args = (OUTPUT_THREAD*) param;
+	// heap allocated, a text block is too big for a thread stack
+	CTextBlock* text = new CTextBlock(writeToLog);
+	UINT32 random = 0xc2b2ae35u * (args->index + 1);
+
+	pthread_barrier_wait(&startBarrier);
+	UINT64 start = readClock();
+	for (UINT64 i = 0; i < args->lines; i++)
+	{
+		UINT32 slot = nextRandom(random) % SLOTS_PER_THREAD;
+		HEAP_EVENT ev = makeEvent(args->index, chunkAddress(args->index, slot), random & 0xfff, (random & 1) != 0);
+		UINT64 clock = start + i;
+		text->note(clock / 1000, ev.chunk_start, ev.chunk_end());
+		formatHeapEvent(*text, ev, 1234, "", &clock, "bench.so");
+	}
+	text->flush();
+	args->nsperline = secondsSince(start) * 1e9 / args->lines;
+	delete text;
+	return NULL;
+}
+
+void benchOutput(UINT32 nrthreads, UINT64 lines, UINT32 blocksize)
+{
+	CBenchLog log(blocksize);
+	std::vector<OUTPUT_THREAD> args(nrthreads);
+	std::vector<pthread_t> threads(nrthreads);
+	pthread_barrier_init(&startBarrier, NULL, nrthreads + 1);
+	for (UINT32 t = 0; t < nrthreads; t++)
+	{
+		args[t].index = t;
+		args[t].lines = lines;
+		pthread_create(&threads[t], NULL, outputThread, &args[t]);
+	}
+	pthread_barrier_wait(&startBarrier);
+	UINT64 start = readClock();
+	double ns = 0;
+	for (UINT32 t = 0; t < nrthreads; t++)
+	{
+		pthread_join(threads[t], NULL);
+		ns += args[t].nsperline;
+	}
+	UINT64 logsize = log.close();
+	double seconds = secondsSince(start);
+	pthread_barrier_destroy(&startBarrier);
+	printf("%8u %-12s %16.1f %16.2f %16.1f\n", nrthreads, blocksize > 0 ? "compressed" : "plain",
+		ns / nrthreads, nrthreads * lines / seconds / 1e6, logsize / seconds / (1024 * 1024));
+}
+
+
+int main(int argc, char* argv[])
+{
+	UINT32 maxthreads = argc > 1 ? strtoul(argv[1], NULL, 0) : 8;
+	UINT64 events = argc > 2 ? strtoull(argv[2], NULL, 0) : 1000000;
+
+	if (maxthreads == 0 || maxthreads > MAX_BENCH_THREADS || events == 0)
+	{
+		fprintf(stderr, "usage: %s [max threads (1-%u)] [events per thread]\n", argv[0], MAX_BENCH_THREADS);
+		return 1;
+	}
+
+	printf("Ingestion: analysis routine work per event, drain, history, formatting and log writer\n");
+	printf("%8s %16s %16s %16s %12s\n", "threads", "thread ns/event", "total Mevents/s", "total ns/event", "log MB");
+	for (UINT32 nrthreads = 1; nrthreads <= maxthreads; nrthreads *= 2)
+	{
+		benchIngestion(nrthreads, events);
+	}
+
+	printf("\nLookup: chunk history (under one lock) and chunk table, %u chunks\n", 4 * SLOTS_PER_THREAD);
+	printf("%8s %16s %16s %16s %16s\n", "threads", "history ns", "table ns", "history ops", "table hits");
+	{
+		CChunkTable table;
+		CChunkIndex index(&table);
+		fillIndex(table, index, 4);
+		for (UINT32 nrthreads = 1; nrthreads <= maxthreads; nrthreads *= 2)
+		{
+			// history lookups take a hundred times longer than chunk table lookups, keep the count down
+			benchLookup(nrthreads, events / 100 + 1, table, index, 4);
+		}
+	}
+
+	printf("\nOutput: formatting and writing log lines\n");
+	printf("%8s %-12s %16s %16s %16s\n", "threads", "log", "thread ns/line", "total Mlines/s", "file MB/s");
+	for (UINT32 nrthreads = 1; nrthreads <= maxthreads; nrthreads *= 2)
+	{
+		benchOutput(nrthreads, events, 0);
+		benchOutput(nrthreads, events, BLOCK_SIZE);
+	}
+	return 0;
+}
@@ -0,0 +1,115 @@
+/*
+	Sends a command to a process running under Corelan_HeapLog with -control 1, and prints
+	the answer
+
+	The command is written to corelan_heaplog_<pid>.cmd in the directory the log is written
+	to, and the answer comes back in corelan_heaplog_<pid>.reply. The pintool looks for
+	commands every 100 ms, on a thread of its own, so the application keeps running.
+
+	usage: heaplog_ctl [-dir <directory>] <pid> <command> [<argument>]
+	commands:
+		flush					write everything logged so far to the log file
+		stats					number of heap operations, chunks, threads (and heaps, with -heapstats)
+		live [<sites>]			live chunks per allocation site, most bytes first
+		history <address>		operations on the chunks that contain the (hex) address
+		log [on|off]			switch logging of heap operations on or off, or show the setting
+
+	Same license as Corelan_HeapLog.cpp
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define REPLY_TIMEOUT 10000			// ms
+
+
+void sleepMs(unsigned int ms)
+{
+#if defined(_WIN32)
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+
+int main(int argc, char* argv[])
+{
+	std::string directory = ".";
+	int first = 1;
+	if (argc > 2 && strcmp(argv[1], "-dir") == 0)
+	{
+		directory = argv[2];
+		first = 3;
+	}
+	if (argc - first < 2)
+	{
+		fprintf(stderr, "usage: %s [-dir <directory>] <pid> <command> [<argument>]\n", argv[0]);
+		fprintf(stderr, "commands: flush, stats, live [<sites>], history <address>, log [on|off]\n");
+		return 1;
+	}
+	unsigned int pid = (unsigned int) strtoul(argv[first], NULL, 10);
+	const char * command = argv[first + 1];
+	const char * argument = (argc - first > 2) ? argv[first + 2] : "";
+
+	char name[64];
+	snprintf(name, sizeof(name), "/corelan_heaplog_%u", pid);
+	std::string commandFile = directory + name + ".cmd";
+	std::string replyFile = directory + name + ".reply";
+	std::string commandTemp = commandFile + ".tmp";
+
+	// a number of our own, so an old reply is never taken for the answer
+	unsigned int seq = ((unsigned int) time(NULL) ^ ((unsigned int) clock() << 16)) % 1000000000 + 1;
+	remove(replyFile.c_str());
+	FILE* file = fopen(commandTemp.c_str(), "w");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Unable to create %s\n", commandTemp.c_str());
+		return 1;
+	}
+	fprintf(file, "%u %s %s\n", seq, command, argument);
+	fclose(file);
+	remove(commandFile.c_str());
+	if (rename(commandTemp.c_str(), commandFile.c_str()) != 0)
+	{
+		fprintf(stderr, "Unable to create %s\n", commandFile.c_str());
+		return 1;
+	}
+
+	for (unsigned int waited = 0; waited < REPLY_TIMEOUT; waited += 50)
+	{
+		sleepMs(50);
+		FILE* reply = fopen(replyFile.c_str(), "r");
+		if (reply == NULL)
+		{
+			continue;
+		}
+		char line[4096];
+		unsigned int replyseq = 0;
+		if (fgets(line, sizeof(line), reply) == NULL || sscanf(line, "%u", &replyseq) != 1 || replyseq != seq)
+		{
+			// answer to someone else
+			fclose(reply);
+			continue;
+		}
+		size_t len;
+		while ((len = fread(line, 1, sizeof(line), reply)) > 0)
+		{
+			fwrite(line, 1, len, stdout);
+		}
+		fclose(reply);
+		remove(replyFile.c_str());
+		return 0;
+	}
+	remove(commandFile.c_str());
+	fprintf(stderr, "No answer from process %u. Is it running with -control 1, in directory %s?\n", pid, directory.c_str());
+	return 1;
+}
@@ -0,0 +1,266 @@
+/*
+	Merges the logs Corelan_HeapLog writes with -sharedclock 1, one per process, into a
+	single stream in time order
+
+	Every log starts with a "Trace:" line with the PID of the process, and every heap event
+	has the cycle counter value it was captured at, which is the same clock in all processes.
+	Each log is in clock order already (the pintool's drain holds back events stamped after one
+	that is still being queued), so the merge only ever looks at the next line of each log:
+	memory use doesn't depend on the size of the logs. Lines without a clock value
+	(double free reports, call stacks, thread start and stop) stay right after the line they
+	followed in their own log. Lines that don't start with the PID get "PID: <pid> | " in front.
+	Compressed logs (.hlz) are read as well.
+
+	usage: heaplog_merge [-o <output file>] <log> <log> ...
+
+	Same license as Corelan_HeapLog.cpp
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <functional>
+#include <queue>
+#include <string>
+#include <vector>
+
+typedef uint8_t UINT8;
+typedef uint32_t UINT32;
+typedef int64_t INT64;
+typedef uint64_t UINT64;
+
+#include "BlockFile.h"
+
+
+// lines of a plain or a block compressed log
+class CLineSource
+{
+public:
+	CLineSource()
+	{
+		file = NULL;
+		compressed = false;
+		next = 0;
+	}
+
+	~CLineSource()
+	{
+		if (file != NULL)
+		{
+			fclose(file);
+		}
+	}
+
+	bool open(const char * fileName)
+	{
+		file = fopen(fileName, "rb");
+		if (file == NULL)
+		{
+			return false;
+		}
+		compressed = blocks.open(file);
+		if (!compressed)
+		{
+			rewind(file);
+			setvbuf(file, NULL, _IOFBF, 1 << 20);
+		}
+		return true;
+	}
+
+	// next line, without the newline. False at the end of the log
+	bool getLine(std::string& line)
+	{
+		line.clear();
+		if (!compressed)
+		{
+			char buffer[4096];
+			while (fgets(buffer, sizeof(buffer), file) != NULL)
+			{
+				line += buffer;
+				if (line[line.size() - 1] == '\n')
+				{
+					line.resize(line.size() - 1);
+					return true;
+				}
+			}
+			return !line.empty();
+		}
+		for (;;)
+		{
+			if (next == text.size())
+			{
+				next = 0;
+				if (!blocks.next(text))
+				{
+					text.clear();
+					return !line.empty();
+				}
+			}
+			const char * start = &text[0] + next;
+			const char * newline = (const char *) memchr(start, '\n', text.size() - next);
+			if (newline != NULL)
+			{
+				line.append(start, newline - start);
+				next += newline - start + 1;
+				return true;
+			}
+			line.append(start, text.size() - next);
+			next = text.size();
+		}
+	}
+
+private:
+	FILE* file;
+	bool compressed;
+	CBlockFileReader blocks;
+	std::vector<char> text;		// current block of a compressed log
+	size_t next;
+};
+
+
+// one log being merged, with the line that is next in line
+struct MERGE_INPUT
+{
+	CLineSource source;
+	std::string name;
+	UINT32 pid;
+	UINT64 clock;				// of the current line
+	std::string line;
+};
+
+// "Trace: pid <pid>, clock tsc, base 0x<clock>, ..."
+bool parseTraceLine(const std::string& line, UINT32& pid, UINT64& base)
+{
+	unsigned int value;
+	unsigned long long clock;
+	if (sscanf(line.c_str(), "Trace: pid %u, clock tsc, base 0x%llx", &value, &clock) != 2)
+	{
+		return false;
+	}
+	pid = value;
+	base = clock;
+	return true;
+}
+
+// "PID: <pid> | [<time> ]@<clock> | ..."
+bool parseClock(const std::string& line, UINT64& clock)
+{
+	if (line.compare(0, 5, "PID: ") != 0)
+	{
+		return false;
+	}
+	size_t field = line.find(" | ", 5);
+	if (field == std::string::npos)
+	{
+		return false;
+	}
+	size_t fieldend = line.find(" | ", field + 3);
+	size_t at = line.find('@', field + 3);
+	if (fieldend == std::string::npos || at == std::string::npos || at > fieldend)
+	{
+		return false;
+	}
+	clock = strtoull(line.c_str() + at + 1, NULL, 16);
+	return true;
+}
+
+// read the next line of an input, false at its end
+bool advance(MERGE_INPUT& input)
+{
+	if (!input.source.getLine(input.line))
+	{
+		return false;
+	}
+	// lines without a clock of their own keep the one of the line before
+	parseClock(input.line, input.clock);
+	return true;
+}
+
+typedef std::pair<UINT64, size_t> MERGE_KEY;		// clock, input number. Ties go to the earlier input
+
+
+int main(int argc, char* argv[])
+{
+	const char * outputName = NULL;
+	int first = 1;
+	if (argc > 2 && strcmp(argv[1], "-o") == 0)
+	{
+		outputName = argv[2];
+		first = 3;
+	}
+	if (first >= argc)
+	{
+		fprintf(stderr, "usage: %s [-o <output file>] <log> <log> ...\n", argv[0]);
+		return 1;
+	}
+	FILE* output = stdout;
+	if (outputName != NULL && (output = fopen(outputName, "wb")) == NULL)
+	{
+		fprintf(stderr, "Unable to create %s\n", outputName);
+		return 1;
+	}
+	setvbuf(output, NULL, _IOFBF, 1 << 20);
+
+	std::vector<MERGE_INPUT*> inputs;
+	std::priority_queue<MERGE_KEY, std::vector<MERGE_KEY>, std::greater<MERGE_KEY> > heap;
+	for (int i = first; i < argc; i++)
+	{
+		MERGE_INPUT* input = new MERGE_INPUT;
+		input->name = argv[i];
+		input->pid = 0;
+		input->clock = 0;
+		if (!input->source.open(argv[i]))
+		{
+			fprintf(stderr, "Unable to open %s\n", argv[i]);
+			return 1;
+		}
+		if (!input->source.getLine(input->line) || !parseTraceLine(input->line, input->pid, input->clock))
+		{
+			fprintf(stderr, "%s doesn't start with a Trace: line, was it written with -sharedclock 1?\n", argv[i]);
+			return 1;
+		}
+		heap.push(MERGE_KEY(input->clock, inputs.size()));
+		inputs.push_back(input);
+	}
+
+	UINT64 nrlines = 0;
+	while (!heap.empty())
+	{
+		size_t i = heap.top().second;
+		heap.pop();
+		MERGE_INPUT& input = *inputs[i];
+		// everything up to the next line with a later clock goes out in one go
+		for (;;)
+		{
+			if (input.line.compare(0, 5, "PID: ") != 0)
+			{
+				fprintf(output, "PID: %u | ", input.pid);
+			}
+			fwrite(input.line.data(), 1, input.line.size(), output);
+			fputc('\n', output);
+			nrlines++;
+			if (!advance(input))
+			{
+				break;
+			}
+			if (!heap.empty() && heap.top() < MERGE_KEY(input.clock, i))
+			{
+				heap.push(MERGE_KEY(input.clock, i));
+				break;
+			}
+		}
+	}
+	fprintf(stderr, "Merged %llu lines from %u logs\n", (unsigned long long) nrlines, (UINT32) inputs.size());
+	if (output != stdout)
+	{
+		fclose(output);
+	}
+	for (size_t i = 0; i < inputs.size(); i++)
+	{
+		delete inputs[i];
+	}
+	return 0;
+}
@@ -0,0 +1,1355 @@
+/*
+	Indexed queries on Corelan_HeapLog log files (Linux)
+
+	The first query on a log builds a sidecar index, <log>.qidx, which is reused as long as
+	the log doesn't change. The log is memory mapped and split into one part per core, every
+	thread parses its part and sorts what it finds in runs that fit in the -memory budget,
+	which are merged into the index afterwards. So logs larger than RAM work too, the index
+	takes about as much disk space as the log itself.
+
+	The index has every heap event (its file offset, time, chunk, size, PID and module),
+	and sorted tables from chunk start, from chunk start per power of 2 size class, from
+	module and from time to the file offset of the events. Queries are binary searches in
+	those tables, with the matching lines read straight from the mapped log.
+
+	usage: heaplog_query [options] <log> <query>
+	queries:
+		build						(re)build the index
+		info						number of events, time span
+		history <address>			every event on the chunks that ever contained address
+		covering <address>			chunks that contained address at the end of the log, or -at / -attime
+		frees <module>				frees from module (file name, case insensitive)
+		allocs <module>				allocations from module
+		time <from> [<to>]			events in a time range, in seconds since the first event
+	options:
+		-threads <n>				threads for building the index (default: all cores)
+		-memory <MB>				memory for building the index (default 1024)
+		-at <event>					event number for covering
+		-attime <seconds>			time for covering, in seconds since the first event
+		-pid <pid>					only events of this process
+
+	Events are numbered from 0 in the order they appear in the log, every result line starts
+	with the event number. Timestamps are only known if the log was written with -timestamp 1.
+
+	Same license as Corelan_HeapLog.cpp
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef uint8_t UINT8;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+
+
+/* ================================================================== */
+// Index file
+/* ================================================================== */
+
+enum QUERY_OP
+{
+	QOP_ALLOC = 0,
+	QOP_REALLOC,
+	QOP_VIRTUALALLOC,
+	QOP_MMAP,
+	QOP_FREE,
+	QOP_MUNMAP,
+	QOP_DOUBLE_FREE,
+	QOP_USE_AFTER_FREE,
+	QOP_LAST
+};
+
+inline bool isAllocOp(UINT32 op)
+{
+	return op <= QOP_MMAP;
+}
+
+inline bool isFreeOp(UINT32 op)
+{
+	return op == QOP_FREE || op == QOP_MUNMAP || op == QOP_DOUBLE_FREE;
+}
+
+// one heap event line of the log
+struct QUERY_EVENT
+{
+	UINT64 offset;				// of the line in the log
+	UINT64 time;				// microseconds, 0 if the log has no timestamps
+	UINT64 start;				// chunk
+	UINT32 size;				// 0 if unknown
+	UINT32 pid;
+	UINT32 module;				// low bits of the module hash, see hashModule()
+	UINT8 op;					// QUERY_OP
+	UINT8 reserved[3];
+};
+
+static_assert(sizeof(QUERY_EVENT) == 40, "QUERY_EVENT should be 40 bytes");
+
+// entry of a sorted table, the events with the same key are in log order
+struct KEY_ENTRY
+{
+	UINT64 key;
+	UINT64 offset;
+
+	bool operator<(const KEY_ENTRY& other) const
+	{
+		return key < other.key || (key == other.key && offset < other.offset);
+	}
+
+	bool operator>(const KEY_ENTRY& other) const
+	{
+		return other < *this;
+	}
+};
+
+enum KEY_INDEX
+{
+	INDEX_ADDRESS = 0,			// chunk start
+	INDEX_COVERAGE,				// size class << 56 | chunk start, allocations only
+	INDEX_MODULE,				// module hash << 8 | operation
+	INDEX_TIME,					// time, events with a timestamp only
+	NR_INDEXES
+};
+
+#define SIZE_CLASS_SHIFT 56
+
+#define QUERY_INDEX_MAGIC "CHQI"
+#define QUERY_INDEX_VERSION 1
+
+struct QUERY_INDEX_HEADER
+{
+	char magic[4];
+	UINT32 version;
+	UINT64 logsize;				// the index is rebuilt if the log changes
+	UINT64 logmtime;
+	UINT64 firsttime;			// earliest event time
+	UINT64 lasttime;
+	UINT64 nrevents;
+	UINT64 eventsoffset;
+	UINT64 counts[NR_INDEXES];
+	UINT64 offsets[NR_INDEXES];
+};
+
+
+// FNV-1a of the lower case file name, without the path
+UINT64 hashModule(const char * name, const char * end)
+{
+	for (const char * p = name; p < end; p++)
+	{
+		if (*p == '\\' || *p == '/')
+		{
+			name = p + 1;
+		}
+	}
+	UINT64 hash = 0xcbf29ce484222325ULL;
+	for (; name < end; name++)
+	{
+		char c = *name;
+		if (c >= 'A' && c <= 'Z')
+		{
+			c = c - 'A' + 'a';
+		}
+		hash = (hash ^ (UINT8) c) * 0x100000001b3ULL;
+	}
+	return hash & ((1ULL << SIZE_CLASS_SHIFT) - 1);
+}
+
+UINT32 sizeClass(UINT32 size)
+{
+	UINT32 sizeclass = 0;
+	while (size > 1)
+	{
+		size >>= 1;
+		sizeclass++;
+	}
+	return sizeclass;
+}
+
+
+/* ================================================================== */
+// Log parser
+/* ================================================================== */
+
+// Parses the heap event lines the pintool writes:
+//	PID: <pid> | <time> | alloc(0x<size>) = 0x<chunk> from 0x<caller> (<module>)[ [stack <id>]]
+//	PID: <pid> | <time> | realloc|virtualalloc|mmap(0x<size>) at 0x<chunk> from 0x<caller> (<module>)...
+//	PID: <pid> | <time> | free|munmap(0x<chunk>) from 0x<caller> (size was 0x<size>) (<module>)...
+//	PID: <pid> >>> Double Free of 0x<chunk> from 0x<caller> (<module>) <<<
+//	PID: <pid> >>> Use after free: ... (chunk 0x<chunk> + 0x<offset>, size 0x<size>) at 0x<ip> (<module>), ...
+// Pointers are 0x<upper case digits> on Windows, 0x0x<digits> or 0x(nil) on Linux
+class CLineParser
+{
+public:
+	CLineParser()
+	{
+		cachedtext[0] = 0;
+		cachedsecond = 0;
+		lasttime = 0;
+	}
+
+	bool parse(const char * line, const char * end, QUERY_EVENT& ev)
+	{
+		const char * p = line;
+		if (!expect(p, end, "PID: "))
+		{
+			return false;
+		}
+		ev.pid = (UINT32) parseNumber(p, end, 10);
+		ev.size = 0;
+		ev.time = 0;
+		memset(ev.reserved, 0, sizeof(ev.reserved));
+		const char * module;
+		const char * moduleend = stripSuffixes(p, end);
+		if (expect(p, end, " | "))
+		{
+			const char * timeend = find(p, end, " | ");
+			if (timeend == NULL)
+			{
+				// thread start and stop
+				return false;
+			}
+			ev.time = parseTime(p, timeend);
+			lasttime = ev.time;
+			p = timeend + 3;
+			if (expect(p, end, "alloc(0x"))
+			{
+				ev.op = QOP_ALLOC;
+				ev.size = (UINT32) parseNumber(p, end, 16);
+				if (!expect(p, end, ") = 0x"))
+				{
+					return false;
+				}
+				ev.start = parsePointer(p, end);
+			}
+			else if (parseOpName(p, end, ev.op, "realloc(0x", QOP_REALLOC, "virtualalloc(0x", QOP_VIRTUALALLOC, "mmap(0x", QOP_MMAP))
+			{
+				ev.size = (UINT32) parseNumber(p, end, 16);
+				if (!expect(p, end, ") at 0x"))
+				{
+					return false;
+				}
+				ev.start = parsePointer(p, end);
+			}
+			else if (parseOpName(p, end, ev.op, "free(0x", QOP_FREE, "munmap(0x", QOP_MUNMAP, NULL, 0))
+			{
+				ev.start = parsePointer(p, end);
+				if (!expect(p, end, ") from 0x"))
+				{
+					return false;
+				}
+				parsePointer(p, end);
+				if (!expect(p, end, " (size was 0x"))
+				{
+					return false;
+				}
+				ev.size = (UINT32) parseNumber(p, end, 16);
+				if (!expect(p, end, ") ("))
+				{
+					return false;
+				}
+				ev.module = (UINT32) hashModule(p, moduleend);
+				return true;
+			}
+			else
+			{
+				return false;
+			}
+			if (!expect(p, end, " from 0x"))
+			{
+				return false;
+			}
+			parsePointer(p, end);
+			module = p;
+		}
+		else if (expect(p, end, " >>> Double Free of 0x"))
+		{
+			ev.op = QOP_DOUBLE_FREE;
+			ev.time = lasttime;
+			ev.start = parsePointer(p, end);
+			if (!expect(p, end, " from 0x"))
+			{
+				return false;
+			}
+			parsePointer(p, end);
+			module = p;
+		}
+		else if (expect(p, end, " >>> Use after free: "))
+		{
+			ev.op = QOP_USE_AFTER_FREE;
+			ev.time = lasttime;
+			p = find(p, end, "(chunk 0x");
+			if (p == NULL)
+			{
+				return false;
+			}
+			p += 9;
+			ev.start = parsePointer(p, end);
+			const char * size = find(p, end, ", size 0x");
+			const char * at = find(p, end, ") at 0x");
+			moduleend = find(p, end, "), allocated from");
+			if (size == NULL || at == NULL || moduleend == NULL)
+			{
+				return false;
+			}
+			p = size + 9;
+			ev.size = (UINT32) parseNumber(p, end, 16);
+			p = at + 7;
+			parsePointer(p, end);
+			module = p;
+		}
+		else
+		{
+			return false;
+		}
+		if (!expect(module, end, " ("))
+		{
+			return false;
+		}
+		ev.module = (UINT32) hashModule(module, moduleend);
+		return true;
+	}
+
+private:
+	char cachedtext[32];
+	time_t cachedsecond;
+	UINT64 lasttime;			// double frees and use after free reports have no time of their own
+
+	static bool expect(const char *& p, const char * end, const char * text)
+	{
+		size_t len = strlen(text);
+		if ((size_t) (end - p) < len || memcmp(p, text, len) != 0)
+		{
+			return false;
+		}
+		p += len;
+		return true;
+	}
+
+	static bool parseOpName(const char *& p, const char * end, UINT8& op,
+		const char * name1, UINT8 op1, const char * name2, UINT8 op2, const char * name3, UINT8 op3)
+	{
+		if (expect(p, end, name1))
+		{
+			op = op1;
+		}
+		else if (expect(p, end, name2))
+		{
+			op = op2;
+		}
+		else if (name3 != NULL && expect(p, end, name3))
+		{
+			op = op3;
+		}
+		else
+		{
+			return false;
+		}
+		return true;
+	}
+
+	static const char * find(const char * p, const char * end, const char * text)
+	{
+		size_t len = strlen(text);
+		for (; (size_t) (end - p) >= len; p++)
+		{
+			if (*p == *text && memcmp(p, text, len) == 0)
+			{
+				return p;
+			}
+		}
+		return NULL;
+	}
+
+	static UINT64 parseNumber(const char *& p, const char * end, UINT32 base)
+	{
+		UINT64 value = 0;
+		for (; p < end; p++)
+		{
+			UINT32 digit;
+			if (*p >= '0' && *p <= '9')
+			{
+				digit = *p - '0';
+			}
+			else if (base == 16 && *p >= 'a' && *p <= 'f')
+			{
+				digit = *p - 'a' + 10;
+			}
+			else if (base == 16 && *p >= 'A' && *p <= 'F')
+			{
+				digit = *p - 'A' + 10;
+			}
+			else
+			{
+				break;
+			}
+			value = value * base + digit;
+		}
+		return value;
+	}
+
+	// what follows the "0x" of the format
+	static UINT64 parsePointer(const char *& p, const char * end)
+	{
+		if (expect(p, end, "(nil)"))
+		{
+			return 0;
+		}
+		expect(p, end, "0x");
+		return parseNumber(p, end, 16);
+	}
+
+	// end of the module name of a line: before " [stack <id>]", " <<<" and the closing bracket
+	static const char * stripSuffixes(const char * line, const char * end)
+	{
+		if (end > line && end[-1] == ']')
+		{
+			const char * stack = end - 1;
+			while (stack > line && *stack != '[')
+			{
+				stack--;
+			}
+			if (stack - line >= 1 && stack[-1] == ' ')
+			{
+				end = stack - 1;
+			}
+		}
+		if (end - line >= 4 && memcmp(end - 4, " <<<", 4) == 0)
+		{
+			end -= 4;
+		}
+		if (end > line && end[-1] == ')')
+		{
+			end--;
+		}
+		return end;
+	}
+
+	// "Www Mmm dd hh:mm:ss.uuuuuu yyyy" (or without .uuuuuu), in microseconds. The time zone
+	// doesn't matter, only differences between times are used
+	UINT64 parseTime(const char * text, const char * end)
+	{
+		size_t len = end - text;
+		UINT32 us = 0;
+		const char * year = text + 20;
+		if (len >= 31 && text[19] == '.')
+		{
+			const char * p = text + 20;
+			us = (UINT32) parseNumber(p, end, 10);
+			year = text + 27;
+		}
+		else if (len < 24)
+		{
+			return 0;
+		}
+		if (memcmp(cachedtext, text, 19) != 0 || memcmp(cachedtext + 19, year, 4) != 0)
+		{
+			static const char * months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+			struct tm tm;
+			memset(&tm, 0, sizeof(tm));
+			const char * month = strstr(months, std::string(text + 4, 3).c_str());
+			tm.tm_mon = (month != NULL) ? (int) (month - months) / 3 : 0;
+			tm.tm_mday = atoi(std::string(text + 8, 2).c_str());
+			tm.tm_hour = atoi(std::string(text + 11, 2).c_str());
+			tm.tm_min = atoi(std::string(text + 14, 2).c_str());
+			tm.tm_sec = atoi(std::string(text + 17, 2).c_str());
+			tm.tm_year = atoi(std::string(year, 4).c_str()) - 1900;
+			cachedsecond = timegm(&tm);
+			memcpy(cachedtext, text, 19);
+			memcpy(cachedtext + 19, year, 4);
+		}
+		return (UINT64) cachedsecond * 1000000 + us;
+	}
+};
+
+
+/* ================================================================== */
+// Building the index
+/* ================================================================== */
+
+// sorted run of KEY_ENTRYs in a temporary file
+struct RUN
+{
+	int fd;
+	UINT64 first;				// entry number in the file
+	UINT64 count;
+};
+
+bool writeAll(int fd, const void * data, size_t len, UINT64 offset)
+{
+	const char * p = (const char *) data;
+	while (len > 0)
+	{
+		ssize_t written = pwrite(fd, p, len, (off_t) offset);
+		if (written <= 0)
+		{
+			return false;
+		}
+		p += written;
+		len -= written;
+		offset += written;
+	}
+	return true;
+}
+
+bool readAll(int fd, void * data, size_t len, UINT64 offset)
+{
+	char * p = (char *) data;
+	while (len > 0)
+	{
+		ssize_t done = pread(fd, p, len, (off_t) offset);
+		if (done <= 0)
+		{
+			return false;
+		}
+		p += done;
+		len -= done;
+		offset += done;
+	}
+	return true;
+}
+
+// unnamed temporary file next to the index, /tmp may well be in memory
+int tempFile(const std::string& indexName)
+{
+	std::string name = indexName + ".XXXXXX";
+	std::vector<char> path(name.begin(), name.end());
+	path.push_back(0);
+	int fd = mkstemp(&path[0]);
+	if (fd >= 0)
+	{
+		unlink(&path[0]);
+	}
+	return fd;
+}
+
+// parses one part of the log
+class CIndexWorker
+{
+public:
+	void init(const char * log, UINT64 begin, UINT64 end, size_t bufferentries, const std::string& indexName)
+	{
+		this->log = log;
+		this->begin = begin;
+		this->end = end;
+		this->indexName = indexName;
+		nrevents = 0;
+		firsttime = 0;
+		lasttime = 0;
+		failed = false;
+		eventsfd = -1;
+		for (UINT32 i = 0; i < NR_INDEXES; i++)
+		{
+			buffers[i].reserve(bufferentries);
+			runsfd[i] = -1;
+			written[i] = 0;
+		}
+	}
+
+	void run()
+	{
+		eventsfd = tempFile(indexName);
+		for (UINT32 i = 0; i < NR_INDEXES; i++)
+		{
+			runsfd[i] = tempFile(indexName);
+		}
+		std::vector<QUERY_EVENT> events;
+		events.reserve(0x10000);
+		CLineParser parser;
+		const char * p = log + begin;
+		const char * stop = log + end;
+		while (p < stop)
+		{
+			const char * eol = (const char *) memchr(p, '\n', stop - p);
+			if (eol == NULL)
+			{
+				eol = stop;
+			}
+			const char * lineend = (eol > p && eol[-1] == '\r') ? eol - 1 : eol;
+			QUERY_EVENT ev;
+			if (parser.parse(p, lineend, ev))
+			{
+				ev.offset = p - log;
+				add(ev);
+				events.push_back(ev);
+				if (events.size() == events.capacity())
+				{
+					flushEvents(events);
+				}
+			}
+			p = eol + 1;
+		}
+		flushEvents(events);
+		for (UINT32 i = 0; i < NR_INDEXES; i++)
+		{
+			spill(i);
+		}
+	}
+
+	const char * log;
+	UINT64 begin;
+	UINT64 end;
+	std::string indexName;
+	UINT64 nrevents;
+	UINT64 firsttime;
+	UINT64 lasttime;
+	bool failed;
+	int eventsfd;				// QUERY_EVENTs of this part, in log order
+	int runsfd[NR_INDEXES];
+	std::vector<RUN> runs[NR_INDEXES];
+
+private:
+	std::vector<KEY_ENTRY> buffers[NR_INDEXES];
+	UINT64 written[NR_INDEXES];
+
+	void add(const QUERY_EVENT& ev)
+	{
+		addKey(INDEX_ADDRESS, ev.start, ev.offset);
+		if (isAllocOp(ev.op) && ev.size > 0)
+		{
+			addKey(INDEX_COVERAGE, ((UINT64) sizeClass(ev.size) << SIZE_CLASS_SHIFT) | ev.start, ev.offset);
+		}
+		addKey(INDEX_MODULE, ((UINT64) ev.module << 8) | ev.op, ev.offset);
+		if (ev.time != 0)
+		{
+			addKey(INDEX_TIME, ev.time, ev.offset);
+			if (firsttime == 0 || ev.time < firsttime)
+			{
+				firsttime = ev.time;
+			}
+			if (ev.time > lasttime)
+			{
+				lasttime = ev.time;
+			}
+		}
+	}
+
+	void addKey(UINT32 index, UINT64 key, UINT64 offset)
+	{
+		KEY_ENTRY entry = { key, offset };
+		buffers[index].push_back(entry);
+		if (buffers[index].size() == buffers[index].capacity())
+		{
+			spill(index);
+		}
+	}
+
+	// sort what we have and write it out as a run
+	void spill(UINT32 index)
+	{
+		std::vector<KEY_ENTRY>& buffer = buffers[index];
+		if (buffer.empty())
+		{
+			return;
+		}
+		std::sort(buffer.begin(), buffer.end());
+		RUN run = { runsfd[index], written[index], buffer.size() };
+		failed |= !writeAll(run.fd, &buffer[0], buffer.size() * sizeof(KEY_ENTRY), run.first * sizeof(KEY_ENTRY));
+		written[index] += buffer.size();
+		runs[index].push_back(run);
+		buffer.clear();
+	}
+
+	void flushEvents(std::vector<QUERY_EVENT>& events)
+	{
+		if (!events.empty())
+		{
+			failed |= !writeAll(eventsfd, &events[0], events.size() * sizeof(QUERY_EVENT), nrevents * sizeof(QUERY_EVENT));
+			nrevents += events.size();
+			events.clear();
+		}
+	}
+};
+
+
+// reads a run a buffer at a time
+class CRunReader
+{
+public:
+	CRunReader(const RUN& run, size_t bufferentries)
+	{
+		this->run = run;
+		buffer.resize(bufferentries);
+		next = 0;
+		used = 0;
+		done = 0;
+	}
+
+	// false when the run is exhausted
+	bool get(KEY_ENTRY& entry)
+	{
+		if (next == used)
+		{
+			size_t count = (size_t) std::min<UINT64>(buffer.size(), run.count - done);
+			if (count == 0 || !readAll(run.fd, &buffer[0], count * sizeof(KEY_ENTRY), (run.first + done) * sizeof(KEY_ENTRY)))
+			{
+				return false;
+			}
+			done += count;
+			used = count;
+			next = 0;
+		}
+		entry = buffer[next++];
+		return true;
+	}
+
+private:
+	RUN run;
+	std::vector<KEY_ENTRY> buffer;
+	size_t next;
+	size_t used;
+	UINT64 done;
+};
+
+typedef std::pair<KEY_ENTRY, size_t> MERGE_ITEM;
+
+// k-way merge of sorted runs into the index file at offset
+bool mergeRuns(const std::vector<RUN>& runs, int fd, UINT64 offset, size_t memoryentries)
+{
+	// a MB or so per run is plenty for sequential reads
+	size_t bufferentries = std::min<size_t>(0x10000, std::max<size_t>(1024, memoryentries / (runs.size() + 1)));
+	std::vector<CRunReader*> readers;
+	std::priority_queue<MERGE_ITEM, std::vector<MERGE_ITEM>, std::greater<MERGE_ITEM> > heap;
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		readers.push_back(new CRunReader(runs[i], bufferentries));
+		KEY_ENTRY entry;
+		if (readers[i]->get(entry))
+		{
+			heap.push(MERGE_ITEM(entry, i));
+		}
+	}
+	std::vector<KEY_ENTRY> out;
+	out.reserve(bufferentries);
+	bool ok = true;
+	while (!heap.empty() && ok)
+	{
+		MERGE_ITEM item = heap.top();
+		heap.pop();
+		out.push_back(item.first);
+		if (out.size() == out.capacity())
+		{
+			ok = writeAll(fd, &out[0], out.size() * sizeof(KEY_ENTRY), offset);
+			offset += out.size() * sizeof(KEY_ENTRY);
+			out.clear();
+		}
+		KEY_ENTRY entry;
+		if (readers[item.second]->get(entry))
+		{
+			heap.push(MERGE_ITEM(entry, item.second));
+		}
+	}
+	if (ok && !out.empty())
+	{
+		ok = writeAll(fd, &out[0], out.size() * sizeof(KEY_ENTRY), offset);
+	}
+	for (size_t i = 0; i < readers.size(); i++)
+	{
+		delete readers[i];
+	}
+	return ok;
+}
+
+double secondsSince(const struct timespec& start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+bool buildIndex(const char * log, UINT64 logsize, const struct stat& logstat, const std::string& indexName,
+	UINT32 nrthreads, UINT64 memory)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	madvise((void *) log, logsize, MADV_SEQUENTIAL);
+
+	// one part per thread, cut at line boundaries
+	std::vector<CIndexWorker> workers(nrthreads);
+	size_t bufferentries = std::max<size_t>(0x10000, memory / sizeof(KEY_ENTRY) / nrthreads / NR_INDEXES);
+	UINT64 begin = 0;
+	for (UINT32 i = 0; i < nrthreads; i++)
+	{
+		UINT64 end = logsize * (i + 1) / nrthreads;
+		while (end < logsize && log[end - 1] != '\n')
+		{
+			end++;
+		}
+		if (end < begin)
+		{
+			end = begin;
+		}
+		workers[i].init(log, begin, end, bufferentries, indexName);
+		begin = end;
+	}
+	std::vector<std::thread> threads;
+	for (UINT32 i = 0; i < nrthreads; i++)
+	{
+		threads.push_back(std::thread(&CIndexWorker::run, &workers[i]));
+	}
+	for (UINT32 i = 0; i < nrthreads; i++)
+	{
+		threads[i].join();
+	}
+
+	QUERY_INDEX_HEADER header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, QUERY_INDEX_MAGIC, sizeof(header.magic));
+	header.version = QUERY_INDEX_VERSION;
+	header.logsize = logsize;
+	header.logmtime = (UINT64) logstat.st_mtime;
+	std::vector<RUN> runs[NR_INDEXES];
+	bool ok = true;
+	for (UINT32 i = 0; i < nrthreads; i++)
+	{
+		CIndexWorker& worker = workers[i];
+		ok &= !worker.failed;
+		header.nrevents += worker.nrevents;
+		if (worker.firsttime != 0 && (header.firsttime == 0 || worker.firsttime < header.firsttime))
+		{
+			header.firsttime = worker.firsttime;
+		}
+		header.lasttime = std::max(header.lasttime, worker.lasttime);
+		for (UINT32 j = 0; j < NR_INDEXES; j++)
+		{
+			for (size_t k = 0; k < worker.runs[j].size(); k++)
+			{
+				header.counts[j] += worker.runs[j][k].count;
+				runs[j].push_back(worker.runs[j][k]);
+			}
+		}
+	}
+	double parsetime = secondsSince(start);
+
+	// layout: header, events, the sorted tables
+	std::string tempName = indexName + ".tmp";
+	int fd = open(tempName.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Unable to create %s\n", tempName.c_str());
+		return false;
+	}
+	header.eventsoffset = sizeof(header);
+	UINT64 offset = header.eventsoffset + header.nrevents * sizeof(QUERY_EVENT);
+	for (UINT32 i = 0; i < NR_INDEXES; i++)
+	{
+		header.offsets[i] = offset;
+		offset += header.counts[i] * sizeof(KEY_ENTRY);
+	}
+
+	// the event lists of all parts are in log order already
+	std::vector<char> copy(1 << 20);
+	offset = header.eventsoffset;
+	for (UINT32 i = 0; i < nrthreads && ok; i++)
+	{
+		UINT64 size = workers[i].nrevents * sizeof(QUERY_EVENT);
+		for (UINT64 done = 0; done < size && ok; )
+		{
+			size_t part = (size_t) std::min<UINT64>(copy.size(), size - done);
+			ok = readAll(workers[i].eventsfd, &copy[0], part, done) && writeAll(fd, &copy[0], part, offset);
+			done += part;
+			offset += part;
+		}
+	}
+
+	// the tables are merged in parallel, each into its own part of the file
+	std::vector<std::thread> mergers;
+	bool merged[NR_INDEXES];
+	for (UINT32 i = 0; i < NR_INDEXES; i++)
+	{
+		mergers.push_back(std::thread([&, i]() {
+			merged[i] = mergeRuns(runs[i], fd, header.offsets[i], memory / sizeof(KEY_ENTRY) / NR_INDEXES);
+		}));
+	}
+	for (UINT32 i = 0; i < NR_INDEXES; i++)
+	{
+		mergers[i].join();
+		ok &= merged[i];
+	}
+	ok = ok && writeAll(fd, &header, sizeof(header), 0);
+	close(fd);
+	for (UINT32 i = 0; i < nrthreads; i++)
+	{
+		close(workers[i].eventsfd);
+		for (UINT32 j = 0; j < NR_INDEXES; j++)
+		{
+			close(workers[i].runsfd[j]);
+		}
+	}
+	if (!ok || rename(tempName.c_str(), indexName.c_str()) != 0)
+	{
+		fprintf(stderr, "Unable to write %s\n", indexName.c_str());
+		unlink(tempName.c_str());
+		return false;
+	}
+	double total = secondsSince(start);
+	fprintf(stderr, "Indexed %llu events in %.1f MB with %u threads: %.2f s parsing, %.2f s merging (%.0f MB/s)\n",
+		(unsigned long long) header.nrevents, logsize / 1048576.0, nrthreads, parsetime, total - parsetime,
+		logsize / 1048576.0 / total);
+	return true;
+}
+
+
+/* ================================================================== */
+// Queries
+/* ================================================================== */
+
+class CQuery
+{
+public:
+	CQuery()
+	{
+		log = NULL;
+		logsize = 0;
+		index = NULL;
+		indexsize = 0;
+		pid = 0;
+		filterpid = false;
+		results = 0;
+	}
+
+	bool open(const char * logmap, UINT64 size, const std::string& indexName)
+	{
+		log = logmap;
+		logsize = size;
+		int fd = ::open(indexName.c_str(), O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0 || (UINT64) st.st_size < sizeof(QUERY_INDEX_HEADER))
+		{
+			if (fd >= 0)
+			{
+				::close(fd);
+			}
+			return false;
+		}
+		indexsize = st.st_size;
+		index = (const char *) mmap(NULL, indexsize, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (index == MAP_FAILED)
+		{
+			index = NULL;
+			return false;
+		}
+		header = (const QUERY_INDEX_HEADER *) index;
+		events = (const QUERY_EVENT *) (index + header->eventsoffset);
+		for (UINT32 i = 0; i < NR_INDEXES; i++)
+		{
+			tables[i] = (const KEY_ENTRY *) (index + header->offsets[i]);
+		}
+		return true;
+	}
+
+	// the index belongs to this log, as it is now
+	bool isCurrent(const struct stat& logstat) const
+	{
+		return memcmp(header->magic, QUERY_INDEX_MAGIC, sizeof(header->magic)) == 0 &&
+			header->version == QUERY_INDEX_VERSION &&
+			header->logsize == (UINT64) logstat.st_size && header->logmtime == (UINT64) logstat.st_mtime;
+	}
+
+	void close()
+	{
+		if (index != NULL)
+		{
+			munmap((void *) index, indexsize);
+			index = NULL;
+		}
+	}
+
+	void setPid(UINT32 value)
+	{
+		pid = value;
+		filterpid = true;
+	}
+
+	void info()
+	{
+		printf("%llu events", (unsigned long long) header->nrevents);
+		if (header->firsttime != 0)
+		{
+			printf(", %.6f seconds", (header->lasttime - header->firsttime) / 1e6);
+		}
+		printf("\n");
+		static const char * names[NR_INDEXES] = { "address", "coverage", "module", "time" };
+		for (UINT32 i = 0; i < NR_INDEXES; i++)
+		{
+			printf("%-10s %llu entries\n", names[i], (unsigned long long) header->counts[i]);
+		}
+	}
+
+	// every event on every chunk that ever contained address
+	void history(UINT64 address)
+	{
+		std::vector<UINT64> starts;
+		findCovering(address, header->nrevents, starts, false);
+		std::vector<UINT64> offsets;
+		for (size_t i = 0; i < starts.size(); i++)
+		{
+			const KEY_ENTRY* first = lowerBound(INDEX_ADDRESS, starts[i], 0);
+			const KEY_ENTRY* last = lowerBound(INDEX_ADDRESS, starts[i] + 1, 0);
+			for (; first < last; first++)
+			{
+				offsets.push_back(first->offset);
+			}
+		}
+		std::sort(offsets.begin(), offsets.end());
+		for (size_t i = 0; i < offsets.size(); i++)
+		{
+			printEvent(findEvent(offsets[i]));
+		}
+	}
+
+	// the chunks that contained address right after event number at
+	void covering(UINT64 address, UINT64 at)
+	{
+		std::vector<UINT64> starts;
+		findCovering(address, at, starts, true);
+		for (size_t i = 0; i < starts.size(); i++)
+		{
+			printEvent(lastEvent(starts[i], at));
+		}
+	}
+
+	// operations from a module, in log order
+	void byModule(const char * module, bool frees)
+	{
+		UINT64 hash = (UINT32) hashModule(module, module + strlen(module));
+		std::vector<UINT64> offsets;
+		for (UINT32 op = 0; op < QOP_LAST; op++)
+		{
+			if (frees ? !isFreeOp(op) : !isAllocOp(op))
+			{
+				continue;
+			}
+			UINT64 key = (hash << 8) | op;
+			const KEY_ENTRY* first = lowerBound(INDEX_MODULE, key, 0);
+			const KEY_ENTRY* last = lowerBound(INDEX_MODULE, key + 1, 0);
+			for (; first < last; first++)
+			{
+				offsets.push_back(first->offset);
+			}
+		}
+		std::sort(offsets.begin(), offsets.end());
+		for (size_t i = 0; i < offsets.size(); i++)
+		{
+			printEvent(findEvent(offsets[i]));
+		}
+	}
+
+	// events in [from, to], in seconds since the first event
+	void timeRange(double from, double to)
+	{
+		if (header->firsttime == 0)
+		{
+			fprintf(stderr, "The log has no timestamps, use -timestamp 1\n");
+			return;
+		}
+		const KEY_ENTRY* first = lowerBound(INDEX_TIME, toTime(from), 0);
+		const KEY_ENTRY* last = lowerBound(INDEX_TIME, toTime(to) + 1, 0);
+		for (; first < last; first++)
+		{
+			printEvent(findEvent(first->offset));
+		}
+	}
+
+	// number of the last event at or before a time
+	UINT64 eventAtTime(double seconds)
+	{
+		const KEY_ENTRY* last = lowerBound(INDEX_TIME, toTime(seconds) + 1, 0);
+		if (last == tables[INDEX_TIME])
+		{
+			return 0;
+		}
+		return findEvent(last[-1].offset);
+	}
+
+	UINT64 getNrEvents() const
+	{
+		return header->nrevents;
+	}
+
+	UINT64 getResults() const
+	{
+		return results;
+	}
+
+private:
+	const char * log;
+	UINT64 logsize;
+	const char * index;
+	UINT64 indexsize;
+	const QUERY_INDEX_HEADER* header;
+	const QUERY_EVENT* events;
+	const KEY_ENTRY* tables[NR_INDEXES];
+	UINT32 pid;
+	bool filterpid;
+	UINT64 results;
+
+	UINT64 toTime(double seconds) const
+	{
+		return header->firsttime + (UINT64) (seconds * 1e6);
+	}
+
+	const KEY_ENTRY* lowerBound(UINT32 table, UINT64 key, UINT64 offset) const
+	{
+		KEY_ENTRY entry = { key, offset };
+		return std::lower_bound(tables[table], tables[table] + header->counts[table], entry);
+	}
+
+	// event number of the event at a log offset
+	UINT64 findEvent(UINT64 offset) const
+	{
+		UINT64 low = 0;
+		UINT64 high = header->nrevents;
+		while (low < high)
+		{
+			UINT64 middle = (low + high) / 2;
+			if (events[middle].offset < offset)
+			{
+				low = middle + 1;
+			}
+			else
+			{
+				high = middle;
+			}
+		}
+		return low;
+	}
+
+	bool wanted(const QUERY_EVENT& ev) const
+	{
+		return !filterpid || ev.pid == pid;
+	}
+
+	// number of the last event on the chunk at start, up to and including event at. nrevents if there is none
+	UINT64 lastEvent(UINT64 start, UINT64 at) const
+	{
+		UINT64 atoffset = (at < header->nrevents) ? events[at].offset : logsize;
+		const KEY_ENTRY* first = lowerBound(INDEX_ADDRESS, start, 0);
+		const KEY_ENTRY* last = lowerBound(INDEX_ADDRESS, start, atoffset + 1);
+		while (last > first)
+		{
+			last--;
+			UINT64 number = findEvent(last->offset);
+			if (wanted(events[number]) && events[number].op != QOP_USE_AFTER_FREE)
+			{
+				return number;
+			}
+		}
+		return header->nrevents;
+	}
+
+	// starts of the chunks that contained address. If live is true, only the ones that were
+	// allocated (and not freed) right after event at, otherwise all that ever contained it.
+	// A chunk of size class c starts less than 2^(c+1) bytes before the address
+	void findCovering(UINT64 address, UINT64 at, std::vector<UINT64>& starts, bool live) const
+	{
+		std::vector<UINT64> candidates;
+		for (UINT64 sizeclass = 0; sizeclass < 32; sizeclass++)
+		{
+			UINT64 reach = 2ULL << sizeclass;
+			UINT64 low = (address >= reach) ? address - reach + 1 : 0;
+			const KEY_ENTRY* first = lowerBound(INDEX_COVERAGE, (sizeclass << SIZE_CLASS_SHIFT) | low, 0);
+			const KEY_ENTRY* last = lowerBound(INDEX_COVERAGE, (sizeclass << SIZE_CLASS_SHIFT) | (address + 1), 0);
+			for (; first < last; first++)
+			{
+				UINT64 start = first->key & ((1ULL << SIZE_CLASS_SHIFT) - 1);
+				if (!candidates.empty() && candidates.back() == start)
+				{
+					continue;
+				}
+				if (!live)
+				{
+					const QUERY_EVENT& ev = events[findEvent(first->offset)];
+					if (!wanted(ev) || ev.start + ev.size <= address)
+					{
+						continue;
+					}
+				}
+				candidates.push_back(start);
+			}
+		}
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+		if (!live)
+		{
+			starts = candidates;
+			if (!std::binary_search(starts.begin(), starts.end(), address))
+			{
+				// frees of chunks we never saw allocated
+				starts.insert(std::lower_bound(starts.begin(), starts.end(), address), address);
+			}
+			return;
+		}
+		for (size_t i = 0; i < candidates.size(); i++)
+		{
+			UINT64 number = lastEvent(candidates[i], at);
+			if (number < header->nrevents && isAllocOp(events[number].op) &&
+				events[number].start + events[number].size > address)
+			{
+				starts.push_back(candidates[i]);
+			}
+		}
+	}
+
+	void printEvent(UINT64 number)
+	{
+		if (number >= header->nrevents || !wanted(events[number]))
+		{
+			return;
+		}
+		const char * line = log + events[number].offset;
+		const char * end = (const char *) memchr(line, '\n', logsize - events[number].offset);
+		size_t len = (end != NULL) ? end - line : logsize - events[number].offset;
+		if (len > 0 && line[len - 1] == '\r')
+		{
+			len--;
+		}
+		printf("%10llu  %.*s\n", (unsigned long long) number, (int) len, line);
+		results++;
+	}
+};
+
+
+int usage(const char * name)
+{
+	fprintf(stderr, "usage: %s [-threads <n>] [-memory <MB>] [-at <event>] [-attime <seconds>] [-pid <pid>] <log> <query>\n"
+		"queries: build, info, history <address>, covering <address>, frees <module>, allocs <module>, time <from> [<to>]\n", name);
+	return 1;
+}
+
+int main(int argc, char* argv[])
+{
+	UINT32 nrthreads = std::thread::hardware_concurrency();
+	UINT64 memory = 1024;
+	UINT64 at = ~(UINT64) 0;
+	double attime = -1;
+	bool filterpid = false;
+	UINT32 pid = 0;
+	int i = 1;
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2)
+	{
+		if (strcmp(argv[i], "-threads") == 0)
+		{
+			nrthreads = strtoul(argv[i + 1], NULL, 0);
+		}
+		else if (strcmp(argv[i], "-memory") == 0)
+		{
+			memory = strtoull(argv[i + 1], NULL, 0);
+		}
+		else if (strcmp(argv[i], "-at") == 0)
+		{
+			at = strtoull(argv[i + 1], NULL, 0);
+		}
+		else if (strcmp(argv[i], "-attime") == 0)
+		{
+			attime = atof(argv[i + 1]);
+		}
+		else if (strcmp(argv[i], "-pid") == 0)
+		{
+			pid = strtoul(argv[i + 1], NULL, 0);
+			filterpid = true;
+		}
+		else
+		{
+			return usage(argv[0]);
+		}
+	}
+	if (argc - i < 2)
+	{
+		return usage(argv[0]);
+	}
+	const char * logName = argv[i];
+	std::string query = argv[i + 1];
+	char ** args = argv + i + 2;
+	int nrargs = argc - i - 2;
+	nrthreads = std::max<UINT32>(nrthreads, 1);
+	memory = std::max<UINT64>(memory, 16) << 20;
+
+	int fd = open(logName, O_RDONLY);
+	struct stat logstat;
+	if (fd < 0 || fstat(fd, &logstat) != 0 || logstat.st_size == 0)
+	{
+		fprintf(stderr, "Unable to open %s\n", logName);
+		return 1;
+	}
+	UINT64 logsize = logstat.st_size;
+	const char * log = (const char *) mmap(NULL, logsize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (log == MAP_FAILED)
+	{
+		fprintf(stderr, "Unable to map %s\n", logName);
+		return 1;
+	}
+
+	std::string indexName = std::string(logName) + ".qidx";
+	CQuery q;
+	bool current = q.open(log, logsize, indexName) && q.isCurrent(logstat);
+	if (!current || query == "build")
+	{
+		q.close();
+		if (!buildIndex(log, logsize, logstat, indexName, nrthreads, memory) || !q.open(log, logsize, indexName))
+		{
+			return 1;
+		}
+	}
+	if (filterpid)
+	{
+		q.setPid(pid);
+	}
+	if (attime >= 0)
+	{
+		at = q.eventAtTime(attime);
+	}
+	if (at >= q.getNrEvents() && q.getNrEvents() > 0)
+	{
+		at = q.getNrEvents() - 1;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (query == "build")
+	{
+		return 0;
+	}
+	else if (query == "info")
+	{
+		q.info();
+		return 0;
+	}
+	else if (query == "history" && nrargs == 1)
+	{
+		q.history(strtoull(args[0], NULL, 16));
+	}
+	else if (query == "covering" && nrargs == 1)
+	{
+		q.covering(strtoull(args[0], NULL, 16), at);
+	}
+	else if ((query == "frees" || query == "allocs") && nrargs == 1)
+	{
+		q.byModule(args[0], query == "frees");
+	}
+	else if (query == "time" && (nrargs == 1 || nrargs == 2))
+	{
+		q.timeRange(atof(args[0]), nrargs == 2 ? atof(args[1]) : 1e12);
+	}
+	else
+	{
+		return usage(argv[0]);
+	}
+	fprintf(stderr, "%llu events in %.3f ms\n", (unsigned long long) q.getResults(), secondsSince(start) * 1e3);
+	return 0;
+}
@@ -0,0 +1,456 @@
+/*
+	Replays an allocation trace written by Corelan_HeapLog with -recordtrace 1 against an
+	allocator, and reports throughput, peak RSS and fragmentation
+
+	Every thread of the traced process gets a replay thread that runs its operations in their
+	original order. An operation on an object waits until the operation before it on the same
+	object is done, whichever thread did that, so the replay follows the trace even when
+	objects are freed by another thread than the one that allocated them. Without -notouch,
+	every allocated chunk is written to once per page, like an application that uses its memory,
+	so the resident size reflects what the allocator really costs.
+
+	The allocator is the malloc of the process: glibc, or whatever is preloaded
+		LD_PRELOAD=/usr/lib/x86_64-linux-gnu/libjemalloc.so.2 heaplog_replay app.trace
+	or one loaded with -lib, whose functions are called directly (with -prefix, for builds that
+	export je_malloc and the like)
+
+	Fragmentation is the growth of the resident size over the replay, divided by the bytes the
+	trace had live at that point: 1.00 means no overhead at all.
+
+	usage: heaplog_replay [-lib <allocator.so>] [-prefix <symbol prefix>] [-notouch] <trace>
+
+	Same license as Corelan_HeapLog.cpp
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <emmintrin.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+
+#include "AllocTrace.h"
+
+#define TOUCH_STRIDE 4096		// bytes between two writes to a new chunk
+#define SPIN_BEFORE_YIELD 64	// pause loops while waiting for another thread, before giving up the cpu
+
+
+// The allocator being measured. Every allocation of the replay goes through here
+struct REPLAY_ALLOCATOR
+{
+	std::string name;
+	void* (*allocate)(size_t size);
+	void* (*allocateZeroed)(size_t count, size_t size);
+	void* (*reallocate)(void* chunk, size_t size);
+	int (*allocateAligned)(void** chunk, size_t alignment, size_t size);
+	void (*release)(void* chunk);
+};
+
+void useProcessMalloc(REPLAY_ALLOCATOR& allocator)
+{
+	const char * preload = getenv("LD_PRELOAD");
+	allocator.name = (preload != NULL && preload[0] != 0) ? std::string("malloc of LD_PRELOAD=") + preload : "malloc of the C library";
+	allocator.allocate = malloc;
+	allocator.allocateZeroed = calloc;
+	allocator.reallocate = realloc;
+	allocator.allocateAligned = posix_memalign;
+	allocator.release = free;
+}
+
+bool loadAllocator(REPLAY_ALLOCATOR& allocator, const char * library, const std::string& prefix)
+{
+	void* handle = dlopen(library, RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL)
+	{
+		fprintf(stderr, "Unable to load %s: %s\n", library, dlerror());
+		return false;
+	}
+	allocator.name = std::string(library) + (prefix.empty() ? "" : " (" + prefix + "*)");
+	allocator.allocate = (void* (*)(size_t)) dlsym(handle, (prefix + "malloc").c_str());
+	allocator.allocateZeroed = (void* (*)(size_t, size_t)) dlsym(handle, (prefix + "calloc").c_str());
+	allocator.reallocate = (void* (*)(void*, size_t)) dlsym(handle, (prefix + "realloc").c_str());
+	allocator.allocateAligned = (int (*)(void**, size_t, size_t)) dlsym(handle, (prefix + "posix_memalign").c_str());
+	allocator.release = (void (*)(void*)) dlsym(handle, (prefix + "free").c_str());
+	if (allocator.allocate == NULL || allocator.allocateZeroed == NULL || allocator.reallocate == NULL ||
+		allocator.allocateAligned == NULL || allocator.release == NULL)
+	{
+		fprintf(stderr, "%s doesn't export %smalloc, %scalloc, %srealloc, %sposix_memalign and %sfree\n", library,
+			prefix.c_str(), prefix.c_str(), prefix.c_str(), prefix.c_str(), prefix.c_str());
+		return false;
+	}
+	return true;
+}
+
+
+// an object of the trace, while it's being replayed
+struct REPLAY_OBJECT
+{
+	std::atomic<UINT32> done;	// operations on this object that have been replayed
+	UINT32 size;
+	void* chunk;
+};
+
+struct REPLAY_THREAD
+{
+	std::vector<UINT64> records;	// in the trace, in order
+	UINT64 failed;					// allocations that returned NULL
+	UINT64 pad[7];					// keep the counters of two threads on separate cache lines
+};
+
+std::vector<ALLOC_TRACE_RECORD> traceRecords;
+std::vector<UINT32> objectStep;		// per record, number of the operation on its object
+REPLAY_OBJECT* objects;
+REPLAY_ALLOCATOR allocator;
+bool touchMemory = true;
+pthread_barrier_t startBarrier;
+
+
+bool readTrace(const char * fileName, ALLOC_TRACE_HEADER& header)
+{
+	FILE* file = fopen(fileName, "rb");
+	if (file == NULL || fread(&header, sizeof(header), 1, file) != 1 ||
+		memcmp(header.magic, ALLOC_TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != ALLOC_TRACE_VERSION)
+	{
+		fprintf(stderr, "%s is not an allocation trace written by Corelan_HeapLog\n", fileName);
+		return false;
+	}
+	if (header.nrrecords == 0)
+	{
+		// not closed properly, take whatever is there
+		fseeko(file, 0, SEEK_END);
+		header.nrrecords = (ftello(file) - sizeof(header)) / sizeof(ALLOC_TRACE_RECORD);
+		fseeko(file, sizeof(header), SEEK_SET);
+		fprintf(stderr, "The trace wasn't closed properly, replaying the %llu records in it\n", (unsigned long long) header.nrrecords);
+	}
+	traceRecords.resize(header.nrrecords);
+	size_t nrread = header.nrrecords > 0 ? fread(&traceRecords[0], sizeof(ALLOC_TRACE_RECORD), traceRecords.size(), file) : 0;
+	fclose(file);
+	traceRecords.resize(nrread);
+	return true;
+}
+
+
+// check the trace, and work out what every thread does and what the live size was.
+// Records that don't fit (an object used before or after its life) are dropped
+void prepareReplay(ALLOC_TRACE_HEADER& header, std::vector<REPLAY_THREAD>& threads, UINT64& peaklive, UINT64& endlive)
+{
+	UINT64 nrobjects = header.nrobjects;
+	for (size_t i = 0; i < traceRecords.size(); i++)
+	{
+		if (traceRecords[i].objectid > nrobjects)
+		{
+			nrobjects = traceRecords[i].objectid;
+		}
+	}
+	// only 0 if the trace wasn't closed
+	header.nrobjects = nrobjects;
+	objects = new REPLAY_OBJECT[nrobjects + 1];
+	for (UINT64 id = 0; id <= nrobjects; id++)
+	{
+		objects[id].done = 0;
+		objects[id].size = 0;
+		objects[id].chunk = NULL;
+	}
+	std::vector<UINT8> alive(nrobjects + 1, 0);
+	objectStep.resize(traceRecords.size());
+	threads.resize(header.nrthreads);
+
+	UINT64 live = 0;
+	UINT64 dropped = 0;
+	peaklive = 0;
+	for (size_t i = 0; i < traceRecords.size(); i++)
+	{
+		const ALLOC_TRACE_RECORD& record = traceRecords[i];
+		REPLAY_OBJECT& object = objects[record.objectid];
+		bool isalloc = (record.op == TRACE_MALLOC || record.op == TRACE_CALLOC);
+		// an object is allocated once, and only used while it's alive
+		bool valid = (record.objectid != 0 && record.op <= TRACE_FREE) &&
+			(isalloc ? object.done == 0 : alive[record.objectid] != 0);
+		if (!valid)
+		{
+			dropped++;
+			continue;
+		}
+		objectStep[i] = object.done++;
+		live -= alive[record.objectid] ? object.size : 0;
+		alive[record.objectid] = (record.op != TRACE_FREE);
+		object.size = record.size;
+		live += alive[record.objectid] ? record.size : 0;
+		if (live > peaklive)
+		{
+			peaklive = live;
+		}
+		if (record.thread >= threads.size())
+		{
+			threads.resize(record.thread + 1);
+		}
+		threads[record.thread].records.push_back(i);
+	}
+	endlive = live;
+	// the counting starts over for the replay
+	for (UINT64 id = 0; id <= nrobjects; id++)
+	{
+		objects[id].done = 0;
+		objects[id].size = 0;
+	}
+	if (dropped > 0)
+	{
+		fprintf(stderr, "Dropped %llu records that don't match the life of their object\n", (unsigned long long) dropped);
+	}
+}
+
+
+void touch(void* chunk, size_t from, size_t to)
+{
+	if (!touchMemory || chunk == NULL)
+	{
+		return;
+	}
+	for (size_t offset = from; offset < to; offset += TOUCH_STRIDE)
+	{
+		((volatile char *) chunk)[offset] = 1;
+	}
+}
+
+// wait until the operations on an object that come before step are done, by any thread
+void waitForStep(REPLAY_OBJECT& object, UINT32 step)
+{
+	for (UINT32 spins = 0; object.done.load(std::memory_order_acquire) != step; spins++)
+	{
+		if (spins < SPIN_BEFORE_YIELD)
+		{
+			_mm_pause();
+		}
+		else
+		{
+			sched_yield();
+		}
+	}
+}
+
+void* replayThread(void* param)
+{
+	REPLAY_THREAD* thread = (REPLAY_THREAD*) param;
+	pthread_barrier_wait(&startBarrier);
+	for (size_t i = 0; i < thread->records.size(); i++)
+	{
+		UINT64 index = thread->records[i];
+		const ALLOC_TRACE_RECORD& record = traceRecords[index];
+		REPLAY_OBJECT& object = objects[record.objectid];
+		UINT32 step = objectStep[index];
+		if (step > 0)
+		{
+			waitForStep(object, step);
+		}
+		void* chunk = NULL;
+		switch (record.op)
+		{
+		case TRACE_MALLOC:
+			if (record.alignshift > 0 && ((size_t) 1 << record.alignshift) >= sizeof(void*))
+			{
+				if (allocator.allocateAligned(&chunk, (size_t) 1 << record.alignshift, record.size) != 0)
+				{
+					chunk = NULL;
+				}
+			}
+			else
+			{
+				chunk = allocator.allocate(record.size);
+			}
+			touch(chunk, 0, record.size);
+			break;
+		case TRACE_CALLOC:
+			chunk = allocator.allocateZeroed(1, record.size);
+			touch(chunk, 0, record.size);
+			break;
+		case TRACE_REALLOC:
+			chunk = allocator.reallocate(object.chunk, record.size);
+			if (chunk == NULL && record.size > 0)
+			{
+				// the old chunk is still there
+				chunk = object.chunk;
+				thread->failed++;
+				break;
+			}
+			// only the part that grew is new
+			touch(chunk, object.size, record.size);
+			break;
+		case TRACE_FREE:
+			allocator.release(object.chunk);
+			break;
+		}
+		if (chunk == NULL && record.op != TRACE_FREE && record.op != TRACE_REALLOC && record.size > 0)
+		{
+			thread->failed++;
+		}
+		object.chunk = chunk;
+		object.size = record.size;
+		object.done.store(step + 1, std::memory_order_release);
+	}
+	return NULL;
+}
+
+
+// "VmRSS:" or "VmHWM:" of this process, in bytes
+UINT64 readMemoryStatus(const char * field)
+{
+	FILE* file = fopen("/proc/self/status", "r");
+	if (file == NULL)
+	{
+		return 0;
+	}
+	char line[256];
+	unsigned long long kb = 0;
+	size_t length = strlen(field);
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		if (strncmp(line, field, length) == 0)
+		{
+			kb = strtoull(line + length, NULL, 10);
+			break;
+		}
+	}
+	fclose(file);
+	return kb * 1024;
+}
+
+// start measuring the peak resident size from here, false if the kernel can't
+bool resetPeakMemory()
+{
+	FILE* file = fopen("/proc/self/clear_refs", "w");
+	if (file == NULL)
+	{
+		return false;
+	}
+	bool done = (fputs("5", file) >= 0);
+	return (fclose(file) == 0) && done;
+}
+
+double megabytes(UINT64 bytes)
+{
+	return bytes / (1024.0 * 1024.0);
+}
+
+
+int main(int argc, char* argv[])
+{
+	const char * library = NULL;
+	std::string prefix;
+	const char * fileName = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-lib") == 0 && i + 1 < argc)
+		{
+			library = argv[++i];
+		}
+		else if (strcmp(argv[i], "-prefix") == 0 && i + 1 < argc)
+		{
+			prefix = argv[++i];
+		}
+		else if (strcmp(argv[i], "-notouch") == 0)
+		{
+			touchMemory = false;
+		}
+		else if (fileName == NULL && argv[i][0] != '-')
+		{
+			fileName = argv[i];
+		}
+		else
+		{
+			fileName = NULL;
+			break;
+		}
+	}
+	if (fileName == NULL)
+	{
+		fprintf(stderr, "usage: %s [-lib <allocator.so>] [-prefix <symbol prefix>] [-notouch] <trace>\n", argv[0]);
+		return 1;
+	}
+
+	if (library != NULL)
+	{
+		if (!loadAllocator(allocator, library, prefix))
+		{
+			return 1;
+		}
+	}
+	else
+	{
+		useProcessMalloc(allocator);
+	}
+
+	ALLOC_TRACE_HEADER header;
+	std::vector<REPLAY_THREAD> threads;
+	UINT64 peaklive, endlive;
+	if (!readTrace(fileName, header))
+	{
+		return 1;
+	}
+	prepareReplay(header, threads, peaklive, endlive);
+	UINT32 nrthreads = 0;
+	for (size_t t = 0; t < threads.size(); t++)
+	{
+		nrthreads += threads[t].records.empty() ? 0 : 1;
+	}
+	printf("Trace: %s, pid %u, %llu operations on %llu objects by %u threads\n", fileName, header.pid,
+		(unsigned long long) traceRecords.size(), (unsigned long long) header.nrobjects, nrthreads);
+	printf("Allocator: %s\n", allocator.name.c_str());
+
+	// what the process uses before the replay doesn't count
+	bool peakreset = resetPeakMemory();
+	UINT64 baseline = readMemoryStatus("VmRSS:");
+
+	std::vector<pthread_t> handles;
+	pthread_barrier_init(&startBarrier, NULL, nrthreads + 1);
+	for (size_t t = 0; t < threads.size(); t++)
+	{
+		if (!threads[t].records.empty())
+		{
+			threads[t].failed = 0;
+			pthread_t handle;
+			pthread_create(&handle, NULL, replayThread, &threads[t]);
+			handles.push_back(handle);
+		}
+	}
+	struct timespec start, end;
+	pthread_barrier_wait(&startBarrier);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t t = 0; t < handles.size(); t++)
+	{
+		pthread_join(handles[t], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_barrier_destroy(&startBarrier);
+
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	UINT64 failed = 0;
+	for (size_t t = 0; t < threads.size(); t++)
+	{
+		failed += threads[t].records.empty() ? 0 : threads[t].failed;
+	}
+	UINT64 peak = readMemoryStatus("VmHWM:");
+	UINT64 current = readMemoryStatus("VmRSS:");
+	UINT64 peakgrowth = peak > baseline ? peak - baseline : 0;
+	UINT64 endgrowth = current > baseline ? current - baseline : 0;
+
+	printf("Replay: %.3f s, %.2f M operations/s, %llu failed allocations%s\n", seconds,
+		traceRecords.size() / seconds / 1e6, (unsigned long long) failed, touchMemory ? "" : ", memory not touched");
+	printf("Peak: %.1f MB live, resident size +%.1f MB%s, fragmentation %.2f\n", megabytes(peaklive), megabytes(peakgrowth),
+		peakreset ? "" : " (includes loading the trace)", peaklive > 0 ? (double) peakgrowth / peaklive : 0.0);
+	printf("End: %.1f MB live, resident size +%.1f MB, fragmentation %.2f\n", megabytes(endlive), megabytes(endgrowth),
+		endlive > 0 ? (double) endgrowth / endlive : 0.0);
+	return 0;
+}
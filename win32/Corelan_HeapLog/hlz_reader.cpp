@@ -0,0 +1,231 @@
+/*
+	Reader for the block compressed log files Corelan_HeapLog writes with -compress 1
+
+	Without options, the whole log is decompressed to stdout. With -from and/or -to, only
+	the blocks with heap events in that time range are decompressed, and with -address
+	only the blocks that logged a chunk containing the address. Both work a block at a time,
+	so some lines just outside the range are shown as well. -index lists the blocks.
+
+	usage: hlz_reader [-index] [-from <seconds>] [-to <seconds>] [-address <address>] <file.hlz>
+	Times are in seconds (with fractions) since the first heap event in the file.
+
+	Same license as Corelan_HeapLog.cpp
+*/
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+typedef uint8_t UINT8;
+typedef uint32_t UINT32;
+typedef int64_t INT64;
+typedef uint64_t UINT64;
+
+#include "BlockFile.h"
+
+
+// blocks of the file, from the index or by walking them if the index is missing
+bool readBlockList(FILE* file, const BLOCK_FILE_HEADER& header, std::vector<BLOCK_INDEX_ENTRY>& blocks)
+{
+	BLOCK_FILE_TRAILER trailer;
+	if (fseeko(file, -(off_t) sizeof(trailer), SEEK_END) == 0 &&
+		fread(&trailer, sizeof(trailer), 1, file) == 1 &&
+		memcmp(trailer.magic, BLOCK_FILE_TRAILER_MAGIC, sizeof(trailer.magic)) == 0)
+	{
+		blocks.resize(trailer.nrblocks);
+		if (trailer.nrblocks == 0 ||
+			(fseeko(file, (off_t) trailer.indexoffset, SEEK_SET) == 0 &&
+			fread(&blocks[0], sizeof(BLOCK_INDEX_ENTRY), blocks.size(), file) == blocks.size()))
+		{
+			return true;
+		}
+		blocks.clear();
+	}
+
+	fprintf(stderr, "No block index, the log was not closed properly. Walking the blocks instead\n");
+	UINT64 offset = sizeof(BLOCK_FILE_HEADER);
+	BLOCK_INDEX_ENTRY entry;
+	while (fseeko(file, (off_t) offset, SEEK_SET) == 0 && fread(&entry.header, sizeof(entry.header), 1, file) == 1)
+	{
+		if (entry.header.rawsize == 0 || entry.header.rawsize > header.blocksize ||
+			entry.header.compressedsize > entry.header.rawsize)
+		{
+			break;
+		}
+		entry.offset = offset;
+		offset += sizeof(entry.header) + entry.header.compressedsize;
+		blocks.push_back(entry);
+	}
+	// the last block may have been cut off
+	fseeko(file, 0, SEEK_END);
+	while (!blocks.empty() && blocks.back().offset + sizeof(BLOCK_HEADER) + blocks.back().header.compressedsize > (UINT64) ftello(file))
+	{
+		blocks.pop_back();
+	}
+	return !blocks.empty();
+}
+
+
+bool readBlock(FILE* file, const BLOCK_INDEX_ENTRY& entry, std::vector<UINT8>& compressed, std::vector<char>& text)
+{
+	compressed.resize(entry.header.compressedsize);
+	text.resize(entry.header.rawsize);
+	if (fseeko(file, (off_t) (entry.offset + sizeof(BLOCK_HEADER)), SEEK_SET) != 0 ||
+		fread(&compressed[0], 1, compressed.size(), file) != compressed.size())
+	{
+		return false;
+	}
+	if (entry.header.compressedsize == entry.header.rawsize)
+	{
+		memcpy(&text[0], &compressed[0], text.size());
+		return true;
+	}
+	return lzDecompress(&compressed[0], compressed.size(), (UINT8*) &text[0], text.size());
+}
+
+
+void printTime(UINT64 time)
+{
+	if (time == 0)
+	{
+		printf("%-26s", "-");
+		return;
+	}
+	time_t second = (time_t) (time / 1000000);
+	char text[32];
+	strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", localtime(&second));
+	printf("%s.%06u ", text, (UINT32) (time % 1000000));
+}
+
+
+void printIndex(const std::vector<BLOCK_INDEX_ENTRY>& blocks)
+{
+	UINT64 rawbytes = 0;
+	UINT64 compressedbytes = 0;
+	printf("%8s %14s %10s %10s %-26s %-26s %s\n", "block", "offset", "raw", "compressed", "first event", "last event", "addresses");
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		const BLOCK_HEADER& header = blocks[i].header;
+		printf("%8u %14llu %10u %10u ", (UINT32) i, (unsigned long long) blocks[i].offset, header.rawsize, header.compressedsize);
+		printTime(header.meta.firsttime);
+		printTime(header.meta.lasttime);
+		if (header.meta.maxaddr != 0)
+		{
+			printf("0x%llx-0x%llx", (unsigned long long) header.meta.minaddr, (unsigned long long) header.meta.maxaddr);
+		}
+		printf("\n");
+		rawbytes += header.rawsize;
+		compressedbytes += sizeof(BLOCK_HEADER) + header.compressedsize;
+	}
+	printf("%u blocks, %llu bytes of text in %llu bytes (ratio %.2f)\n", (UINT32) blocks.size(),
+		(unsigned long long) rawbytes, (unsigned long long) compressedbytes,
+		compressedbytes > 0 ? (double) rawbytes / compressedbytes : 0.0);
+}
+
+
+int main(int argc, char* argv[])
+{
+	bool showindex = false;
+	double from = -1;
+	double to = -1;
+	UINT64 address = 0;
+	bool byaddress = false;
+	const char * fileName = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-index") == 0)
+		{
+			showindex = true;
+		}
+		else if (strcmp(argv[i], "-from") == 0 && i + 1 < argc)
+		{
+			from = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-to") == 0 && i + 1 < argc)
+		{
+			to = atof(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-address") == 0 && i + 1 < argc)
+		{
+			address = strtoull(argv[++i], NULL, 16);
+			byaddress = true;
+		}
+		else if (fileName == NULL && argv[i][0] != '-')
+		{
+			fileName = argv[i];
+		}
+		else
+		{
+			fileName = NULL;
+			break;
+		}
+	}
+	if (fileName == NULL)
+	{
+		fprintf(stderr, "usage: %s [-index] [-from <seconds>] [-to <seconds>] [-address <address>] <file.hlz>\n", argv[0]);
+		return 1;
+	}
+
+	FILE* file = fopen(fileName, "rb");
+	BLOCK_FILE_HEADER header;
+	if (file == NULL || fread(&header, sizeof(header), 1, file) != 1 ||
+		memcmp(header.magic, BLOCK_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != BLOCK_FILE_VERSION)
+	{
+		fprintf(stderr, "%s is not a compressed Corelan_HeapLog log file\n", fileName);
+		return 1;
+	}
+	std::vector<BLOCK_INDEX_ENTRY> blocks;
+	if (!readBlockList(file, header, blocks))
+	{
+		fprintf(stderr, "No blocks found in %s\n", fileName);
+		return 1;
+	}
+	if (showindex)
+	{
+		printIndex(blocks);
+		return 0;
+	}
+
+	// times are relative to the first heap event
+	UINT64 start = 0;
+	for (size_t i = 0; i < blocks.size() && start == 0; i++)
+	{
+		start = blocks[i].header.meta.firsttime;
+	}
+	UINT64 fromtime = (from >= 0) ? start + (UINT64) (from * 1e6) : 0;
+	UINT64 totime = (to >= 0) ? start + (UINT64) (to * 1e6) : ~(UINT64) 0;
+	bool filtered = (from >= 0 || to >= 0 || byaddress);
+
+	std::vector<UINT8> compressed;
+	std::vector<char> text;
+	bool previous = false;			// the previous block was shown
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		const BLOCK_META& meta = blocks[i].header.meta;
+		bool show = !filtered ||
+			(meta.firsttime != 0 && meta.firsttime <= totime && meta.lasttime >= fromtime &&
+			(!byaddress || (meta.minaddr <= address && address < meta.maxaddr)));
+		if (!show && !previous)
+		{
+			continue;
+		}
+		if (!readBlock(file, blocks[i], compressed, text))
+		{
+			fprintf(stderr, "Block %u at offset %llu is damaged\n", (UINT32) i, (unsigned long long) blocks[i].offset);
+			return 1;
+		}
+		// a block may start and end in the middle of a line, show whole lines only
+		size_t begin = (previous || i == 0) ? 0 : blocks[i].header.linestart;
+		size_t end = show ? text.size() : blocks[i].header.linestart;
+		fwrite(&text[0] + begin, 1, end - begin, stdout);
+		// keep going if the line didn't end in this block
+		previous = show || end == text.size();
+	}
+	fclose(file);
+	return 0;
+}